@@ -0,0 +1,586 @@
+/* atlaspack.c
+ * packs the sprites of many sheets into one power-of-two atlas.
+ *
+ * each sheet (grayscale or indexed PNG, or CHR as 8x8 2bpp tiles) is cut
+ * into cells. a cell is trimmed to the box around its non-zero pixels,
+ * empty cells are dropped and identical trimmed sprites are stored once.
+ * the unique rectangles are sorted tallest first and placed by a
+ * bottom-left skyline packer, trying power-of-two sizes from the smallest
+ * area that could hold them.
+ *
+ * the placement table has one entry per non-empty cell: where its sprite
+ * sits in the atlas and how far the trimmed box is from the cell corner.
+ * it is JSON, or binary when the map file doesn't end in .json:
+ *   "ATLAS1\0\0", then u32 width, height, sheet count, entry count,
+ *   then each sheet name NUL terminated,
+ *   then entries of u32 sheet, u32 cell, u16 x, y, w, h, ox, oy.
+ * all little endian.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "hash64.h"
+#include "image.h"
+#include "palette.h"
+#include "util.h"
+
+#define PROG_NAME "atlaspack"
+#define DEFAULT_OUTFILE "atlas.png"
+#define DEFAULT_CELL 8
+#define DEFAULT_MAX_SIZE 4096
+
+/* a non-empty cell of a sheet */
+struct sprite {
+	unsigned sheet, cell;
+	unsigned ox, oy; /* trimmed box within the cell */
+	unsigned rect; /* index into rects */
+};
+
+/* a unique trimmed sprite */
+struct rect {
+	unsigned w, h;
+	unsigned x, y; /* in the atlas */
+	size_t pixels; /* offset into the arena, a byte per pixel */
+	uint64_t hash;
+};
+
+/* the top edge of the packed area from x to x+w */
+struct segment {
+	unsigned x, y, w;
+};
+
+static struct sprite *sprites;
+static size_t sprite_count, sprite_max;
+static struct rect *rects;
+static size_t rect_count, rect_max;
+static unsigned char *arena;
+static size_t arena_len, arena_max;
+static unsigned *table; /* open addressing over rects, ~0 is empty */
+static size_t table_size;
+static unsigned out_bpp=1, padding;
+static struct palette atlas_pal; /* of the first indexed sheet */
+static const char *atlas_pal_sheet;
+static int verbose_fl;
+
+static int grow(void **p, size_t *max, size_t need, size_t size) {
+	size_t n=*max?*max:256;
+	void *tmp;
+
+	if(need<=*max)
+		return 1;
+	while(n<need)
+		n*=2;
+	tmp=realloc(*p, n*size);
+	if(!tmp) {
+		perror("realloc()");
+		return 0;
+	}
+	*p=tmp;
+	*max=n;
+	return 1;
+}
+
+static int table_grow(void) {
+	size_t n=table_size?table_size*2:4096, i, j;
+	unsigned *t;
+
+	t=malloc(n*sizeof *t);
+	if(!t) {
+		perror("malloc()");
+		return 0;
+	}
+	memset(t, 0xff, n*sizeof *t);
+	for(i=0;i<rect_count;i++) {
+		for(j=rects[i].hash&(n-1);t[j]!=~0u;j=(j+1)&(n-1)) ;
+		t[j]=i;
+	}
+	free(table);
+	table=t;
+	table_size=n;
+	return 1;
+}
+
+/* find the sprite in pixels or add it, returning its rect or -1 */
+static long find_rect(const unsigned char *pixels, unsigned w, unsigned h) {
+	uint64_t hash=hash64(pixels, (size_t)w*h, (uint64_t)w<<32|h);
+	struct rect *r;
+	size_t j;
+
+	if(rect_count*2>=table_size && !table_grow())
+		return -1;
+	for(j=hash&(table_size-1);table[j]!=~0u;j=(j+1)&(table_size-1)) {
+		r=&rects[table[j]];
+		if(r->hash==hash && r->w==w && r->h==h && !memcmp(arena+r->pixels, pixels, (size_t)w*h))
+			return table[j];
+	}
+	if(!grow((void**)&rects, &rect_max, rect_count+1, sizeof *rects)
+	|| !grow((void**)&arena, &arena_max, arena_len+(size_t)w*h, 1))
+		return -1;
+	r=&rects[rect_count];
+	r->w=w;
+	r->h=h;
+	r->hash=hash;
+	r->pixels=arena_len;
+	memcpy(arena+arena_len, pixels, (size_t)w*h);
+	arena_len+=(size_t)w*h;
+	table[j]=rect_count;
+	return rect_count++;
+}
+
+static int load_sheet(const char *filename, struct image *img, struct palette *pal) {
+	const char *ext=file_extension(filename);
+
+	pal->count=0;
+	if(ext && !strcasecmp(ext, ".chr"))
+		return load_chr(filename, img, 8, 8, 2, 16);
+	return load_png_indexed(filename, img, pal);
+}
+
+/* the atlas takes the PLTE of the first indexed sheet */
+static void merge_palette(const char *filename, const struct palette *pal) {
+	if(!pal->count)
+		return;
+	if(!atlas_pal_sheet) {
+		atlas_pal=*pal;
+		atlas_pal_sheet=filename;
+		return;
+	}
+	if(pal->count!=atlas_pal.count || pal->transparent!=atlas_pal.transparent
+		|| memcmp(pal->rgb, atlas_pal.rgb, pal->count*sizeof *pal->rgb))
+		fprintf(stderr, "%s:palette differs from %s, the atlas keeps the first one.\n", filename, atlas_pal_sheet);
+}
+
+/* cut a sheet into cells and add the sprites */
+static int add_sheet(const char *filename, unsigned sheet, unsigned cell_w, unsigned cell_h) {
+	struct image img;
+	struct palette pal;
+	unsigned char *buf;
+	unsigned cols, rows, cx, cy, x, y;
+	int ret=0;
+
+	if(!load_sheet(filename, &img, &pal))
+		return 0;
+	merge_palette(filename, &pal);
+	if(img.bpp>out_bpp)
+		out_bpp=img.bpp;
+	cols=img.xres/cell_w;
+	rows=img.yres/cell_h;
+	buf=malloc((size_t)cell_w*cell_h*2);
+	if(!buf) {
+		perror("malloc()");
+		goto done;
+	}
+
+	for(cy=0;cy<rows;cy++) {
+		for(cx=0;cx<cols;cx++) {
+			unsigned char *cell=buf, *trim=buf+(size_t)cell_w*cell_h;
+			unsigned x0=cell_w, y0=cell_h, x1=0, y1=0, w, h;
+			struct sprite *s;
+			long r;
+
+			for(y=0;y<cell_h;y++) {
+				for(x=0;x<cell_w;x++) {
+					unsigned char c=image_get_pixel(&img, cx*cell_w+x, cy*cell_h+y);
+
+					cell[y*cell_w+x]=c;
+					if(!c)
+						continue;
+					if(x<x0) x0=x;
+					if(x>=x1) x1=x+1;
+					if(y<y0) y0=y;
+					y1=y+1;
+				}
+			}
+			if(x1<=x0)
+				continue; /* empty */
+			w=x1-x0;
+			h=y1-y0;
+			for(y=0;y<h;y++)
+				memcpy(trim+y*w, cell+(y0+y)*cell_w+x0, w);
+
+			r=find_rect(trim, w, h);
+			if(r<0)
+				goto done;
+			if(!grow((void**)&sprites, &sprite_max, sprite_count+1, sizeof *sprites))
+				goto done;
+			s=&sprites[sprite_count++];
+			s->sheet=sheet;
+			s->cell=cy*cols+cx;
+			s->ox=x0;
+			s->oy=y0;
+			s->rect=r;
+		}
+	}
+	ret=1;
+done:
+	free(buf);
+	image_destroy(&img);
+	return ret;
+}
+
+static int rect_cmp(const void *a, const void *b) {
+	const struct rect *x=&rects[*(const unsigned*)a], *y=&rects[*(const unsigned*)b];
+
+	if(x->h!=y->h)
+		return x->h>y->h?-1:1;
+	if(x->w!=y->w)
+		return x->w>y->w?-1:1;
+	return *(const unsigned*)a<*(const unsigned*)b?-1:1;
+}
+
+/* lowest y a w wide rect can sit at when its left edge is at segment i,
+ * or ~0 if it runs off the right */
+static unsigned skyline_fit(const struct segment *sky, unsigned n, unsigned i, unsigned w, unsigned atlas_w) {
+	unsigned x=sky[i].x, y=0;
+
+	if(x+w>atlas_w)
+		return ~0u;
+	for(;i<n && sky[i].x<x+w;i++)
+		if(sky[i].y>y)
+			y=sky[i].y;
+	return y;
+}
+
+/* raise the skyline over x..x+w to y. returns the new segment count */
+static unsigned skyline_add(struct segment *sky, unsigned n, unsigned i, unsigned w, unsigned y) {
+	unsigned x=sky[i].x, end=x+w, j;
+
+	/* drop or shorten the segments now covered */
+	for(j=i;j<n && sky[j].x+sky[j].w<=end;j++) ;
+	if(j<n && sky[j].x<end) {
+		sky[j].w-=end-sky[j].x;
+		sky[j].x=end;
+	}
+	/* segments i..j-1 become the one new segment */
+	memmove(sky+i+1, sky+j, (n-j)*sizeof *sky);
+	n-=j-i-1;
+	sky[i].x=x;
+	sky[i].y=y;
+	sky[i].w=w;
+
+	/* merge with level neighbours */
+	if(i+1<n && sky[i+1].y==y) {
+		sky[i].w+=sky[i+1].w;
+		memmove(sky+i+1, sky+i+2, (n-i-2)*sizeof *sky);
+		n--;
+	}
+	if(i>0 && sky[i-1].y==y) {
+		sky[i-1].w+=sky[i].w;
+		memmove(sky+i, sky+i+1, (n-i-1)*sizeof *sky);
+		n--;
+	}
+	return n;
+}
+
+/* try to pack every rect into atlas_w x atlas_h */
+static int pack(const unsigned *order, struct segment *sky, unsigned atlas_w, unsigned atlas_h) {
+	unsigned n=1, k;
+
+	sky[0].x=0;
+	sky[0].y=0;
+	sky[0].w=atlas_w;
+	for(k=0;k<rect_count;k++) {
+		struct rect *r=&rects[order[k]];
+		unsigned w=r->w+padding, h=r->h+padding;
+		unsigned i, y, best=~0u, best_top=~0u;
+
+		/* bottom-left: lowest top edge, then leftmost */
+		for(i=0;i<n;i++) {
+			y=skyline_fit(sky, n, i, w, atlas_w);
+			if(y==~0u)
+				break; /* segments further right only get narrower */
+			if(y+h<=atlas_h && y+h<best_top) {
+				best_top=y+h;
+				best=i;
+			}
+		}
+		if(best==~0u)
+			return 0;
+		r->x=sky[best].x;
+		r->y=best_top-h;
+		n=skyline_add(sky, n, best, w, best_top);
+	}
+	return 1;
+}
+
+/* find the smallest power-of-two atlas the rects fit in */
+static int pack_atlas(unsigned max_size, unsigned *atlas_w, unsigned *atlas_h) {
+	unsigned *order;
+	struct segment *sky;
+	uint64_t area=0;
+	unsigned max_w=1, max_h=1, e, k;
+	size_t i;
+	int ret=0;
+
+	order=malloc((rect_count+1)*sizeof *order);
+	sky=malloc((rect_count+2)*sizeof *sky);
+	if(!order || !sky) {
+		perror("malloc()");
+		goto done;
+	}
+	for(i=0;i<rect_count;i++) {
+		order[i]=i;
+		area+=(uint64_t)(rects[i].w+padding)*(rects[i].h+padding);
+		if(rects[i].w+padding>max_w) max_w=rects[i].w+padding;
+		if(rects[i].h+padding>max_h) max_h=rects[i].h+padding;
+	}
+	qsort(order, rect_count, sizeof *order, rect_cmp);
+
+	for(e=0;((uint64_t)1<<e)<area;e++) ;
+	for(;(1u<<((e+1)/2))<=max_size;e++) {
+		/* square, or twice as wide as tall, then twice as tall */
+		for(k=0;k<2;k++) {
+			unsigned w=1u<<((e+1)/2), h=1u<<(e/2);
+
+			if(k) {
+				if(w==h)
+					break;
+				w=1u<<(e/2);
+				h=1u<<((e+1)/2);
+			}
+			if(w<max_w || h<max_h)
+				continue;
+			if(verbose_fl)
+				fprintf(stderr, "trying %ux%u\n", w, h);
+			if(pack(order, sky, w, h)) {
+				*atlas_w=w;
+				*atlas_h=h;
+				ret=1;
+				goto done;
+			}
+		}
+	}
+	fprintf(stderr, "sprites do not fit in %ux%u.\n", max_size, max_size);
+done:
+	free(order);
+	free(sky);
+	return ret;
+}
+
+/* PNG rows hold the first pixel in the most significant bits */
+static void set_pixel(struct image *img, unsigned x, unsigned y, unsigned c) {
+	unsigned shift=8-img->bpp-x*img->bpp%8;
+	unsigned char *p=img->image_data+(size_t)y*img->rowbytes+x*img->bpp/8;
+
+	*p=(*p&~(((1u<<img->bpp)-1)<<shift))|c<<shift;
+}
+
+static int write_atlas(const char *filename, unsigned atlas_w, unsigned atlas_h) {
+	struct image img;
+	unsigned x, y;
+	size_t i;
+	int ret;
+
+	if(!image_create(&img, atlas_w, atlas_h, out_bpp, 0))
+		return 0;
+	for(i=0;i<rect_count;i++) {
+		const struct rect *r=&rects[i];
+		const unsigned char *p=arena+r->pixels;
+
+		for(y=0;y<r->h;y++)
+			for(x=0;x<r->w;x++)
+				set_pixel(&img, r->x+x, r->y+y, *p++);
+	}
+	if(atlas_pal_sheet)
+		ret=save_png_indexed(filename, &img, &atlas_pal);
+	else
+		ret=save_png(filename, &img);
+	image_destroy(&img);
+	return ret;
+}
+
+static void json_string(FILE *f, const char *s) {
+	fputc('"', f);
+	for(;*s;s++) {
+		if(*s=='"' || *s=='\\')
+			fprintf(f, "\\%c", *s);
+		else if((unsigned char)*s<0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static void write_json(FILE *f, char **sheets, unsigned sheet_count, unsigned atlas_w, unsigned atlas_h) {
+	unsigned i;
+	size_t k;
+
+	fprintf(f, "{\n\"width\": %u,\n\"height\": %u,\n\"sheets\": [", atlas_w, atlas_h);
+	for(i=0;i<sheet_count;i++) {
+		fputs(i ? ", " : "", f);
+		json_string(f, sheets[i]);
+	}
+	fprintf(f, "],\n\"sprites\": [\n");
+	for(k=0;k<sprite_count;k++) {
+		const struct sprite *s=&sprites[k];
+		const struct rect *r=&rects[s->rect];
+
+		fprintf(f, "{\"sheet\": %u, \"cell\": %u, \"x\": %u, \"y\": %u, \"w\": %u, \"h\": %u, \"ox\": %u, \"oy\": %u}%s\n",
+			s->sheet, s->cell, r->x, r->y, r->w, r->h, s->ox, s->oy, k+1<sprite_count ? "," : "");
+	}
+	fprintf(f, "]\n}\n");
+}
+
+static void put_le(FILE *f, uint32_t v, unsigned len) {
+	while(len--) {
+		fputc(v&255, f);
+		v>>=8;
+	}
+}
+
+static void write_binary(FILE *f, char **sheets, unsigned sheet_count, unsigned atlas_w, unsigned atlas_h) {
+	unsigned i;
+	size_t k;
+
+	fwrite("ATLAS1\0\0", 1, 8, f);
+	put_le(f, atlas_w, 4);
+	put_le(f, atlas_h, 4);
+	put_le(f, sheet_count, 4);
+	put_le(f, sprite_count, 4);
+	for(i=0;i<sheet_count;i++)
+		fwrite(sheets[i], 1, strlen(sheets[i])+1, f);
+	for(k=0;k<sprite_count;k++) {
+		const struct sprite *s=&sprites[k];
+		const struct rect *r=&rects[s->rect];
+
+		put_le(f, s->sheet, 4);
+		put_le(f, s->cell, 4);
+		put_le(f, r->x, 2);
+		put_le(f, r->y, 2);
+		put_le(f, r->w, 2);
+		put_le(f, r->h, 2);
+		put_le(f, s->ox, 2);
+		put_le(f, s->oy, 2);
+	}
+}
+
+static int write_map(const char *filename, char **sheets, unsigned sheet_count, unsigned atlas_w, unsigned atlas_h) {
+	const char *ext=file_extension(filename);
+	FILE *f;
+
+	f=fopen(filename, "wb");
+	if(!f) {
+		perror(filename);
+		return 0;
+	}
+	if(ext && !strcasecmp(ext, ".json"))
+		write_json(f, sheets, sheet_count, atlas_w, atlas_h);
+	else
+		write_binary(f, sheets, sheet_count, atlas_w, atlas_h);
+	if(ferror(f)) {
+		perror(filename);
+		fclose(f);
+		return 0;
+	}
+	if(fclose(f)) {
+		perror(filename);
+		return 0;
+	}
+	return 1;
+}
+
+static void usage(void) {
+	fprintf(stderr,
+		"usage: " PROG_NAME " [-v] [-t <WxH>] [-p <n>] [-s <max>] [-o <atlas.png>] [-m <map>] <sheet>...\n"
+	);
+
+	fprintf(stderr,
+		"-t <WxH>    cell size sheets are cut into (default %ux%u).\n"
+		"-p <n>      pixels of padding after each sprite (default 0).\n"
+		"-s <max>    largest atlas side (default %u).\n"
+		"-o <f>      output PNG (default '" DEFAULT_OUTFILE "').\n"
+		"-m <f>      placement table, JSON if it ends in .json, otherwise\n"
+		"            binary (default is the output name with .json).\n"
+		"-v          verbose.\n"
+		"sheets are grayscale or indexed PNGs, or .chr files read as 8x8 2bpp\n"
+		"tiles. the atlas keeps the palette of the first indexed sheet.\n",
+		DEFAULT_CELL, DEFAULT_CELL, DEFAULT_MAX_SIZE
+	);
+}
+
+int main(int argc, char **argv) {
+	unsigned cell_w=DEFAULT_CELL, cell_h=DEFAULT_CELL, max_size=DEFAULT_MAX_SIZE;
+	unsigned atlas_w, atlas_h, i;
+	const char *out_filename=DEFAULT_OUTFILE, *map_filename=NULL;
+	char map_filename_tmp[512], *endptr;
+	int c, ret=EXIT_FAILURE;
+
+	while((c=getopt(argc, argv, "hvt:p:s:o:m:"))!=-1) {
+		switch(c) {
+			case 'v':
+				verbose_fl++;
+				break;
+			case 't':
+				cell_w=strtoul(optarg, &endptr, 10);
+				if(*endptr=='x' || *endptr=='X' || *endptr==',') {
+					cell_h=strtoul(endptr+1, &endptr, 10);
+					if(!*endptr && cell_w && cell_h)
+						break;
+				}
+				fprintf(stderr, "Error: -t takes a width and height.\n");
+				return EXIT_FAILURE;
+			case 'p':
+				padding=strtoul(optarg, &endptr, 10);
+				if(*endptr) {
+					fprintf(stderr, "Error: -p takes a number.\n");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 's':
+				max_size=strtoul(optarg, &endptr, 10);
+				if(*endptr || !max_size || max_size>65536) {
+					fprintf(stderr, "Error: -s takes a number up to 65536.\n");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'o':
+				out_filename=optarg;
+				break;
+			case 'm':
+				map_filename=optarg;
+				break;
+			case 'h':
+			default:
+				usage();
+				return EXIT_FAILURE;
+		}
+	}
+	if(optind==argc) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	if(!map_filename) {
+		if(!make_file_name(map_filename_tmp, sizeof map_filename_tmp, out_filename, ".json")) {
+			fprintf(stderr, "%s:name too long\n", out_filename);
+			return EXIT_FAILURE;
+		}
+		map_filename=map_filename_tmp;
+	}
+
+	for(i=optind;i<(unsigned)argc;i++)
+		if(!add_sheet(argv[i], i-optind, cell_w, cell_h))
+			goto done;
+	if(!rect_count) {
+		fprintf(stderr, "no sprites.\n");
+		goto done;
+	}
+	if(!pack_atlas(max_size, &atlas_w, &atlas_h))
+		goto done;
+	fprintf(stderr, "%zu sprites, %zu unique: %ux%u\n", sprite_count, rect_count, atlas_w, atlas_h);
+	if(!write_atlas(out_filename, atlas_w, atlas_h))
+		goto done;
+	if(!write_map(map_filename, argv+optind, argc-optind, atlas_w, atlas_h))
+		goto done;
+	ret=EXIT_SUCCESS;
+done:
+	free(sprites);
+	free(rects);
+	free(arena);
+	free(table);
+	return ret;
+}
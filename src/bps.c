@@ -0,0 +1,301 @@
+/* bps.c
+ * BPS and UPS patch formats.
+ *
+ * Both start with a 4 byte signature and end with three little-endian
+ * CRC32s: source, target and the patch itself (minus its last 4 bytes).
+ * Sizes and offsets are variable length numbers, 7 bits per byte, where
+ * the high bit marks the last byte.
+ *
+ * BPS: "BPS1" source-size target-size metadata-size metadata actions...
+ *   each action is a number ((length - 1) << 2 | command):
+ *   0 SourceRead  copy length bytes from the source at the output offset
+ *   1 TargetRead  copy length bytes from the patch
+ *   2 SourceCopy  signed relative offset, copy from the source
+ *   3 TargetCopy  signed relative offset, copy from the output so far
+ *
+ * UPS: "UPS1" size-a size-b records...
+ *   each record is a relative offset followed by bytes XORed into the
+ *   input, terminated by a 0 byte. The patch works in both directions.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "ips.h"
+
+#define FOOTER_SIZE 12
+
+static uint32_t get_le32(const unsigned char *bp)
+{
+	return (uint32_t)bp[0] | (uint32_t)bp[1] << 8 |
+		(uint32_t)bp[2] << 16 | (uint32_t)bp[3] << 24;
+}
+
+/* @returns 0 on success, -1 if the number runs past end */
+static int read_number(const unsigned char **pp, const unsigned char *end,
+	uint64_t *out)
+{
+	const unsigned char *p = *pp;
+	uint64_t data = 0, shift = 1;
+
+	while (p < end) {
+		unsigned char x = *p++;
+
+		data += (x & 0x7f) * shift;
+		if (x & 0x80) {
+			*pp = p;
+			*out = data;
+			return 0;
+		}
+		if (shift >= (uint64_t)1 << 56)
+			break; /* overflow */
+		shift <<= 7;
+		data += shift;
+	}
+	return -1;
+}
+
+/* check signature, size and patch CRC. sets *end to the start of the footer */
+static int check_patch(const char *patchfile, const char *magic,
+	const unsigned char *patch, size_t patchlen,
+	const unsigned char **end)
+{
+	uint32_t crc;
+
+	if (patchlen < 4 + FOOTER_SIZE || memcmp(patch, magic, 4)) {
+		error("%s: Header signature invalid\n", patchfile);
+		return -1;
+	}
+
+	*end = patch + patchlen - FOOTER_SIZE;
+	crc = crc32_update(0, patch, patchlen - 4);
+	if (crc != get_le32(patch + patchlen - 4)) {
+		error("%s: Patch CRC mismatch (%08x, expected %08x)\n",
+			patchfile, crc, get_le32(patch + patchlen - 4));
+		return -1;
+	}
+	return 0;
+}
+
+/* read the two sizes from a BPS or UPS header: source and target for BPS,
+ * the two sides for UPS */
+int delta_sizes(const char *patchfile, const unsigned char *patch,
+	size_t patchlen, uint64_t *size_a, uint64_t *size_b)
+{
+	const unsigned char *p = patch + 4, *end = patch + patchlen;
+
+	if (patchlen < 4 + FOOTER_SIZE || (memcmp(patch, "BPS1", 4) &&
+		memcmp(patch, "UPS1", 4))) {
+		error("%s: Header signature invalid\n", patchfile);
+		return -1;
+	}
+	if (read_number(&p, end, size_a) || read_number(&p, end, size_b)) {
+		error("%s: Truncated file detected\n", patchfile);
+		return -1;
+	}
+	return 0;
+}
+
+int bps_apply(const char *patchfile, const unsigned char *patch,
+	size_t patchlen, const unsigned char *src, size_t srclen,
+	unsigned char **out, size_t *outlen)
+{
+	const unsigned char *p, *end;
+	uint64_t source_size, target_size, metadata_size, data;
+	uint64_t outpos, length, source_rel, target_rel;
+	unsigned char *dst;
+	uint32_t crc;
+
+	if (check_patch(patchfile, "BPS1", patch, patchlen, &end))
+		return -1;
+	p = patch + 4;
+
+	if (read_number(&p, end, &source_size) ||
+		read_number(&p, end, &target_size) ||
+		read_number(&p, end, &metadata_size))
+		goto trunc_detected;
+	if (metadata_size > (uint64_t)(end - p))
+		goto trunc_detected;
+	p += metadata_size;
+
+	if (srclen != source_size) {
+		error("%s: Source size mismatch (%zu, expected %llu)\n",
+			patchfile, srclen, (unsigned long long)source_size);
+		return -1;
+	}
+	crc = crc32_update(0, src, srclen);
+	if (crc != get_le32(end)) {
+		error("%s: Source CRC mismatch (%08x, expected %08x)\n",
+			patchfile, crc, get_le32(end));
+		return -1;
+	}
+
+	if (target_size != (size_t)target_size) {
+		error("%s: Target too large\n", patchfile);
+		return -1;
+	}
+	dst = malloc(target_size ? target_size : 1);
+	if (!dst) {
+		perror("malloc()");
+		return -1;
+	}
+
+	outpos = source_rel = target_rel = 0;
+	while (p < end) {
+		int64_t rel;
+
+		if (read_number(&p, end, &data))
+			goto trunc_free;
+		length = (data >> 2) + 1;
+		if (length > target_size - outpos)
+			goto corrupt;
+
+		switch (data & 3) {
+		case 0: /* SourceRead */
+			if (outpos + length > srclen)
+				goto corrupt;
+			memcpy(dst + outpos, src + outpos, length);
+			break;
+		case 1: /* TargetRead */
+			if (length > (uint64_t)(end - p))
+				goto trunc_free;
+			memcpy(dst + outpos, p, length);
+			p += length;
+			break;
+		case 2: /* SourceCopy */
+			if (read_number(&p, end, &data))
+				goto trunc_free;
+			rel = (int64_t)(data >> 1);
+			source_rel += (data & 1) ? -rel : rel;
+			if (source_rel > srclen || length > srclen - source_rel)
+				goto corrupt;
+			memcpy(dst + outpos, src + source_rel, length);
+			source_rel += length;
+			break;
+		case 3: /* TargetCopy */
+			if (read_number(&p, end, &data))
+				goto trunc_free;
+			rel = (int64_t)(data >> 1);
+			target_rel += (data & 1) ? -rel : rel;
+			if (target_rel >= outpos)
+				goto corrupt;
+			/* may overlap the bytes being written, copy forward */
+			for (data = 0; data < length; data++)
+				dst[outpos + data] = dst[target_rel++];
+			break;
+		}
+		outpos += length;
+	}
+
+	if (outpos != target_size) {
+		error("%s: Patch produced %llu bytes, expected %llu\n",
+			patchfile, (unsigned long long)outpos,
+			(unsigned long long)target_size);
+		free(dst);
+		return -1;
+	}
+
+	crc = crc32_update(0, dst, target_size);
+	if (crc != get_le32(end + 4)) {
+		error("%s: Target CRC mismatch (%08x, expected %08x)\n",
+			patchfile, crc, get_le32(end + 4));
+		free(dst);
+		return -1;
+	}
+
+	*out = dst;
+	*outlen = target_size;
+	return 0;
+corrupt:
+	error("%s: Action out of range at patch offset %zd\n", patchfile,
+		p - patch);
+	free(dst);
+	return -1;
+trunc_free:
+	free(dst);
+trunc_detected:
+	error("%s: Truncated file detected\n", patchfile);
+	return -1;
+}
+
+int ups_apply(const char *patchfile, const unsigned char *patch,
+	size_t patchlen, const unsigned char *src, size_t srclen,
+	unsigned char **out, size_t *outlen)
+{
+	const unsigned char *p, *end;
+	uint64_t size_a, size_b, target_size, pos, rel;
+	uint32_t crc, target_crc;
+	unsigned char *dst;
+
+	if (check_patch(patchfile, "UPS1", patch, patchlen, &end))
+		return -1;
+	p = patch + 4;
+
+	if (read_number(&p, end, &size_a) || read_number(&p, end, &size_b))
+		goto trunc_detected;
+
+	/* UPS patches go both ways, decide by which side the input matches */
+	crc = crc32_update(0, src, srclen);
+	if (srclen == size_a && crc == get_le32(end)) {
+		target_size = size_b;
+		target_crc = get_le32(end + 4);
+	} else if (srclen == size_b && crc == get_le32(end + 4)) {
+		verbose("%s: Input matches target, reversing patch\n",
+			patchfile);
+		target_size = size_a;
+		target_crc = get_le32(end);
+	} else {
+		error("%s: Source mismatch (%zu bytes, CRC %08x, "
+			"expected %llu bytes, CRC %08x)\n", patchfile, srclen,
+			crc, (unsigned long long)size_a, get_le32(end));
+		return -1;
+	}
+
+	if (target_size != (size_t)target_size) {
+		error("%s: Target too large\n", patchfile);
+		return -1;
+	}
+	dst = calloc(1, target_size ? target_size : 1);
+	if (!dst) {
+		perror("calloc()");
+		return -1;
+	}
+	memcpy(dst, src, srclen < target_size ? srclen : target_size);
+
+	pos = 0;
+	while (p < end) {
+		unsigned char x;
+
+		if (read_number(&p, end, &rel))
+			goto trunc_free;
+		pos += rel;
+		/* XOR bytes in, the terminating 0 also consumes a byte */
+		do {
+			if (p >= end)
+				goto trunc_free;
+			x = *p++;
+			if (pos < target_size)
+				dst[pos] ^= x;
+			pos++;
+		} while (x);
+	}
+
+	crc = crc32_update(0, dst, target_size);
+	if (crc != target_crc) {
+		error("%s: Target CRC mismatch (%08x, expected %08x)\n",
+			patchfile, crc, target_crc);
+		free(dst);
+		return -1;
+	}
+
+	*out = dst;
+	*outlen = target_size;
+	return 0;
+trunc_free:
+	free(dst);
+trunc_detected:
+	error("%s: Truncated file detected\n", patchfile);
+	return -1;
+}
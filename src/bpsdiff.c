@@ -0,0 +1,355 @@
+/* bpsdiff.c
+ * create a BPS patch from an original and a modified file.
+ *
+ * A suffix array of the original lets every position of the modified
+ * file find its longest match anywhere in the original, so moved data
+ * (reshuffled banks, relocated tiles) becomes SourceCopy actions instead
+ * of literal bytes. The modified file is cut into chunks that are
+ * matched on separate threads; the actions are then serialized in order
+ * because BPS copy offsets are relative to the previous copy.
+ *
+ * Memory use is the two mappings, 4 bytes per byte of the original for
+ * the suffix array and the action lists.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "ips.h"
+#include "pool.h"
+#include "sais.h"
+#include "util.h"
+
+#define MIN_SOURCE_READ	4	/* shorter runs are cheaper as literals */
+#define MIN_TARGET_RUN	4
+#define MIN_SOURCE_COPY	8
+#define SOURCE_COPY_COST 4	/* a copy also pays for its offset */
+#define GOOD_MATCH	64	/* skip the suffix array search past this */
+#define MIN_CHUNK	(256 * 1024)
+
+enum bps_action {
+	SOURCE_READ,
+	TARGET_READ,
+	SOURCE_COPY,
+	TARGET_COPY,
+};
+
+struct op {
+	enum bps_action action;
+	size_t len;
+	size_t offset;	/* source or target offset the bytes come from */
+};
+
+struct chunk {
+	size_t start, end;
+	struct op *ops;
+	size_t count, max;
+	int failed;
+};
+
+struct bpsdiff {
+	const unsigned char *src, *tgt;
+	size_t srclen, tgtlen;
+	const int32_t *sa;
+	struct chunk *chunks;
+};
+
+static int add_op(struct chunk *c, enum bps_action action, size_t len,
+	size_t offset)
+{
+	if (c->count == c->max) {
+		size_t max = c->max ? c->max * 2 : 256;
+		struct op *tmp;
+
+		tmp = realloc(c->ops, max * sizeof(*tmp));
+		if (!tmp) {
+			perror("realloc()");
+			return -1;
+		}
+		c->ops = tmp;
+		c->max = max;
+	}
+	c->ops[c->count].action = action;
+	c->ops[c->count].len = len;
+	c->ops[c->count].offset = offset;
+	c->count++;
+	return 0;
+}
+
+/* longest prefix of pat found in the source, by binary search over the
+ * suffix array. lcps with both ends of the range are tracked so each
+ * probe resumes comparing where the bounds agree. */
+static size_t find_match(const struct bpsdiff *d, const unsigned char *pat,
+	size_t patlen, size_t *offset)
+{
+	const unsigned char *src = d->src;
+	size_t lo = 0, hi = d->srclen;
+	size_t llcp = 0, hlcp = 0;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		size_t s = d->sa[mid];
+		size_t k = llcp < hlcp ? llcp : hlcp;
+		size_t max = d->srclen - s < patlen ? d->srclen - s : patlen;
+
+		while (k < max && src[s + k] == pat[k])
+			k++;
+		if (k == patlen || (k < max && src[s + k] > pat[k])) {
+			hi = mid;
+			hlcp = k;
+		} else {
+			lo = mid + 1;
+			llcp = k;
+		}
+	}
+
+	/* the best match is a neighbour of the insertion point */
+	if (lo < d->srclen && hlcp >= llcp) {
+		*offset = d->sa[lo];
+		return hlcp;
+	}
+	if (lo > 0) {
+		*offset = d->sa[lo - 1];
+		return llcp;
+	}
+	return 0;
+}
+
+static void diff_chunk(void *arg, unsigned index)
+{
+	struct bpsdiff *d = arg;
+	struct chunk *c = &d->chunks[index];
+	const unsigned char *src = d->src, *tgt = d->tgt;
+	size_t pos, lit, end = c->end;
+
+	for (pos = lit = c->start; pos < end; ) {
+		enum bps_action action = SOURCE_READ;
+		size_t best = 0, offset = 0, k;
+
+		/* same bytes at the same place */
+		if (pos < d->srclen) {
+			for (k = 0; pos + k < end && pos + k < d->srclen &&
+				src[pos + k] == tgt[pos + k]; k++)
+				;
+			if (k >= MIN_SOURCE_READ) {
+				best = k;
+				action = SOURCE_READ;
+			}
+		}
+
+		/* a run of the previous byte */
+		if (pos > 0) {
+			for (k = 0; pos + k < end && tgt[pos + k] == tgt[pos - 1]; k++)
+				;
+			if (k >= MIN_TARGET_RUN && k > best) {
+				best = k;
+				action = TARGET_COPY;
+				offset = pos - 1;
+			}
+		}
+
+		/* the same bytes anywhere in the source */
+		if (best < GOOD_MATCH && d->srclen) {
+			size_t o;
+
+			k = find_match(d, tgt + pos, end - pos, &o);
+			if (k >= MIN_SOURCE_COPY && k > best + SOURCE_COPY_COST) {
+				best = k;
+				action = SOURCE_COPY;
+				offset = o;
+			}
+		}
+
+		if (!best) {
+			pos++;
+			continue;
+		}
+
+		if (lit < pos && add_op(c, TARGET_READ, pos - lit, lit))
+			goto failed;
+		if (add_op(c, action, best, offset))
+			goto failed;
+		pos += best;
+		lit = pos;
+	}
+	if (lit < end && add_op(c, TARGET_READ, end - lit, lit))
+		goto failed;
+
+	debug("chunk %u: %zd-%zd, %zd actions\n", index, c->start, end - 1,
+		c->count);
+	return;
+failed:
+	c->failed = 1;
+}
+
+static int put_number(struct buf *b, uint64_t data)
+{
+	unsigned char tmp[10];
+	int len = 0;
+
+	for (;;) {
+		unsigned char x = data & 0x7f;
+
+		data >>= 7;
+		if (!data) {
+			tmp[len++] = 0x80 | x;
+			break;
+		}
+		tmp[len++] = x;
+		data--;
+	}
+	return buf_put(b, tmp, len);
+}
+
+static int put_relative(struct buf *b, size_t offset, size_t *rel)
+{
+	uint64_t data;
+
+	if (offset >= *rel)
+		data = (uint64_t)(offset - *rel) << 1;
+	else
+		data = (uint64_t)(*rel - offset) << 1 | 1;
+	*rel = offset;
+	return put_number(b, data);
+}
+
+static int put_le32(struct buf *b, uint32_t v)
+{
+	unsigned char tmp[4];
+
+	tmp[0] = v;
+	tmp[1] = v >> 8;
+	tmp[2] = v >> 16;
+	tmp[3] = v >> 24;
+	return buf_put(b, tmp, sizeof(tmp));
+}
+
+static int serialize(struct bpsdiff *d, unsigned nchunks, struct buf *out)
+{
+	size_t source_rel = 0, target_rel = 0;
+	unsigned i;
+	size_t j;
+
+	if (buf_put(out, "BPS1", 4) || put_number(out, d->srclen) ||
+		put_number(out, d->tgtlen) || put_number(out, 0))
+		return -1;
+
+	for (i = 0; i < nchunks; i++) {
+		struct chunk *c = &d->chunks[i];
+
+		for (j = 0; j < c->count; j++) {
+			struct op *op = &c->ops[j];
+			int e = 0;
+
+			if (put_number(out, (uint64_t)(op->len - 1) << 2 |
+				op->action))
+				return -1;
+			switch (op->action) {
+			case SOURCE_READ:
+				break;
+			case TARGET_READ:
+				e = buf_put(out, d->tgt + op->offset, op->len);
+				break;
+			case SOURCE_COPY:
+				e = put_relative(out, op->offset, &source_rel);
+				source_rel += op->len;
+				break;
+			case TARGET_COPY:
+				e = put_relative(out, op->offset, &target_rel);
+				target_rel += op->len;
+				break;
+			}
+			if (e)
+				return -1;
+		}
+	}
+
+	if (put_le32(out, crc32_update(0, d->src, d->srclen)) ||
+		put_le32(out, crc32_update(0, d->tgt, d->tgtlen)))
+		return -1;
+	return put_le32(out, crc32_update(0, out->data, out->len));
+}
+
+int bps_create(const char *origfile, const char *modfile,
+	const char *outfile, unsigned threads)
+{
+	struct bpsdiff d;
+	struct buf out = { NULL, 0, 0 };
+	unsigned char *orig, *mod;
+	int32_t *sa = NULL;
+	size_t chunk, pos;
+	unsigned nchunks = 0, i;
+	int e = -1;
+
+	memset(&d, 0, sizeof(d));
+	orig = map_file(origfile, &d.srclen);
+	if (!orig)
+		return -1;
+	mod = map_file(modfile, &d.tgtlen);
+	if (!mod)
+		goto out_unmap_orig;
+	d.src = orig;
+	d.tgt = mod;
+
+	if (d.srclen > INT32_MAX) {
+		error("%s: Too large\n", origfile);
+		goto out_unmap;
+	}
+
+	if (d.srclen) {
+		sa = malloc(d.srclen * sizeof(*sa));
+		if (!sa) {
+			perror("malloc()");
+			goto out_unmap;
+		}
+		verbose("%s: building suffix array\n", origfile);
+		if (sais(orig, sa, d.srclen)) {
+			error("%s: Could not build suffix array\n", origfile);
+			goto out_free;
+		}
+		d.sa = sa;
+	}
+
+	/* a few chunks per thread so uneven chunks balance out */
+	if (threads < 1)
+		threads = 1;
+	chunk = d.tgtlen / (threads * 4);
+	if (chunk < MIN_CHUNK)
+		chunk = MIN_CHUNK;
+	nchunks = (d.tgtlen + chunk - 1) / chunk;
+	d.chunks = calloc(nchunks ? nchunks : 1, sizeof(*d.chunks));
+	if (!d.chunks) {
+		perror("calloc()");
+		goto out_free;
+	}
+	for (i = 0, pos = 0; i < nchunks; i++, pos += chunk) {
+		d.chunks[i].start = pos;
+		d.chunks[i].end = pos + chunk < d.tgtlen ? pos + chunk : d.tgtlen;
+	}
+
+	verbose("%s: matching %u chunks on %u threads\n", modfile, nchunks,
+		threads);
+	pool_run(threads, nchunks, diff_chunk, &d);
+	for (i = 0; i < nchunks; i++) {
+		if (d.chunks[i].failed)
+			goto out_free;
+	}
+
+	if (serialize(&d, nchunks, &out))
+		goto out_free;
+
+	e = buf_write(&out, outfile);
+
+out_free:
+	for (i = 0; d.chunks && i < nchunks; i++)
+		free(d.chunks[i].ops);
+	free(d.chunks);
+	free(out.data);
+	free(sa);
+out_unmap:
+	unmap_file(mod, d.tgtlen);
+out_unmap_orig:
+	unmap_file(orig, d.srclen);
+	return e;
+}
@@ -0,0 +1,519 @@
+/* chrcodec.c
+ * compression for CHR data, in formats simple enough to unpack on the NES.
+ *
+ * every stream ends with its own end code, so a decoder needs no length.
+ *
+ * rle - PackBits. a control byte n is followed by n+1 literal bytes when
+ *   n<128, or by one byte repeated 257-n times when n>128. 128 ends.
+ *
+ * lzss - a flag byte covers the next 8 items, low bit first. a 1 is a
+ *   literal byte, a 0 a big-endian word DDDDDDDDDDDDLLLL: copy L+2 bytes
+ *   (3 to 16) from D+1 bytes back (1 to 4096), or for L=15 17 more than
+ *   the byte that follows (17 to 272). L=0 ends. matches are found through
+ *   hash chains and the parse is optimal for this cost model.
+ *
+ * tile - 16 byte 2bpp tiles, a mode byte each. bits 0-1 say how plane 0 is
+ *   stored and bits 2-3 plane 1: 0 coded rows, 1 all $00, 2 all $FF, 3 a
+ *   copy (of the previous tile's plane 0 for plane 0, of this tile's plane
+ *   0 for plane 1). coded rows are a mask byte, where bit 7-r set means row
+ *   r repeats the row above it ($00 above row 0), then the other rows.
+ *   a mode byte of $80 ends.
+ *
+ * these are the repository's own formats. they follow the ideas of the
+ * usual NES tile codecs but are not compatible with any of them.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chrcodec.h"
+#include "planar.h"
+
+#define LZSS_WINDOW 4096
+#define LZSS_MIN 3
+#define LZSS_SHORT 16 /* longest without a length byte */
+#define LZSS_MAX 272
+#define LZSS_HASH_BITS 15
+#define LZSS_MAX_CHAIN 256
+#define LZSS_LITERAL_BITS 9
+#define LZSS_MATCH_BITS 17
+#define LZSS_LONG_BITS 25
+#define LZSS_BLOCK 16 /* costs kept with the minimum of each block */
+
+#define TILE_END 0x80
+
+struct buf {
+	unsigned char *data;
+	size_t len, max;
+	int failed;
+};
+
+static const char *const codec_names[]={"none", "rle", "lzss", "tile"};
+
+int codec_lookup(const char *name) {
+	unsigned i;
+
+	for(i=0;i<sizeof codec_names/sizeof *codec_names;i++)
+		if(!strcmp(name, codec_names[i]))
+			return i;
+	return -1;
+}
+
+const char *codec_name(int codec) {
+	return codec_names[codec];
+}
+
+static void put(struct buf *b, const void *data, size_t len) {
+	if(b->failed)
+		return;
+	if(b->len+len>b->max) {
+		size_t n=b->max?b->max:4096;
+		unsigned char *tmp;
+
+		while(n<b->len+len)
+			n*=2;
+		tmp=realloc(b->data, n);
+		if(!tmp) {
+			perror("realloc()");
+			b->failed=1;
+			return;
+		}
+		b->data=tmp;
+		b->max=n;
+	}
+	memcpy(b->data+b->len, data, len);
+	b->len+=len;
+}
+
+static void put_byte(struct buf *b, unsigned c) {
+	unsigned char v=c;
+
+	put(b, &v, 1);
+}
+
+/* hand back the buffer, or NULL if anything failed */
+static unsigned char *finish(struct buf *b, size_t *out_len) {
+	if(!b->data && !b->failed) {
+		b->data=malloc(1); /* nothing was put, still not an error */
+		if(!b->data) {
+			perror("malloc()");
+			return NULL;
+		}
+	}
+	if(b->failed) {
+		free(b->data);
+		return NULL;
+	}
+	*out_len=b->len;
+	return b->data;
+}
+
+static unsigned char *corrupt(const char *filename, struct buf *b) {
+	fprintf(stderr, "%s:compressed data is corrupt.\n", filename);
+	free(b->data);
+	return NULL;
+}
+
+/**** RLE ****/
+
+static void rle_compress(struct buf *b, const unsigned char *src, size_t len) {
+	size_t i=0, start, run;
+
+	while(i<len) {
+		for(run=1;i+run<len && run<128 && src[i+run]==src[i];run++) ;
+		if(run>=3) {
+			put_byte(b, 257-run);
+			put_byte(b, src[i]);
+			i+=run;
+			continue;
+		}
+		/* literals up to the next run worth coding */
+		for(start=i;i<len && i-start<128;i++)
+			if(i+2<len && src[i]==src[i+1] && src[i]==src[i+2])
+				break;
+		put_byte(b, i-start-1);
+		put(b, src+start, i-start);
+	}
+	put_byte(b, 128);
+}
+
+static unsigned char *rle_decompress(const char *filename, const unsigned char *src, size_t len, size_t *out_len) {
+	struct buf b={NULL, 0, 0, 0};
+	size_t i=0;
+	unsigned n;
+
+	while(i<len) {
+		n=src[i++];
+		if(n==128)
+			return finish(&b, out_len);
+		if(n<128) {
+			if(len-i<n+1)
+				break;
+			put(&b, src+i, n+1);
+			i+=n+1;
+		} else {
+			unsigned char run[128];
+
+			if(i>=len)
+				break;
+			memset(run, src[i++], 257-n);
+			put(&b, run, 257-n);
+		}
+	}
+	return corrupt(filename, &b);
+}
+
+/**** LZSS ****/
+
+static unsigned lzss_hash(const unsigned char *p) {
+	return (((uint32_t)p[0]<<16|p[1]<<8|p[2])*2654435761u)>>(32-LZSS_HASH_BITS);
+}
+
+/* index of the cheapest cost[] in a..b, a whole block at a time where it can */
+static size_t lzss_cheapest(const uint32_t *cost, const uint32_t *block_min, size_t a, size_t b) {
+	size_t j=a, at=a, block=(size_t)-1;
+	uint32_t m=UINT32_MAX;
+
+	while(j<=b) {
+		if(!(j%LZSS_BLOCK) && j+LZSS_BLOCK-1<=b) {
+			if(block_min[j/LZSS_BLOCK]<m) {
+				m=block_min[j/LZSS_BLOCK];
+				block=j;
+			}
+			j+=LZSS_BLOCK;
+		} else {
+			if(cost[j]<m) {
+				m=cost[j];
+				at=j;
+				block=(size_t)-1;
+			}
+			j++;
+		}
+	}
+	if(block!=(size_t)-1)
+		for(at=block;cost[at]!=m;at++) ;
+	return at;
+}
+
+/* longest match at each position through hash chains, then the cheapest
+ * parse found backwards from the end */
+static int lzss_compress(struct buf *b, const unsigned char *src, size_t len) {
+	int32_t *head, *prev;
+	uint16_t *match_len, *match_dist;
+	uint32_t *cost, *block_min;
+	size_t i;
+	unsigned flags_pos=0, nflags=8, item;
+
+	head=malloc(((size_t)1<<LZSS_HASH_BITS)*sizeof *head);
+	prev=malloc(len*sizeof *prev+1);
+	match_len=malloc(len*sizeof *match_len+1);
+	match_dist=malloc(len*sizeof *match_dist+1);
+	cost=malloc((len+1)*sizeof *cost);
+	block_min=malloc((len/LZSS_BLOCK+1)*sizeof *block_min);
+	if(!head || !prev || !match_len || !match_dist || !cost || !block_min) {
+		perror("malloc()");
+		free(head);
+		free(prev);
+		free(match_len);
+		free(match_dist);
+		free(cost);
+		free(block_min);
+		return 0;
+	}
+	memset(head, 0xff, ((size_t)1<<LZSS_HASH_BITS)*sizeof *head);
+	memset(block_min, 0xff, (len/LZSS_BLOCK+1)*sizeof *block_min);
+
+	for(i=0;i<len;i++) {
+		unsigned max=len-i<LZSS_MAX?len-i:LZSS_MAX, best=0, dist=0, depth, l, h;
+		int32_t p;
+
+		match_len[i]=0;
+		if(max<LZSS_MIN)
+			continue;
+		h=lzss_hash(src+i);
+		/* inside a long match the same distance is good for one less, so
+		 * runs of blank tiles do not walk the chain at every byte */
+		if(i && match_len[i-1]==LZSS_MAX) {
+			dist=match_dist[i-1];
+			for(best=LZSS_MAX-1;best<max && src[i-dist+best]==src[i+best];best++) ;
+		}
+		for(p=best<max?head[h]:-1,depth=0;p>=0 && i-p<=LZSS_WINDOW && depth<LZSS_MAX_CHAIN;p=prev[p],depth++) {
+			if(src[p+best]!=src[i+best])
+				continue;
+			for(l=0;l<max && src[p+l]==src[i+l];l++) ;
+			if(l>best) {
+				best=l;
+				dist=i-p;
+				if(l==max)
+					break;
+			}
+		}
+		if(best>=LZSS_MIN) {
+			match_len[i]=best;
+			match_dist[i]=dist;
+		}
+		prev[i]=head[h];
+		head[h]=i;
+	}
+
+	/* match_len becomes the length chosen, 0 for a literal */
+	cost[len]=0;
+	block_min[len/LZSS_BLOCK]=0;
+	for(i=len;i-->0;) {
+		unsigned l, best=0;
+
+		cost[i]=LZSS_LITERAL_BITS+cost[i+1];
+		for(l=LZSS_MIN;l<=match_len[i] && l<=LZSS_SHORT;l++) {
+			if(LZSS_MATCH_BITS+cost[i+l]<cost[i]) {
+				cost[i]=LZSS_MATCH_BITS+cost[i+l];
+				best=l;
+			}
+		}
+		/* long matches all cost the same, so only the cheapest rest counts */
+		if(match_len[i]>LZSS_SHORT) {
+			l=lzss_cheapest(cost, block_min, i+LZSS_SHORT+1, i+match_len[i])-i;
+			if(LZSS_LONG_BITS+cost[i+l]<cost[i]) {
+				cost[i]=LZSS_LONG_BITS+cost[i+l];
+				best=l;
+			}
+		}
+		match_len[i]=best;
+		if(cost[i]<block_min[i/LZSS_BLOCK])
+			block_min[i/LZSS_BLOCK]=cost[i];
+	}
+
+	for(i=0;;i+=match_len[i]?match_len[i]:1) {
+		if(nflags==8) {
+			flags_pos=b->len;
+			put_byte(b, 0);
+			nflags=0;
+		}
+		if(i>=len) {
+			put_byte(b, 0); /* end */
+			put_byte(b, 0);
+			break;
+		}
+		if(match_len[i]) {
+			item=(match_dist[i]-1)<<4|(match_len[i]>LZSS_SHORT?15:match_len[i]-2);
+			put_byte(b, item>>8);
+			put_byte(b, item);
+			if(match_len[i]>LZSS_SHORT)
+				put_byte(b, match_len[i]-LZSS_SHORT-1);
+		} else {
+			if(!b->failed)
+				b->data[flags_pos]|=1<<nflags;
+			put_byte(b, src[i]);
+		}
+		nflags++;
+	}
+	free(head);
+	free(prev);
+	free(match_len);
+	free(match_dist);
+	free(cost);
+	free(block_min);
+	return 1;
+}
+
+static unsigned char *lzss_decompress(const char *filename, const unsigned char *src, size_t len, size_t *out_len) {
+	struct buf b={NULL, 0, 0, 0};
+	size_t i=0;
+	unsigned flags=0, nflags=8, item, dist, n;
+
+	while(!b.failed) {
+		if(nflags==8) {
+			if(i>=len)
+				break;
+			flags=src[i++];
+			nflags=0;
+		}
+		if(flags>>nflags++&1) {
+			if(i>=len)
+				break;
+			put(&b, src+i++, 1);
+			continue;
+		}
+		if(len-i<2)
+			break;
+		item=src[i]<<8|src[i+1];
+		i+=2;
+		if(!(item&15))
+			return finish(&b, out_len);
+		dist=(item>>4)+1;
+		if(dist>b.len)
+			break;
+		n=(item&15)+2;
+		if((item&15)==15) {
+			if(i>=len)
+				break;
+			n=src[i++]+LZSS_SHORT+1;
+		}
+		/* byte by byte, the copy may overlap what it writes */
+		for(;n;n--)
+			put_byte(&b, b.data[b.len-dist]);
+	}
+	return corrupt(filename, &b);
+}
+
+/**** tile ****/
+
+static unsigned plane_fill(const unsigned char *plane) {
+	unsigned r;
+
+	for(r=1;r<8;r++)
+		if(plane[r]!=plane[0])
+			return 0;
+	if(plane[0]==0x00)
+		return 1;
+	if(plane[0]==0xff)
+		return 2;
+	return 0;
+}
+
+static void put_rows(struct buf *b, const unsigned char *plane) {
+	unsigned r, mask=0, above=0;
+
+	for(r=0;r<8;r++) {
+		if(plane[r]==above)
+			mask|=0x80>>r;
+		above=plane[r];
+	}
+	put_byte(b, mask);
+	for(r=0;r<8;r++)
+		if(!(mask&(0x80>>r)))
+			put_byte(b, plane[r]);
+}
+
+static int tile_compress(struct buf *b, const char *filename, const unsigned char *src, size_t len) {
+	const unsigned char *prev0=NULL;
+	size_t t;
+
+	if(len%PLANAR_TILE_SIZE) {
+		fprintf(stderr, "%s:the tile codec needs whole %u byte tiles.\n", filename, PLANAR_TILE_SIZE);
+		return 0;
+	}
+	for(t=0;t<len;t+=PLANAR_TILE_SIZE) {
+		const unsigned char *p0=src+t, *p1=src+t+8;
+		unsigned m0, m1;
+
+		m0=plane_fill(p0);
+		if(!m0 && prev0 && !memcmp(p0, prev0, 8))
+			m0=3;
+		m1=plane_fill(p1);
+		if(!m1 && !memcmp(p1, p0, 8))
+			m1=3;
+		put_byte(b, m0|m1<<2);
+		if(!m0)
+			put_rows(b, p0);
+		if(!m1)
+			put_rows(b, p1);
+		prev0=p0;
+	}
+	put_byte(b, TILE_END);
+	return 1;
+}
+
+/* decode a plane into dest, returns bytes used or 0 */
+static size_t get_plane(unsigned mode, const unsigned char *src, size_t len, unsigned char *dest, const unsigned char *copy) {
+	unsigned r, mask;
+	size_t i=0;
+
+	switch(mode) {
+		case 1:
+		case 2:
+			memset(dest, mode==1?0x00:0xff, 8);
+			return 0;
+		case 3:
+			memcpy(dest, copy, 8);
+			return 0;
+	}
+	if(!len)
+		return (size_t)-1;
+	mask=src[i++];
+	for(r=0;r<8;r++) {
+		if(mask&(0x80>>r)) {
+			dest[r]=r?dest[r-1]:0;
+		} else {
+			if(i>=len)
+				return (size_t)-1;
+			dest[r]=src[i++];
+		}
+	}
+	return i;
+}
+
+static unsigned char *tile_decompress(const char *filename, const unsigned char *src, size_t len, size_t *out_len) {
+	struct buf b={NULL, 0, 0, 0};
+	unsigned char tile[PLANAR_TILE_SIZE], prev0[8];
+	size_t i=0, n;
+	unsigned m;
+	int have_prev=0;
+
+	while(i<len && !b.failed) {
+		m=src[i++];
+		if(m==TILE_END)
+			return finish(&b, out_len);
+		if(m&0xf0 || ((m&3)==3 && !have_prev))
+			break;
+		n=get_plane(m&3, src+i, len-i, tile, prev0);
+		if(n==(size_t)-1)
+			break;
+		i+=n;
+		n=get_plane(m>>2&3, src+i, len-i, tile+8, tile);
+		if(n==(size_t)-1)
+			break;
+		i+=n;
+		put(&b, tile, sizeof tile);
+		memcpy(prev0, tile, 8);
+		have_prev=1;
+	}
+	return corrupt(filename, &b);
+}
+
+/**
+ * compress len bytes of src.
+ * @returns a malloc()ed buffer of *out_len bytes, or NULL on error.
+ */
+unsigned char *codec_compress(int codec, const char *filename, const unsigned char *src, size_t len, size_t *out_len) {
+	struct buf b={NULL, 0, 0, 0};
+	int ok=1;
+
+	switch(codec) {
+		case CODEC_RLE:
+			rle_compress(&b, src, len);
+			break;
+		case CODEC_LZSS:
+			ok=lzss_compress(&b, src, len);
+			break;
+		case CODEC_TILE:
+			ok=tile_compress(&b, filename, src, len);
+			break;
+		default:
+			put(&b, src, len);
+	}
+	if(!ok) {
+		free(b.data);
+		return NULL;
+	}
+	return finish(&b, out_len);
+}
+
+/**
+ * undo codec_compress(). bytes after the end code are ignored.
+ * @returns a malloc()ed buffer of *out_len bytes, or NULL on error.
+ */
+unsigned char *codec_decompress(int codec, const char *filename, const unsigned char *src, size_t len, size_t *out_len) {
+	struct buf b={NULL, 0, 0, 0};
+
+	switch(codec) {
+		case CODEC_RLE:
+			return rle_decompress(filename, src, len, out_len);
+		case CODEC_LZSS:
+			return lzss_decompress(filename, src, len, out_len);
+		case CODEC_TILE:
+			return tile_decompress(filename, src, len, out_len);
+	}
+	put(&b, src, len);
+	return finish(&b, out_len);
+}
@@ -0,0 +1,17 @@
+/* chrcodec.h
+ * compression for CHR data.
+ */
+#ifndef CHRCODEC_H
+#define CHRCODEC_H
+#include <stddef.h>
+
+#define CODEC_NONE 0
+#define CODEC_RLE 1
+#define CODEC_LZSS 2
+#define CODEC_TILE 3
+
+int codec_lookup(const char *name);
+const char *codec_name(int codec);
+unsigned char *codec_compress(int codec, const char *filename, const unsigned char *src, size_t len, size_t *out_len);
+unsigned char *codec_decompress(int codec, const char *filename, const unsigned char *src, size_t len, size_t *out_len);
+#endif
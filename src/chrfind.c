@@ -0,0 +1,395 @@
+/* chrfind.c
+ * finds 2bpp planar tile graphics stored inside a ROM, for games on
+ * CHR-RAM boards that keep their tiles in PRG.
+ *
+ * every byte offset is scored as the start of a tile. drawn graphics are
+ * coherent: a row tends to look like the row above it, and the two planes
+ * of a row tend to overlap. code and tables are not. the score counts the
+ * bits that stay the same between neighbouring rows of each plane and
+ * between the planes, 176 in all; random bytes average 88.
+ *
+ * for each of the 16 alignments the tiles are averaged over a short
+ * window, runs above the threshold become regions, and regions are ranked
+ * by how far they rise above random. overlapping regions from other
+ * alignments are dropped, as are regions whose bytes have so little
+ * entropy they are padding.
+ *
+ * the tile score can't place a region on its own: sparse tiles with blank
+ * edges score as well or better a few bytes off, where the seams fall
+ * inside the drawing. each region's start is then resolved within a tile
+ * by the plane comparisons alone. only at the true start does no plane
+ * comparison cross a tile boundary, and only there do the end tiles hold
+ * no bytes from outside the region. tiles drawn in one plane don't pair,
+ * so they keep the start the tile score gave.
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "image.h"
+#include "planar.h"
+#include "util.h"
+
+#define PROG_NAME "chrfind"
+#define SCORE_MAX 176
+#define SCORE_RANDOM 88
+#define WINDOW_TILES 8
+#define DEFAULT_THRESHOLD 112
+#define DEFAULT_COUNT 10
+#define MIN_ENTROPY 1.5 /* bits per byte */
+#define PHASE_SEARCH 7 /* bytes either side of a region's start */
+#define MIN_PAIRING 4 /* bits per tile the planes must pair by to move it */
+
+struct region {
+	size_t start, len; /* in bytes */
+	double excess; /* sum of score above random */
+	double mean;
+};
+
+static int verbose_fl;
+
+/* score every offset that has a whole tile after it. inlined into each
+ * kernel so the popcounts compile to the instruction where there is one. */
+static inline __attribute__((always_inline)) void score_range(const unsigned char *data, size_t len, unsigned char *score) {
+	size_t o;
+
+	for(o=0;o+PLANAR_TILE_SIZE<=len;o++) {
+		uint64_t p0=planar_load(data+o), p1=planar_load(data+o+8);
+		unsigned bits, changes;
+
+		/* nearly empty or full tiles say nothing either way */
+		bits=planar_popcount(p0)+planar_popcount(p1);
+		if(bits<6 || bits>122) {
+			score[o]=SCORE_RANDOM;
+			continue;
+		}
+		changes=planar_popcount(planar_row_changes(p0))
+			+planar_popcount(planar_row_changes(p1))
+			+planar_popcount(p0^p1);
+		score[o]=SCORE_MAX-changes;
+	}
+}
+
+static void score_generic(const unsigned char *data, size_t len, unsigned char *score) {
+	score_range(data, len, score);
+}
+
+#ifdef HAVE_CPU_DISPATCH
+__attribute__((target("popcnt")))
+static void score_popcnt(const unsigned char *data, size_t len, unsigned char *score) {
+	score_range(data, len, score);
+}
+#endif
+
+static void score_offsets(const unsigned char *data, size_t len, unsigned char *score) {
+#ifdef HAVE_CPU_DISPATCH
+	if(cpu_features()&CPU_POPCNT) {
+		score_popcnt(data, len, score);
+		return;
+	}
+#endif
+	score_generic(data, len, score);
+}
+
+static int add_region(struct region **regions, size_t *count, size_t *max, const struct region *r) {
+	if(*count==*max) {
+		size_t n=*max?*max*2:64;
+		struct region *tmp;
+
+		tmp=realloc(*regions, n*sizeof *tmp);
+		if(!tmp) {
+			perror("realloc()");
+			return 0;
+		}
+		*regions=tmp;
+		*max=n;
+	}
+	(*regions)[(*count)++]=*r;
+	return 1;
+}
+
+/* find runs of tiles at alignment phase whose windowed mean reaches the
+ * threshold. hot is scratch of at least ntiles bytes. */
+static int find_runs(const unsigned char *score, size_t len, unsigned phase, unsigned threshold, unsigned char *hot, struct region **regions, size_t *count, size_t *max) {
+	size_t ntiles, k, j, t, sum=0;
+	struct region r;
+
+	if(len<phase+PLANAR_TILE_SIZE)
+		return 1;
+	ntiles=(len-phase)/PLANAR_TILE_SIZE;
+	memset(hot, 0, ntiles);
+	for(k=0;k<ntiles;k++) {
+		sum+=score[phase+k*PLANAR_TILE_SIZE];
+		if(k>=WINDOW_TILES)
+			sum-=score[phase+(k-WINDOW_TILES)*PLANAR_TILE_SIZE];
+		if(k+1>=WINDOW_TILES && sum>=(size_t)threshold*WINDOW_TILES)
+			memset(hot+k+1-WINDOW_TILES, 1, WINDOW_TILES);
+	}
+
+	for(k=0;k<ntiles;k=j) {
+		if(!hot[k]) {
+			j=k+1;
+			continue;
+		}
+		for(j=k;j<ntiles && hot[j];j++) ;
+		/* the window drags in a few weak tiles at each end */
+		while(k<j && score[phase+k*PLANAR_TILE_SIZE]<threshold)
+			k++;
+		while(j>k && score[phase+(j-1)*PLANAR_TILE_SIZE]<threshold)
+			j--;
+		if(k==j)
+			continue;
+		r.start=phase+k*PLANAR_TILE_SIZE;
+		r.len=(j-k)*PLANAR_TILE_SIZE;
+		r.excess=0;
+		for(t=k;t<j;t++)
+			r.excess+=(double)score[phase+t*PLANAR_TILE_SIZE]-SCORE_RANDOM;
+		r.mean=SCORE_RANDOM+r.excess/(j-k);
+		if(!add_region(regions, count, max, &r))
+			return 0;
+	}
+	return 1;
+}
+
+static int region_cmp(const void *a, const void *b) {
+	const struct region *x=a, *y=b;
+
+	if(x->excess!=y->excess)
+		return x->excess>y->excess?-1:1;
+	return x->start<y->start?-1:x->start>y->start;
+}
+
+/* Shannon entropy of the bytes, in bits per byte */
+static double entropy(const unsigned char *data, size_t len) {
+	size_t hist[256], i;
+	double e=0;
+
+	memset(hist, 0, sizeof hist);
+	for(i=0;i<len;i++)
+		hist[data[i]]++;
+	for(i=0;i<256;i++) {
+		if(hist[i]) {
+			double p=(double)hist[i]/len;
+			e-=p*log2(p);
+		}
+	}
+	return e;
+}
+
+static int overlaps(const struct region *a, const struct region *b) {
+	return a->start<b->start+b->len && b->start<a->start+a->len;
+}
+
+/* keep the best regions that don't overlap a better one. count is
+ * updated to the number kept, at most limit. */
+static void pick_regions(const unsigned char *data, struct region *regions, size_t *count, unsigned limit) {
+	size_t i, j, kept=0;
+
+	qsort(regions, *count, sizeof *regions, region_cmp);
+	for(i=0;i<*count && kept<limit;i++) {
+		for(j=0;j<kept;j++)
+			if(overlaps(&regions[i], &regions[j]))
+				break;
+		if(j<kept)
+			continue;
+		if(entropy(data+regions[i].start, regions[i].len)<MIN_ENTROPY)
+			continue;
+		regions[kept++]=regions[i];
+	}
+	*count=kept;
+}
+
+/* how well tiles at start pair as planes. a row's two planes in one tile
+ * overlap, plane 1 of a tile and plane 0 of the next don't, so the score
+ * is the mean difference across each tile boundary less the mean within
+ * a tile, also left in pairing. an end tile that pairs worse than the
+ * mean has taken in bytes from outside the region, and is charged the
+ * difference. */
+static double phase_score(const unsigned char *data, size_t start, size_t tiles, double *pairing) {
+	const unsigned char *p=data+start;
+	double within=0, across=0, first=0, last=0, mean, penalty=0;
+	size_t t;
+
+	for(t=0;t<tiles;t++,p+=PLANAR_TILE_SIZE) {
+		last=planar_popcount(planar_load(p)^planar_load(p+8));
+		if(!t)
+			first=last;
+		within+=last;
+		if(t+1<tiles)
+			across+=planar_popcount(planar_load(p+8)^planar_load(p+PLANAR_TILE_SIZE));
+	}
+	mean=within/tiles;
+	*pairing=across/(tiles-1)-mean;
+	if(first>mean)
+		penalty+=first-mean;
+	if(last>mean)
+		penalty+=last-mean;
+	return *pairing-penalty;
+}
+
+/* move r to the start within PHASE_SEARCH bytes that pairs best, if its
+ * planes pair at all, and rescore it there */
+static void resolve_phase(const char *filename, const unsigned char *data, size_t len, const unsigned char *score, struct region *r) {
+	size_t tiles=r->len/PLANAR_TILE_SIZE, start, best_start=r->start, t;
+	double best, best_pairing, v, pairing;
+
+	if(tiles<2)
+		return;
+	best=phase_score(data, r->start, tiles, &best_pairing);
+	start=r->start>PHASE_SEARCH?r->start-PHASE_SEARCH:0;
+	for(;start<=r->start+PHASE_SEARCH && start+r->len<=len;start++) {
+		if(start==r->start)
+			continue;
+		v=phase_score(data, start, tiles, &pairing);
+		if(v>best) {
+			best=v;
+			best_pairing=pairing;
+			best_start=start;
+		}
+	}
+	if(best_start==r->start || best_pairing<MIN_PAIRING)
+		return;
+	if(verbose_fl)
+		fprintf(stderr, "%s: region at %08zx moved to %08zx\n", filename, r->start, best_start);
+	r->start=best_start;
+	r->excess=0;
+	for(t=0;t<tiles;t++)
+		r->excess+=(double)score[best_start+t*PLANAR_TILE_SIZE]-SCORE_RANDOM;
+	r->mean=SCORE_RANDOM+r->excess/tiles;
+}
+
+static int render(const char *prefix, unsigned index, const char *filename, const unsigned char *data, const struct region *r, unsigned tiles_per_row) {
+	struct image img;
+	char out_filename[512];
+	int ret;
+
+	if(snprintf(out_filename, sizeof out_filename, "%s-%02u.png", prefix, index)>=(int)sizeof out_filename) {
+		fprintf(stderr, "%s:name too long\n", prefix);
+		return 0;
+	}
+	if(!load_chr_data(filename, data+r->start, r->len, &img, 8, 8, 2, tiles_per_row))
+		return 0;
+	ret=save_png(out_filename, &img);
+	image_destroy(&img);
+	return ret;
+}
+
+static void usage(void) {
+	fprintf(stderr,
+		"usage: " PROG_NAME " [-v] [-n <count>] [-t <score>] [-r <prefix>] [-w <width>] <file>...\n"
+	);
+
+	fprintf(stderr,
+		"-n <count>  regions to report (default %d).\n"
+		"-t <score>  tile score a region must average, %d is random and\n"
+		"            %d perfect (default %d).\n"
+		"-r <prefix> render each region to <prefix>-NN.png.\n"
+		"-w <width>  tiles per row when rendering (default 16).\n"
+		"-v          verbose.\n",
+		DEFAULT_COUNT, SCORE_RANDOM, SCORE_MAX, DEFAULT_THRESHOLD
+	);
+}
+
+static int scan(const char *filename, unsigned limit, unsigned threshold, const char *prefix, unsigned tiles_per_row) {
+	unsigned char *data, *score=NULL, *hot=NULL;
+	struct region *regions=NULL;
+	size_t len, count=0, max=0, i;
+	unsigned phase;
+	int ret=0;
+
+	data=map_file(filename, &len);
+	if(!data)
+		return 0;
+	printf("** %s\n", filename);
+	if(len<PLANAR_TILE_SIZE) {
+		ret=1;
+		goto done;
+	}
+
+	score=malloc(len);
+	hot=malloc(len/PLANAR_TILE_SIZE+1);
+	if(!score || !hot) {
+		perror("malloc()");
+		goto done;
+	}
+	score_offsets(data, len, score);
+	for(phase=0;phase<PLANAR_TILE_SIZE;phase++)
+		if(!find_runs(score, len, phase, threshold, hot, &regions, &count, &max))
+			goto done;
+	if(verbose_fl)
+		fprintf(stderr, "%s: %zu candidate regions\n", filename, count);
+	pick_regions(data, regions, &count, limit);
+	for(i=0;i<count;i++)
+		resolve_phase(filename, data, len, score, &regions[i]);
+
+	for(i=0;i<count;i++) {
+		printf("  %08zx-%08zx %5zu tiles score %.1f\n", regions[i].start,
+			regions[i].start+regions[i].len-1, regions[i].len/PLANAR_TILE_SIZE, regions[i].mean);
+		if(prefix && !render(prefix, i, filename, data, &regions[i], tiles_per_row))
+			goto done;
+	}
+	ret=1;
+done:
+	free(score);
+	free(hot);
+	free(regions);
+	unmap_file(data, len);
+	return ret;
+}
+
+int main(int argc, char **argv) {
+	unsigned limit=DEFAULT_COUNT, threshold=DEFAULT_THRESHOLD, tiles_per_row=16;
+	const char *prefix=NULL;
+	char *endptr;
+	int c, i, ret=0;
+
+	while((c=getopt(argc, argv, "hvn:t:r:w:"))!=-1) {
+		switch(c) {
+			case 'v':
+				verbose_fl++;
+				break;
+			case 'n':
+				limit=strtoul(optarg, &endptr, 10);
+				if(*endptr) {
+					fprintf(stderr, "Error: -n takes a number.\n");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 't':
+				threshold=strtoul(optarg, &endptr, 10);
+				if(*endptr || threshold<=SCORE_RANDOM || threshold>SCORE_MAX) {
+					fprintf(stderr, "Error: -t takes a number from %d to %d.\n", SCORE_RANDOM+1, SCORE_MAX);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'r':
+				prefix=optarg;
+				break;
+			case 'w':
+				tiles_per_row=strtoul(optarg, &endptr, 10);
+				if(*endptr || !tiles_per_row) {
+					fprintf(stderr, "Error: -w takes a positive number.\n");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'h':
+			default:
+				usage();
+				return EXIT_FAILURE;
+		}
+	}
+	if(optind==argc) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	for(i=optind;i<argc;i++) {
+		if(!scan(argv[i], limit, threshold, prefix, tiles_per_row))
+			ret=EXIT_FAILURE;
+	}
+	return ret;
+}
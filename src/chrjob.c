@@ -0,0 +1,86 @@
+/* chrjob.c
+ * copies a file, has a kernel rewrite its CHR in chunks of tiles on the
+ * thread pool, and writes the copy out. the CHR-ROM of an iNES file is
+ * rewritten and the rest copied, anything else is all CHR.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chrjob.h"
+#include "ines.h"
+#include "planar.h"
+#include "pool.h"
+#include "util.h"
+
+struct chunk_job {
+	const struct chr_job *job;
+	const unsigned char *src;
+	unsigned char *dst;
+	size_t tiles;
+};
+
+static void chunk_job(void *arg, unsigned index) {
+	const struct chunk_job *c=arg;
+	size_t first=(size_t)index*CHRJOB_CHUNK_TILES, end=first+CHRJOB_CHUNK_TILES;
+
+	if(end>c->tiles)
+		end=c->tiles;
+	c->job->kernel(c->job->arg, c->src, c->dst, first, end);
+}
+
+/* returns 1 on success, and the number of tiles in *tiles if not NULL */
+int chr_job_file(const char *filename, const char *out_filename, const struct chr_job *job, unsigned threads, size_t *tiles) {
+	struct chunk_job c;
+	unsigned char *data, *out;
+	size_t len, ofs, chr_len;
+	FILE *f;
+	int ret=0;
+
+	data=map_file(filename, &len);
+	if(!data)
+		return 0;
+	if(!ines_find_chr(filename, data, len, &ofs, &chr_len))
+		goto done;
+	if(chr_len%PLANAR_TILE_SIZE)
+		fprintf(stderr, "%s:the last %u bytes are not a whole tile, left as they are.\n", filename, (unsigned)(chr_len%PLANAR_TILE_SIZE));
+	c.tiles=chr_len/PLANAR_TILE_SIZE;
+	if(job->prepare && !job->prepare(job->arg, filename, c.tiles))
+		goto done;
+	out=malloc(len+1);
+	if(!out) {
+		perror("malloc()");
+		goto done;
+	}
+	memcpy(out, data, len);
+
+	c.job=job;
+	c.src=data+ofs;
+	c.dst=out+ofs;
+	if(pool_run(threads, (c.tiles+CHRJOB_CHUNK_TILES-1)/CHRJOB_CHUNK_TILES, chunk_job, &c))
+		goto free_out;
+
+	f=fopen(out_filename, "wb");
+	if(!f) {
+		perror(out_filename);
+		goto free_out;
+	}
+	fwrite(out, 1, len, f);
+	if(ferror(f)) {
+		perror(out_filename);
+		fclose(f);
+		goto free_out;
+	}
+	if(fclose(f)) {
+		perror(out_filename);
+		goto free_out;
+	}
+	if(tiles)
+		*tiles=c.tiles;
+	ret=1;
+free_out:
+	free(out);
+done:
+	unmap_file(data, len);
+	return ret;
+}
@@ -0,0 +1,21 @@
+/* chrjob.h
+ * rewrites the CHR of a file tile by tile on the thread pool.
+ */
+#ifndef CHRJOB_H
+#define CHRJOB_H
+#include <stddef.h>
+
+#define CHRJOB_CHUNK_TILES 65536 /* tiles per pool job */
+
+struct chr_job {
+	/* optional, called with the tile count before anything is written.
+	 * returning 0 fails the file. */
+	int (*prepare)(void *arg, const char *filename, size_t tiles);
+	/* rewrites tiles first to end-1 from src into dst, both the start of
+	 * the CHR. runs on several threads at once, on different tiles. */
+	void (*kernel)(void *arg, const unsigned char *src, unsigned char *dst, size_t first, size_t end);
+	void *arg;
+};
+
+int chr_job_file(const char *filename, const char *out_filename, const struct chr_job *job, unsigned threads, size_t *tiles);
+#endif
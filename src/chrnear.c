@@ -0,0 +1,751 @@
+/* chrnear.c
+ * finds tiles that are nearly the same across a library of ROMs and CHR
+ * dumps, to spot edited art and tiles worth merging.
+ *
+ * chrnear [-j threads] -o index dir...
+ *   reads the CHR of every .nes and .chr file under each dir and writes a
+ *   BK-tree of the distinct 8x8 2bpp tiles.
+ * chrnear -q index [-d dist] [-n tile] file...
+ *   lists the indexed tiles within dist pixels of each tile of a .nes,
+ *   .chr or .png file.
+ *
+ * the distance between two tiles is the number of pixels that differ,
+ * popcount((a0^b0)|(a1^b1)) of their planes. it is a metric, so in the
+ * BK-tree a node's children hold the tiles at each distance from it and a
+ * search within d of a tile k away from the node only goes into children
+ * k-d to k+d. blank tiles are left out, they would match everything.
+ *
+ * the tree is laid out in preorder, so each subtree is one run of nodes:
+ * the first child of a node follows it and each child ends where its next
+ * sibling starts. siblings are in order of distance.
+ *
+ * Index file format (all numbers little-endian):
+ *  +--------+------+------------------------------------------+
+ *  | Offset | Size | Content(s)                               |
+ *  +--------+------+------------------------------------------+
+ *  |   0    |  8   | 'CHRNEAR' $00                            |
+ *  |   8    |  4   | number of files                          |
+ *  |  12    |  4   | number of nodes                          |
+ *  |  16    |  4   | number of occurrences                    |
+ *  |  20    |  4   | size of string table                     |
+ *  |  24    | 4*F  | string table offset of each file's path  |
+ *  |  ...   | 32*N | nodes, in preorder                       |
+ *  |        |      |   16 tile, 4 end of subtree,             |
+ *  |        |      |   4 first occurrence, 4 occurrences,     |
+ *  |        |      |   4 distance from the parent             |
+ *  |  ...   | 8*O  | occurrences, 4 file number, 4 tile number|
+ *  |  ...   |      | string table, NUL terminated paths       |
+ *  +--------+------+------------------------------------------+
+ */
+#define _XOPEN_SOURCE 700
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "image.h"
+#include "ines.h"
+#include "planar.h"
+#include "pool.h"
+#include "util.h"
+
+#define PROG_NAME "chrnear"
+#define INDEX_MAGIC "CHRNEAR"
+#define INDEX_HDR_SIZE 24
+#define NODE_SIZE 32
+#define OCC_SIZE 8
+#define MAX_DIST 64 /* pixels in a tile */
+#define DEFAULT_DIST 2
+
+/* macro to turn a macro into a string */
+#define _TOSTR(x) #x
+#define TOSTR(x) _TOSTR(x)
+
+/* a tile as read, before the distinct ones become nodes */
+struct tile_ref {
+	unsigned char tile[PLANAR_TILE_SIZE];
+	uint32_t file, number;
+};
+
+/* one file found by the walk, and its tiles */
+struct rom {
+	char *path;
+	struct tile_ref *refs;
+	size_t count;
+	int failed;
+};
+
+struct node {
+	unsigned char tile[PLANAR_TILE_SIZE];
+	uint32_t end, occ, occ_count, dist;
+};
+
+static int verbose_fl;
+
+/* nftw() has no user argument, so the walk collects into these */
+static struct rom *roms;
+static unsigned rom_count, rom_max;
+
+static unsigned tile_distance(const unsigned char *a, const unsigned char *b) {
+	return planar_popcount((planar_load(a)^planar_load(b))|(planar_load(a+8)^planar_load(b+8)));
+}
+
+static int blank_tile(const unsigned char *p) {
+	return !(planar_load(p)|planar_load(p+8));
+}
+
+static void load_job(void *arg, unsigned index) {
+	struct rom *rom=&roms[index];
+	const unsigned char *chr;
+	unsigned char *data;
+	size_t len, ofs, chr_len, i;
+
+	(void)arg;
+	data=map_file(rom->path, &len);
+	if(!data) {
+		rom->failed=1;
+		return;
+	}
+	if(!ines_find_chr(rom->path, data, len, &ofs, &chr_len)) {
+		rom->failed=1;
+		goto done;
+	}
+	chr=data+ofs;
+	rom->refs=malloc((chr_len/PLANAR_TILE_SIZE+1)*sizeof *rom->refs);
+	if(!rom->refs) {
+		perror(rom->path);
+		rom->failed=1;
+		goto done;
+	}
+	for(i=0;i+PLANAR_TILE_SIZE<=chr_len;i+=PLANAR_TILE_SIZE) {
+		struct tile_ref *r=&rom->refs[rom->count];
+
+		if(blank_tile(chr+i))
+			continue;
+		memcpy(r->tile, chr+i, PLANAR_TILE_SIZE);
+		r->file=index;
+		r->number=i/PLANAR_TILE_SIZE;
+		rom->count++;
+	}
+done:
+	unmap_file(data, len);
+}
+
+static int walk_file(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+	const char *ext;
+
+	(void)sb;
+	(void)ftwbuf;
+	if(typeflag!=FTW_F)
+		return 0;
+	ext=file_extension(fpath);
+	if(!ext || (strcasecmp(ext, ".nes") && strcasecmp(ext, ".chr")))
+		return 0;
+
+	if(rom_count==rom_max) {
+		struct rom *tmp;
+		unsigned max=rom_max?rom_max*2:256;
+
+		tmp=realloc(roms, max*sizeof *roms);
+		if(!tmp) {
+			perror("realloc()");
+			return -1;
+		}
+		roms=tmp;
+		rom_max=max;
+	}
+	memset(&roms[rom_count], 0, sizeof *roms);
+	roms[rom_count].path=strdup(fpath);
+	if(!roms[rom_count].path) {
+		perror("strdup()");
+		return -1;
+	}
+	rom_count++;
+	return 0;
+}
+
+static int ref_cmp(const void *a, const void *b) {
+	const struct tile_ref *x=a, *y=b;
+	int c=memcmp(x->tile, y->tile, PLANAR_TILE_SIZE);
+
+	if(c)
+		return c;
+	if(x->file!=y->file)
+		return x->file<y->file?-1:1;
+	if(x->number!=y->number)
+		return x->number<y->number?-1:1;
+	return 0;
+}
+
+/* a run of nodes still to be made into a subtree */
+struct range {
+	size_t start, end;
+};
+
+/* arrange nodes into a BK-tree in place. the first node of a run is the
+ * root of its subtree, the rest are sorted by their distance to it and
+ * each group of the same distance becomes a child subtree. */
+static int bk_build(struct node *nodes, size_t count) {
+	struct node *tmp;
+	unsigned char *dist;
+	struct range *stack;
+	size_t sp=0, i;
+
+	if(!count)
+		return 1;
+	tmp=malloc(count*sizeof *tmp);
+	dist=malloc(count);
+	/* each run pushes its children only after it is popped, and all the
+	 * runs on the stack are disjoint, so count is enough */
+	stack=malloc(count*sizeof *stack);
+	if(!tmp || !dist || !stack) {
+		perror("malloc()");
+		free(tmp);
+		free(dist);
+		free(stack);
+		return 0;
+	}
+	nodes[0].dist=0;
+	stack[sp].start=0;
+	stack[sp++].end=count;
+	while(sp) {
+		struct range r=stack[--sp];
+		size_t first[MAX_DIST+2];
+		unsigned d;
+
+		nodes[r.start].end=r.end;
+		if(r.end-r.start<2)
+			continue;
+		memset(first, 0, sizeof first);
+		for(i=r.start+1;i<r.end;i++) {
+			dist[i]=tile_distance(nodes[r.start].tile, nodes[i].tile);
+			first[dist[i]+1]++;
+		}
+		for(d=1;d<=MAX_DIST+1;d++)
+			first[d]+=first[d-1];
+		for(i=r.start+1;i<r.end;i++)
+			tmp[first[dist[i]]++]=nodes[i];
+		memcpy(nodes+r.start+1, tmp, (r.end-r.start-1)*sizeof *tmp);
+		/* first[d] is now where the group after d starts */
+		for(d=MAX_DIST+1;d-->0;) {
+			size_t start=r.start+1+(d?first[d-1]:0), end=r.start+1+first[d];
+
+			if(start==end)
+				continue;
+			nodes[start].dist=d;
+			stack[sp].start=start;
+			stack[sp++].end=end;
+		}
+	}
+	free(tmp);
+	free(dist);
+	free(stack);
+	return 1;
+}
+
+static void put32(FILE *f, uint32_t v) {
+	unsigned char b[4]={v, v>>8, v>>16, v>>24};
+	fwrite(b, 1, sizeof b, f);
+}
+
+static uint32_t get32(const unsigned char *p) {
+	return (uint32_t)p[0]|((uint32_t)p[1]<<8)|((uint32_t)p[2]<<16)|((uint32_t)p[3]<<24);
+}
+
+static int write_index(const char *filename, const struct node *nodes, size_t count, const struct tile_ref *refs, size_t ref_count) {
+	FILE *f;
+	unsigned i;
+	uint32_t ofs;
+	size_t j;
+
+	f=fopen(filename, "wb");
+	if(!f) {
+		perror(filename);
+		return 0;
+	}
+
+	fwrite(INDEX_MAGIC, 1, sizeof INDEX_MAGIC, f);
+	put32(f, rom_count);
+	put32(f, count);
+	put32(f, ref_count);
+	for(i=0, ofs=0;i<rom_count;i++)
+		ofs+=strlen(roms[i].path)+1;
+	put32(f, ofs);
+	for(i=0, ofs=0;i<rom_count;i++) {
+		put32(f, ofs);
+		ofs+=strlen(roms[i].path)+1;
+	}
+	for(j=0;j<count;j++) {
+		fwrite(nodes[j].tile, 1, PLANAR_TILE_SIZE, f);
+		put32(f, nodes[j].end);
+		put32(f, nodes[j].occ);
+		put32(f, nodes[j].occ_count);
+		put32(f, nodes[j].dist);
+	}
+	for(j=0;j<ref_count;j++) {
+		put32(f, refs[j].file);
+		put32(f, refs[j].number);
+	}
+	for(i=0;i<rom_count;i++)
+		fwrite(roms[i].path, 1, strlen(roms[i].path)+1, f);
+
+	if(ferror(f) || fclose(f)) {
+		perror(filename);
+		return 0;
+	}
+	return 1;
+}
+
+static int build(const char *out_filename, char **dirs, int ndirs, unsigned threads) {
+	struct tile_ref *refs;
+	struct node *nodes;
+	size_t ref_count=0, count=0, j;
+	unsigned i;
+	int d, res=0;
+
+	for(d=0;d<ndirs;d++) {
+		if(nftw(dirs[d], walk_file, 64, FTW_PHYS)) {
+			perror(dirs[d]);
+			return 0;
+		}
+	}
+
+	if(pool_run(threads, rom_count, load_job, NULL))
+		return 0;
+
+	for(i=0;i<rom_count;i++)
+		ref_count+=roms[i].count;
+	if(ref_count>UINT32_MAX) {
+		fprintf(stderr, "%s:too many tiles.\n", out_filename);
+		return 0;
+	}
+	refs=malloc((ref_count?ref_count:1)*sizeof *refs);
+	if(!refs) {
+		perror("malloc()");
+		return 0;
+	}
+	for(i=0, ref_count=0;i<rom_count;i++) {
+		if(roms[i].count)
+			memcpy(refs+ref_count, roms[i].refs, roms[i].count*sizeof *refs);
+		ref_count+=roms[i].count;
+		free(roms[i].refs);
+	}
+	/* equal tiles end up together, their occurrences in file order */
+	qsort(refs, ref_count, sizeof *refs, ref_cmp);
+
+	for(j=0;j<ref_count;j++)
+		if(!j || memcmp(refs[j].tile, refs[j-1].tile, PLANAR_TILE_SIZE))
+			count++;
+	nodes=malloc((count?count:1)*sizeof *nodes);
+	if(!nodes) {
+		perror("malloc()");
+		free(refs);
+		return 0;
+	}
+	for(j=0, count=0;j<ref_count;j++) {
+		if(!j || memcmp(refs[j].tile, refs[j-1].tile, PLANAR_TILE_SIZE)) {
+			memcpy(nodes[count].tile, refs[j].tile, PLANAR_TILE_SIZE);
+			nodes[count].occ=j;
+			nodes[count].occ_count=0;
+			count++;
+		}
+		nodes[count-1].occ_count++;
+	}
+
+	if(bk_build(nodes, count))
+		res=write_index(out_filename, nodes, count, refs, ref_count);
+	if(res && verbose_fl)
+		fprintf(stderr, "%s: %u files, %zu tiles, %zu distinct\n", out_filename, rom_count, ref_count, count);
+	free(nodes);
+	free(refs);
+	return res;
+}
+
+/* an index mapped in memory */
+struct index {
+	unsigned char *data;
+	size_t len;
+	uint32_t files, count, occ_count;
+	const unsigned char *names, *nodes, *occs, *strings;
+	uint32_t strings_len;
+};
+
+#define NODE(idx, i) ((idx)->nodes+(size_t)NODE_SIZE*(i))
+#define NODE_END(idx, i) get32(NODE(idx, i)+16)
+#define NODE_OCC(idx, i) get32(NODE(idx, i)+20)
+#define NODE_OCC_COUNT(idx, i) get32(NODE(idx, i)+24)
+#define NODE_DIST(idx, i) get32(NODE(idx, i)+28)
+
+/* check that the subtrees nest, so a search can trust the ends */
+static int check_tree(const struct index *idx) {
+	uint32_t *stack, sp=0, i, end;
+	int ok=1;
+
+	if(!idx->count)
+		return 1;
+	stack=malloc(idx->count*sizeof *stack);
+	if(!stack) {
+		perror("malloc()");
+		return 0;
+	}
+	for(i=0;i<idx->count && ok;i++) {
+		while(sp && NODE_END(idx, stack[sp-1])<=i)
+			sp--;
+		end=NODE_END(idx, i);
+		if(end<=i || (sp?end>NODE_END(idx, stack[sp-1]):i || end!=idx->count)
+			|| (uint64_t)NODE_OCC(idx, i)+NODE_OCC_COUNT(idx, i)>idx->occ_count
+			|| NODE_DIST(idx, i)>MAX_DIST)
+			ok=0;
+		stack[sp++]=i;
+	}
+	free(stack);
+	return ok;
+}
+
+static int open_index(const char *filename, struct index *idx) {
+	idx->data=map_file(filename, &idx->len);
+	if(!idx->data)
+		return 0;
+	if(idx->len<INDEX_HDR_SIZE || memcmp(idx->data, INDEX_MAGIC, sizeof INDEX_MAGIC))
+		goto bad;
+	idx->files=get32(idx->data+8);
+	idx->count=get32(idx->data+12);
+	idx->occ_count=get32(idx->data+16);
+	idx->strings_len=get32(idx->data+20);
+	if((uint64_t)INDEX_HDR_SIZE+4ull*idx->files+(uint64_t)NODE_SIZE*idx->count+(uint64_t)OCC_SIZE*idx->occ_count+idx->strings_len!=idx->len)
+		goto bad;
+	idx->names=idx->data+INDEX_HDR_SIZE;
+	idx->nodes=idx->names+4*idx->files;
+	idx->occs=idx->nodes+(size_t)NODE_SIZE*idx->count;
+	idx->strings=idx->occs+(size_t)OCC_SIZE*idx->occ_count;
+	if(idx->strings_len && idx->strings[idx->strings_len-1])
+		goto bad;
+	if(!check_tree(idx))
+		goto bad;
+	return 1;
+bad:
+	fprintf(stderr, "%s:Not a valid index.\n", filename);
+	unmap_file(idx->data, idx->len);
+	return 0;
+}
+
+static const char *index_path(const struct index *idx, uint32_t file) {
+	uint32_t ofs;
+
+	if(file>=idx->files)
+		return "?";
+	ofs=get32(idx->names+4*file);
+	return ofs<idx->strings_len?(const char *)idx->strings+ofs:"?";
+}
+
+/* a node within reach of a query tile */
+struct hit {
+	uint32_t node, dist;
+};
+
+/* a growing array of nodes still to visit */
+struct node_stack {
+	uint32_t *nodes;
+	size_t count, max;
+};
+
+static int push_node(struct node_stack *st, uint32_t node) {
+	if(st->count==st->max) {
+		size_t n=st->max?st->max*2:64;
+		uint32_t *tmp;
+
+		tmp=realloc(st->nodes, n*sizeof *tmp);
+		if(!tmp) {
+			perror("realloc()");
+			return 0;
+		}
+		st->nodes=tmp;
+		st->max=n;
+	}
+	st->nodes[st->count++]=node;
+	return 1;
+}
+
+static int add_hit(struct hit **hits, size_t *count, size_t *max, uint32_t node, unsigned dist) {
+	if(*count==*max) {
+		size_t n=*max?*max*2:16;
+		struct hit *tmp;
+
+		tmp=realloc(*hits, n*sizeof *tmp);
+		if(!tmp) {
+			perror("realloc()");
+			return 0;
+		}
+		*hits=tmp;
+		*max=n;
+	}
+	(*hits)[*count].node=node;
+	(*hits)[(*count)++].dist=dist;
+	return 1;
+}
+
+/* walk the tree for every node within max_dist of tile. inlined into each
+ * kernel so the popcounts compile to the instruction where there is one.
+ * @returns 0 if out of memory */
+static inline __attribute__((always_inline)) int bk_search(const struct index *idx, const unsigned char *tile, unsigned max_dist, struct hit **hits, size_t *count) {
+	uint64_t q0=planar_load(tile), q1=planar_load(tile+8);
+	struct node_stack st={NULL, 0, 0};
+	size_t hit_max=0;
+	uint32_t i, c, end;
+	unsigned d, cd;
+	int ok=1;
+
+	if(idx->count)
+		ok=push_node(&st, 0);
+	while(ok && st.count) {
+		const unsigned char *n;
+
+		i=st.nodes[--st.count];
+		n=NODE(idx, i);
+		d=planar_popcount((q0^planar_load(n))|(q1^planar_load(n+8)));
+		if(d<=max_dist)
+			ok=add_hit(hits, count, &hit_max, i, d);
+		/* children are in order of distance, so stop past d+max_dist */
+		end=get32(n+16);
+		for(c=i+1;ok && c<end;c=NODE_END(idx, c)) {
+			cd=NODE_DIST(idx, c);
+			if(cd>d+max_dist)
+				break;
+			if(cd+max_dist>=d)
+				ok=push_node(&st, c);
+		}
+	}
+	free(st.nodes);
+	return ok;
+}
+
+static int search_generic(const struct index *idx, const unsigned char *tile, unsigned max_dist, struct hit **hits, size_t *count) {
+	return bk_search(idx, tile, max_dist, hits, count);
+}
+
+#ifdef HAVE_CPU_DISPATCH
+__attribute__((target("popcnt")))
+static int search_popcnt(const struct index *idx, const unsigned char *tile, unsigned max_dist, struct hit **hits, size_t *count) {
+	return bk_search(idx, tile, max_dist, hits, count);
+}
+#endif
+
+/* the tiles of a query file and what each of them found */
+struct query_job {
+	const struct index *idx;
+	const unsigned char *chr;
+	unsigned first; /* tile number of chr[0] */
+	unsigned max_dist;
+	struct hit **hits;
+	size_t *hit_count;
+	int failed;
+};
+
+static int hit_cmp(const void *a, const void *b) {
+	const struct hit *x=a, *y=b;
+
+	if(x->dist!=y->dist)
+		return x->dist<y->dist?-1:1;
+	if(x->node!=y->node)
+		return x->node<y->node?-1:1;
+	return 0;
+}
+
+static void query_job(void *arg, unsigned index) {
+	struct query_job *job=arg;
+	const unsigned char *tile=job->chr+(size_t)index*PLANAR_TILE_SIZE;
+	int ok;
+
+	if(blank_tile(tile))
+		return;
+#ifdef HAVE_CPU_DISPATCH
+	if(cpu_features()&CPU_POPCNT)
+		ok=search_popcnt(job->idx, tile, job->max_dist, &job->hits[index], &job->hit_count[index]);
+	else
+#endif
+	ok=search_generic(job->idx, tile, job->max_dist, &job->hits[index], &job->hit_count[index]);
+	if(!ok)
+		job->failed=1;
+	else
+		qsort(job->hits[index], job->hit_count[index], sizeof *job->hits[index], hit_cmp);
+}
+
+/* the CHR of a query file, as a malloc()ed copy */
+static unsigned char *load_query(const char *filename, size_t *len) {
+	unsigned char *data, *copy=NULL;
+	const char *ext=file_extension(filename);
+	size_t data_len, ofs;
+
+	if(ext && !strcasecmp(ext, ".png")) {
+		struct image img;
+
+		if(!load_png(filename, &img))
+			return NULL;
+		copy=image_to_chr(filename, &img, 8, 8, len);
+		image_destroy(&img);
+		return copy;
+	}
+	data=map_file(filename, &data_len);
+	if(!data)
+		return NULL;
+	if(ines_find_chr(filename, data, data_len, &ofs, len)) {
+		copy=malloc(*len+1);
+		if(!copy)
+			perror("malloc()");
+		else
+			memcpy(copy, data+ofs, *len);
+	}
+	unmap_file(data, data_len);
+	return copy;
+}
+
+static int query(const struct index *idx, const char *filename, unsigned max_dist, long only_tile, unsigned threads) {
+	struct query_job job;
+	unsigned char *chr;
+	size_t len, i, j, k;
+	unsigned tiles;
+
+	chr=load_query(filename, &len);
+	if(!chr)
+		return 0;
+	tiles=len/PLANAR_TILE_SIZE;
+	memset(&job, 0, sizeof job);
+	job.idx=idx;
+	job.chr=chr;
+	job.max_dist=max_dist;
+	if(only_tile>=0) {
+		if((unsigned long)only_tile>=tiles) {
+			fprintf(stderr, "%s:no tile %ld, there are %u.\n", filename, only_tile, tiles);
+			free(chr);
+			return 0;
+		}
+		job.chr+=(size_t)only_tile*PLANAR_TILE_SIZE;
+		job.first=only_tile;
+		tiles=1;
+	}
+	job.hits=calloc(tiles?tiles:1, sizeof *job.hits);
+	job.hit_count=calloc(tiles?tiles:1, sizeof *job.hit_count);
+	if(!job.hits || !job.hit_count) {
+		perror(filename);
+		free(job.hits);
+		free(job.hit_count);
+		free(chr);
+		return 0;
+	}
+
+	if(pool_run(threads, tiles, query_job, &job))
+		job.failed=1;
+	if(!job.failed) {
+		printf("** %s\n", filename);
+		for(i=0;i<tiles;i++) {
+			for(j=0;j<job.hit_count[i];j++) {
+				const struct hit *h=&job.hits[i][j];
+				uint32_t occ=NODE_OCC(idx, h->node);
+
+				for(k=0;k<NODE_OCC_COUNT(idx, h->node);k++) {
+					const unsigned char *o=idx->occs+(size_t)OCC_SIZE*(occ+k);
+
+					printf("  %u %u %s:%u\n", (unsigned)(job.first+i), (unsigned)h->dist,
+						index_path(idx, get32(o)), (unsigned)get32(o+4));
+				}
+			}
+		}
+	}
+
+	for(i=0;i<tiles;i++)
+		free(job.hits[i]);
+	free(job.hits);
+	free(job.hit_count);
+	free(chr);
+	return !job.failed;
+}
+
+static void usage(void) {
+	fprintf(stderr,
+		"usage: " PROG_NAME " [-v] [-j <n>] -o <index> <dir>...\n"
+		"       " PROG_NAME " [-j <n>] [-d <dist>] [-n <tile>] -q <index> <file>...\n"
+	);
+
+	fprintf(stderr,
+		"-o <index>  write an index of the tiles of every .nes and .chr file\n"
+		"            under each dir.\n"
+		"-q <index>  list the indexed tiles near each tile of a .nes, .chr or\n"
+		"            .png file, as: tile distance path:tile.\n"
+		"-d <dist>   most pixels that may differ (default " TOSTR(DEFAULT_DIST) ").\n"
+		"-n <tile>   look up only this tile of each file.\n"
+		"-j <n>      number of threads (default is one per processor).\n"
+		"-v          verbose.\n"
+	);
+}
+
+int main(int argc, char **argv) {
+	const char *out_filename=NULL, *index_filename=NULL;
+	unsigned threads=pool_threads(), max_dist=DEFAULT_DIST;
+	long only_tile=-1;
+	struct index idx;
+	char *endptr;
+	int c, i, ret=0;
+
+	while((c=getopt(argc, argv, "hvo:q:j:d:n:"))!=-1) {
+		switch(c) {
+			case 'v':
+				verbose_fl++;
+				break;
+			case 'o':
+				out_filename=optarg;
+				break;
+			case 'q':
+				index_filename=optarg;
+				break;
+			case 'd':
+				max_dist=strtoul(optarg, &endptr, 10);
+				if(*endptr || max_dist>MAX_DIST) {
+					fprintf(stderr, "Error: -d takes a number from 0 to %u.\n", MAX_DIST);
+					usage();
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'n':
+				only_tile=strtol(optarg, &endptr, 0);
+				if(*endptr || only_tile<0) {
+					fprintf(stderr, "Error: -n takes a tile number.\n");
+					usage();
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'j':
+				threads=strtoul(optarg, &endptr, 10);
+				if(*endptr || !threads) {
+					fprintf(stderr, "Error: -j takes a positive number.\n");
+					usage();
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'h':
+			default:
+				usage();
+				return EXIT_FAILURE;
+		}
+	}
+
+	if(optind==argc || !out_filename==!index_filename) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	if(out_filename)
+		return build(out_filename, argv+optind, argc-optind, threads)?0:EXIT_FAILURE;
+
+	if(!open_index(index_filename, &idx))
+		return EXIT_FAILURE;
+	for(i=optind;i<argc;i++) {
+		if(!query(&idx, argv[i], max_dist, only_tile, threads))
+			ret=EXIT_FAILURE;
+	}
+	unmap_file(idx.data, idx.len);
+	return ret;
+}
@@ -0,0 +1,747 @@
+/* chrpack.c
+ * packs the tiles of several scenes into CHR banks for mappers that switch
+ * CHR in 1K/2K banks, storing tiles that scenes share only once.
+ *
+ * each input .chr holds the tiles one scene needs on screen at the same
+ * time. every scene must find all of its tiles in at most -w banks (the
+ * banks it can have mapped at once). the output is a CHR image and a map
+ * giving the banks of each scene and the bank:slot of each of its tiles.
+ *
+ * finding the fewest banks is NP-hard (it is the "pagination" variant of
+ * bin packing), so this is a greedy heuristic in two passes. first:
+ *  1. tiles are deduplicated across all scenes.
+ *  2. tiles used by exactly the same set of scenes form a group, they can
+ *     go anywhere the others go.
+ *  3. groups are placed most-shared first. each goes in a bank that takes
+ *     all of it if there is one, then the bank already serving the most of
+ *     its scenes, without pushing any of its scenes over the window.
+ *  4. if that is impossible, the rest of the group is stored again for each
+ *     scene separately, trading ROM for a layout that fits.
+ * this packs well but can paint a scene into a corner when the window is
+ * tight. if it does, the second pass lays out one scene at a time, largest
+ * first: it maps the existing banks that cover the most of the scene's
+ * tiles while the rest still fits, and puts the remainder in free slots of
+ * those banks or new ones. that always succeeds if every scene fits its
+ * window at all.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hash64.h"
+#include "util.h"
+
+#define PROG_NAME "chrpack"
+#define TILE_SIZE 16
+
+struct scene {
+	const char *filename;
+	unsigned char *data;
+	size_t len;
+	unsigned ntiles;
+	uint32_t *uid; /* unique tile of each input tile */
+	uint32_t *distinct; /* each unique tile once, most shared first */
+	unsigned ndistinct;
+	unsigned nbanks;
+	unsigned *banks; /* at most window entries */
+};
+
+/* where a copy of a tile was stored */
+struct loc {
+	uint32_t bank, slot;
+};
+
+/* a unique tile, with the scenes that use it in ascending order */
+struct utile {
+	const unsigned char *data;
+	unsigned *scenes;
+	unsigned nscenes, max;
+	unsigned rank; /* position in packer.order */
+	struct loc *locs;
+	unsigned nlocs, maxlocs;
+};
+
+/* a run of unique tiles used by the same scenes */
+struct group {
+	unsigned start, count;
+};
+
+/* tile uid lives at bank:slot for scene */
+struct place {
+	uint32_t scene, uid, bank, slot;
+};
+
+struct packer {
+	unsigned bank_tiles, window;
+	struct scene *scenes;
+	unsigned nscenes;
+	struct utile *tiles;
+	unsigned ntiles;
+	uint32_t *order; /* uids sorted by scene set */
+	struct group *groups;
+	unsigned ngroups;
+	unsigned *used; /* tiles used in each bank */
+	unsigned *cover; /* scratch for the second pass, per bank */
+	unsigned nbanks, maxbanks;
+	unsigned char *chr;
+	struct place *places;
+	size_t nplaces, maxplaces;
+	unsigned copies; /* tiles stored more than once */
+	unsigned failed; /* scene that did not fit */
+};
+
+static int verbose_fl;
+
+/* dedup every tile of every scene with an open addressed hash table. */
+static int dedup_tiles(struct packer *pk) {
+	size_t total=0, size, h;
+	uint32_t *table;
+	unsigned s, t;
+
+	for(s=0;s<pk->nscenes;s++)
+		total+=pk->scenes[s].ntiles;
+	for(size=16;size<total*2;size*=2) ;
+	table=malloc(size*sizeof *table);
+	pk->tiles=calloc(total?total:1, sizeof *pk->tiles);
+	if(!table || !pk->tiles) {
+		perror("malloc()");
+		free(table);
+		return 0;
+	}
+	memset(table, 0xff, size*sizeof *table);
+
+	for(s=0;s<pk->nscenes;s++) {
+		struct scene *sc=&pk->scenes[s];
+
+		sc->uid=malloc((sc->ntiles?sc->ntiles:1)*sizeof *sc->uid);
+		sc->distinct=malloc((sc->ntiles?sc->ntiles:1)*sizeof *sc->distinct);
+		if(!sc->uid || !sc->distinct) {
+			perror("malloc()");
+			free(table);
+			return 0;
+		}
+		for(t=0;t<sc->ntiles;t++) {
+			const unsigned char *p=sc->data+t*TILE_SIZE;
+			struct utile *u;
+
+			for(h=hash64(p, TILE_SIZE, 0)&(size-1);table[h]!=UINT32_MAX;h=(h+1)&(size-1)) {
+				if(!memcmp(pk->tiles[table[h]].data, p, TILE_SIZE))
+					break;
+			}
+			if(table[h]==UINT32_MAX) {
+				table[h]=pk->ntiles;
+				pk->tiles[pk->ntiles++].data=p;
+			}
+			sc->uid[t]=table[h];
+
+			/* scenes are visited in order, so the list stays sorted */
+			u=&pk->tiles[table[h]];
+			if(u->nscenes && u->scenes[u->nscenes-1]==s)
+				continue;
+			if(u->nscenes==u->max) {
+				unsigned *tmp;
+
+				u->max=u->max?u->max*2:2;
+				tmp=realloc(u->scenes, u->max*sizeof *tmp);
+				if(!tmp) {
+					perror("realloc()");
+					free(table);
+					return 0;
+				}
+				u->scenes=tmp;
+			}
+			u->scenes[u->nscenes++]=s;
+			sc->distinct[sc->ndistinct++]=table[h];
+		}
+	}
+	free(table);
+	return 1;
+}
+
+static const struct packer *sort_pk; /* qsort() has no user argument */
+
+/* most shared first, then by scene list so equal sets are adjacent */
+static int tile_cmp(const void *a, const void *b) {
+	const struct utile *x=&sort_pk->tiles[*(const uint32_t*)a];
+	const struct utile *y=&sort_pk->tiles[*(const uint32_t*)b];
+	unsigned i;
+
+	if(x->nscenes!=y->nscenes)
+		return x->nscenes>y->nscenes?-1:1;
+	for(i=0;i<x->nscenes;i++) {
+		if(x->scenes[i]!=y->scenes[i])
+			return x->scenes[i]<y->scenes[i]?-1:1;
+	}
+	return *(const uint32_t*)a<*(const uint32_t*)b?-1:1;
+}
+
+static int rank_cmp(const void *a, const void *b) {
+	unsigned x=sort_pk->tiles[*(const uint32_t*)a].rank;
+	unsigned y=sort_pk->tiles[*(const uint32_t*)b].rank;
+
+	return x<y?-1:x>y;
+}
+
+static int same_scenes(const struct utile *x, const struct utile *y) {
+	return x->nscenes==y->nscenes && !memcmp(x->scenes, y->scenes, x->nscenes*sizeof *x->scenes);
+}
+
+/* larger sharing first, then larger groups */
+static int group_cmp(const void *a, const void *b) {
+	const struct group *x=a, *y=b;
+	const struct utile *tx=&sort_pk->tiles[sort_pk->order[x->start]];
+	const struct utile *ty=&sort_pk->tiles[sort_pk->order[y->start]];
+
+	if(tx->nscenes!=ty->nscenes)
+		return tx->nscenes>ty->nscenes?-1:1;
+	if(x->count!=y->count)
+		return x->count>y->count?-1:1;
+	return x->start<y->start?-1:1;
+}
+
+/* sort the unique tiles into groups, most shared first */
+static int group_tiles(struct packer *pk) {
+	unsigned i;
+
+	pk->order=malloc((pk->ntiles?pk->ntiles:1)*sizeof *pk->order);
+	pk->groups=malloc((pk->ntiles?pk->ntiles:1)*sizeof *pk->groups);
+	if(!pk->order || !pk->groups) {
+		perror("malloc()");
+		return 0;
+	}
+	for(i=0;i<pk->ntiles;i++)
+		pk->order[i]=i;
+	sort_pk=pk;
+	qsort(pk->order, pk->ntiles, sizeof *pk->order, tile_cmp);
+	for(i=0;i<pk->ntiles;i++) {
+		pk->tiles[pk->order[i]].rank=i;
+		if(i && same_scenes(&pk->tiles[pk->order[i]], &pk->tiles[pk->order[i-1]])) {
+			pk->groups[pk->ngroups-1].count++;
+		} else {
+			pk->groups[pk->ngroups].start=i;
+			pk->groups[pk->ngroups].count=1;
+			pk->ngroups++;
+		}
+	}
+	qsort(pk->groups, pk->ngroups, sizeof *pk->groups, group_cmp);
+	for(i=0;i<pk->nscenes;i++)
+		qsort(pk->scenes[i].distinct, pk->scenes[i].ndistinct, sizeof *pk->scenes[i].distinct, rank_cmp);
+	if(verbose_fl)
+		fprintf(stderr, "%u unique tiles in %u groups\n", pk->ntiles, pk->ngroups);
+	return 1;
+}
+
+static int scene_has_bank(const struct scene *sc, unsigned bank) {
+	unsigned i;
+
+	for(i=0;i<sc->nbanks;i++)
+		if(sc->banks[i]==bank)
+			return 1;
+	return 0;
+}
+
+static int new_bank(struct packer *pk) {
+	if(pk->nbanks==pk->maxbanks) {
+		unsigned max=pk->maxbanks?pk->maxbanks*2:16;
+		unsigned *used, *cover;
+		unsigned char *chr;
+
+		used=realloc(pk->used, max*sizeof *used);
+		if(used)
+			pk->used=used;
+		cover=realloc(pk->cover, max*sizeof *cover);
+		if(cover)
+			pk->cover=cover;
+		chr=realloc(pk->chr, (size_t)max*pk->bank_tiles*TILE_SIZE);
+		if(chr)
+			pk->chr=chr;
+		if(!used || !cover || !chr) {
+			perror("realloc()");
+			return -1;
+		}
+		pk->maxbanks=max;
+	}
+	pk->used[pk->nbanks]=0;
+	memset(pk->chr+(size_t)pk->nbanks*pk->bank_tiles*TILE_SIZE, 0, pk->bank_tiles*TILE_SIZE);
+	return pk->nbanks++;
+}
+
+static int add_place(struct packer *pk, uint32_t scene, uint32_t uid, uint32_t bank, uint32_t slot) {
+	if(pk->nplaces==pk->maxplaces) {
+		size_t max=pk->maxplaces?pk->maxplaces*2:1024;
+		struct place *tmp;
+
+		tmp=realloc(pk->places, max*sizeof *tmp);
+		if(!tmp) {
+			perror("realloc()");
+			return 0;
+		}
+		pk->places=tmp;
+		pk->maxplaces=max;
+	}
+	pk->places[pk->nplaces].scene=scene;
+	pk->places[pk->nplaces].uid=uid;
+	pk->places[pk->nplaces].bank=bank;
+	pk->places[pk->nplaces].slot=slot;
+	pk->nplaces++;
+	return 1;
+}
+
+/* store a copy of tile uid in the next slot of bank.
+ * @returns the slot, or -1 on error */
+static long store_tile(struct packer *pk, uint32_t uid, unsigned bank) {
+	struct utile *u=&pk->tiles[uid];
+	unsigned slot=pk->used[bank]++;
+
+	memcpy(pk->chr+((size_t)bank*pk->bank_tiles+slot)*TILE_SIZE, u->data, TILE_SIZE);
+	if(u->nlocs)
+		pk->copies++;
+	if(u->nlocs==u->maxlocs) {
+		unsigned max=u->maxlocs?u->maxlocs*2:1;
+		struct loc *tmp;
+
+		tmp=realloc(u->locs, max*sizeof *tmp);
+		if(!tmp) {
+			perror("realloc()");
+			return -1;
+		}
+		u->locs=tmp;
+		u->maxlocs=max;
+	}
+	u->locs[u->nlocs].bank=bank;
+	u->locs[u->nlocs].slot=slot;
+	u->nlocs++;
+	return slot;
+}
+
+/* place count tiles from uids so every scene in scenes can reach them.
+ * @returns number of tiles that could not be placed, or -1 on error */
+static long place_tiles(struct packer *pk, const unsigned *scenes, unsigned nscenes, const uint32_t *uids, unsigned count) {
+	unsigned b, i, k, aff, fits, best_aff=0, best_fits=0;
+	long slot;
+	int best;
+
+	while(count>0) {
+		best=-1;
+		for(b=0;b<pk->nbanks;b++) {
+			if(pk->used[b]==pk->bank_tiles)
+				continue;
+			for(i=0, aff=0;i<nscenes;i++) {
+				const struct scene *sc=&pk->scenes[scenes[i]];
+
+				if(scene_has_bank(sc, b))
+					aff++;
+				else if(sc->nbanks>=pk->window)
+					break;
+			}
+			if(i<nscenes)
+				continue; /* would push a scene over the window */
+			/* splitting a group costs its scenes a window slot each, so
+			 * a bank that takes the rest of it wins, then affinity, then
+			 * the tightest fit. */
+			fits=pk->bank_tiles-pk->used[b]>=count;
+			if(best<0 || fits>best_fits || (fits==best_fits && (aff>best_aff
+			|| (aff==best_aff && (fits?pk->used[b]>pk->used[best]:pk->used[b]<pk->used[best]))))) {
+				best=b;
+				best_aff=aff;
+				best_fits=fits;
+			}
+		}
+		if(best<0) {
+			for(i=0;i<nscenes;i++)
+				if(pk->scenes[scenes[i]].nbanks>=pk->window)
+					return count;
+			best=new_bank(pk);
+			if(best<0)
+				return -1;
+		}
+
+		for(i=0;i<nscenes;i++) {
+			struct scene *sc=&pk->scenes[scenes[i]];
+
+			if(!scene_has_bank(sc, best))
+				sc->banks[sc->nbanks++]=best;
+		}
+		for(k=0;k<count && pk->used[best]<pk->bank_tiles;k++) {
+			slot=store_tile(pk, uids[k], best);
+			if(slot<0)
+				return -1;
+			for(i=0;i<nscenes;i++)
+				if(!add_place(pk, scenes[i], uids[k], best, slot))
+					return -1;
+		}
+		uids+=k;
+		count-=k;
+	}
+	return 0;
+}
+
+/* forget any previous attempt */
+static void pack_reset(struct packer *pk) {
+	unsigned i;
+
+	for(i=0;i<pk->nscenes;i++)
+		pk->scenes[i].nbanks=0;
+	for(i=0;i<pk->ntiles;i++)
+		pk->tiles[i].nlocs=0;
+	pk->nbanks=0;
+	pk->nplaces=0;
+	pk->copies=0;
+}
+
+/* first pass, by groups of tiles.
+ * @returns 1 on success, 0 if a scene (pk->failed) did not fit, -1 on error */
+static int pack_groups(struct packer *pk) {
+	unsigned g, s;
+	long left, res;
+
+	pack_reset(pk);
+	for(g=0;g<pk->ngroups;g++) {
+		const uint32_t *uids=pk->order+pk->groups[g].start;
+		const struct utile *u=&pk->tiles[uids[0]];
+
+		left=place_tiles(pk, u->scenes, u->nscenes, uids, pk->groups[g].count);
+		if(left<0)
+			return -1;
+		if(!left)
+			continue;
+
+		/* store the rest again for each scene on its own */
+		uids+=pk->groups[g].count-left;
+		for(s=0;s<u->nscenes;s++) {
+			res=place_tiles(pk, &u->scenes[s], 1, uids, left);
+			if(res<0)
+				return -1;
+			if(res) {
+				pk->failed=u->scenes[s];
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+static int size_cmp(const void *a, const void *b) {
+	unsigned x=sort_pk->scenes[*(const unsigned*)a].ndistinct;
+	unsigned y=sort_pk->scenes[*(const unsigned*)b].ndistinct;
+
+	if(x!=y)
+		return x>y?-1:1;
+	return *(const unsigned*)a<*(const unsigned*)b?-1:1;
+}
+
+/* find a copy of uid in one of the scene's banks.
+ * @returns 1 and sets *where if there is one */
+static int find_tile(const struct packer *pk, const struct scene *sc, uint32_t uid, struct loc *where) {
+	const struct utile *u=&pk->tiles[uid];
+	unsigned i;
+
+	for(i=0;i<u->nlocs;i++) {
+		if(scene_has_bank(sc, u->locs[i].bank)) {
+			*where=u->locs[i];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* lay out one scene: map the existing banks that cover most of its tiles
+ * while the rest still fits, then store the rest. */
+static int pack_scene(struct packer *pk, unsigned s, uint32_t *rest) {
+	struct scene *sc=&pk->scenes[s];
+	unsigned nrest, i, j, b, free_mapped=0;
+	struct loc where;
+	long slot;
+	int best;
+
+	if(sc->ndistinct>(size_t)pk->window*pk->bank_tiles) {
+		pk->failed=s;
+		return 0;
+	}
+	memcpy(rest, sc->distinct, sc->ndistinct*sizeof *rest);
+	nrest=sc->ndistinct;
+
+	while(nrest>0 && sc->nbanks<pk->window) {
+		memset(pk->cover, 0, pk->nbanks*sizeof *pk->cover);
+		for(i=0;i<nrest;i++) {
+			const struct utile *u=&pk->tiles[rest[i]];
+
+			for(j=0;j<u->nlocs;j++)
+				pk->cover[u->locs[j].bank]++;
+		}
+		best=-1;
+		for(b=0;b<pk->nbanks;b++) {
+			if(!pk->cover[b] || scene_has_bank(sc, b))
+				continue;
+			/* what is left must fit the free slots and the banks still
+			 * unmapped */
+			if(nrest-pk->cover[b]>free_mapped+(pk->bank_tiles-pk->used[b])+(pk->window-sc->nbanks-1)*pk->bank_tiles)
+				continue;
+			if(best<0 || pk->cover[b]>pk->cover[best])
+				best=b;
+		}
+		if(best<0)
+			break;
+		sc->banks[sc->nbanks++]=best;
+		free_mapped+=pk->bank_tiles-pk->used[best];
+		for(i=0, j=0;i<nrest;i++) {
+			if(find_tile(pk, sc, rest[i], &where)) {
+				if(!add_place(pk, s, rest[i], where.bank, where.slot))
+					return -1;
+			} else {
+				rest[j++]=rest[i];
+			}
+		}
+		nrest=j;
+	}
+
+	/* the rest goes in free slots of the mapped banks, then new banks */
+	for(i=0, b=0;i<nrest;i++) {
+		while(b<sc->nbanks && pk->used[sc->banks[b]]==pk->bank_tiles)
+			b++;
+		if(b==sc->nbanks) {
+			if(sc->nbanks>=pk->window) {
+				pk->failed=s;
+				return 0;
+			}
+			best=new_bank(pk);
+			if(best<0)
+				return -1;
+			sc->banks[sc->nbanks++]=best;
+		}
+		slot=store_tile(pk, rest[i], sc->banks[b]);
+		if(slot<0 || !add_place(pk, s, rest[i], sc->banks[b], slot))
+			return -1;
+	}
+	return 1;
+}
+
+/* second pass, by scenes.
+ * @returns 1 on success, 0 if a scene (pk->failed) did not fit, -1 on error */
+static int pack_scenes(struct packer *pk) {
+	unsigned *order, i, max=1;
+	uint32_t *rest;
+	int res=1;
+
+	pack_reset(pk);
+	for(i=0;i<pk->nscenes;i++)
+		if(pk->scenes[i].ndistinct>max)
+			max=pk->scenes[i].ndistinct;
+	order=malloc(pk->nscenes*sizeof *order);
+	rest=malloc(max*sizeof *rest);
+	if(!order || !rest) {
+		perror("malloc()");
+		free(order);
+		free(rest);
+		return -1;
+	}
+	for(i=0;i<pk->nscenes;i++)
+		order[i]=i;
+	sort_pk=pk;
+	qsort(order, pk->nscenes, sizeof *order, size_cmp);
+
+	for(i=0;i<pk->nscenes && res>0;i++)
+		res=pack_scene(pk, order[i], rest);
+
+	free(order);
+	free(rest);
+	return res;
+}
+
+static int place_cmp(const void *a, const void *b) {
+	const struct place *x=a, *y=b;
+
+	if(x->scene!=y->scene)
+		return x->scene<y->scene?-1:1;
+	if(x->uid!=y->uid)
+		return x->uid<y->uid?-1:1;
+	return 0;
+}
+
+static int write_map(const struct packer *pk, const char *filename, size_t bank_size) {
+	struct place key, *p;
+	unsigned s, i, t;
+	FILE *f;
+
+	f=fopen(filename, "w");
+	if(!f) {
+		perror(filename);
+		return 0;
+	}
+	fprintf(f, "# %u banks of %zu bytes, %u tiles each\n", pk->nbanks, bank_size, pk->bank_tiles);
+	for(s=0;s<pk->nscenes;s++) {
+		const struct scene *sc=&pk->scenes[s];
+
+		fprintf(f, "scene %s banks", sc->filename);
+		for(i=0;i<sc->nbanks;i++)
+			fprintf(f, " %u", sc->banks[i]);
+		fprintf(f, "\n");
+		for(t=0;t<sc->ntiles;t++) {
+			key.scene=s;
+			key.uid=sc->uid[t];
+			p=bsearch(&key, pk->places, pk->nplaces, sizeof *pk->places, place_cmp);
+			if(p)
+				fprintf(f, "  %u %u:%u\n", t, (unsigned)p->bank, (unsigned)p->slot);
+		}
+	}
+	if(ferror(f) || fclose(f)) {
+		perror(filename);
+		return 0;
+	}
+	return 1;
+}
+
+static int write_chr(const struct packer *pk, const char *filename) {
+	FILE *f;
+	size_t len=(size_t)pk->nbanks*pk->bank_tiles*TILE_SIZE;
+
+	f=fopen(filename, "wb");
+	if(!f) {
+		perror(filename);
+		return 0;
+	}
+	if(fwrite(pk->chr, 1, len, f)!=len || fclose(f)) {
+		perror(filename);
+		return 0;
+	}
+	return 1;
+}
+
+static void usage(void) {
+	fprintf(stderr,
+		"usage: " PROG_NAME " [-v] [-b <size>] [-w <n>] -o <out.chr> [-m <map>] <scene.chr>...\n"
+	);
+
+	fprintf(stderr,
+		"-b <size>   bank size in bytes (default is 1024).\n"
+		"-w <n>      banks a scene can have mapped at once (default fills 8K).\n"
+		"-o <f>      CHR output.\n"
+		"-m <f>      map output (default is the CHR output with .map).\n"
+		"-v          verbose.\n"
+	);
+}
+
+int main(int argc, char **argv) {
+	struct packer pk;
+	const char *out_filename=NULL, *map_filename=NULL;
+	char map_filename_tmp[512];
+	unsigned long bank_size=1024;
+	size_t input_tiles=0;
+	char *endptr;
+	int c, i, res, ret=EXIT_FAILURE;
+
+	memset(&pk, 0, sizeof pk);
+	while((c=getopt(argc, argv, "hvb:w:o:m:"))!=-1) {
+		switch(c) {
+			case 'v':
+				verbose_fl++;
+				break;
+			case 'b':
+				bank_size=strtoul(optarg, &endptr, 0);
+				if(*endptr || !bank_size || bank_size%TILE_SIZE) {
+					fprintf(stderr, "Error: -b takes a multiple of %d.\n", TILE_SIZE);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'w':
+				pk.window=strtoul(optarg, &endptr, 10);
+				if(*endptr || !pk.window) {
+					fprintf(stderr, "Error: -w takes a positive number.\n");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'o':
+				out_filename=optarg;
+				break;
+			case 'm':
+				map_filename=optarg;
+				break;
+			case 'h':
+			default:
+				usage();
+				return EXIT_FAILURE;
+		}
+	}
+	if(optind==argc || !out_filename) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	if(!map_filename) {
+		if(!make_file_name(map_filename_tmp, sizeof map_filename_tmp, out_filename, ".map")) {
+			fprintf(stderr, "Cannot output map file.\n");
+			return EXIT_FAILURE;
+		}
+		map_filename=map_filename_tmp;
+	}
+	pk.bank_tiles=bank_size/TILE_SIZE;
+	if(!pk.window)
+		pk.window=bank_size<8192?8192/bank_size:1;
+
+	pk.nscenes=argc-optind;
+	pk.scenes=calloc(pk.nscenes, sizeof *pk.scenes);
+	if(!pk.scenes) {
+		perror("calloc()");
+		return EXIT_FAILURE;
+	}
+	for(i=0;i<argc-optind;i++) {
+		struct scene *sc=&pk.scenes[i];
+
+		sc->filename=argv[optind+i];
+		sc->data=map_file(sc->filename, &sc->len);
+		if(!sc->data)
+			goto done;
+		if(sc->len%TILE_SIZE)
+			fprintf(stderr, "%s: ignoring %zu trailing bytes.\n", sc->filename, sc->len%TILE_SIZE);
+		sc->ntiles=sc->len/TILE_SIZE;
+		sc->banks=malloc(pk.window*sizeof *sc->banks);
+		if(!sc->banks) {
+			perror("malloc()");
+			goto done;
+		}
+		input_tiles+=sc->ntiles;
+	}
+
+	if(!dedup_tiles(&pk) || !group_tiles(&pk))
+		goto done;
+	res=pack_groups(&pk);
+	if(!res) {
+		if(verbose_fl)
+			fprintf(stderr, "%s: does not fit, packing scene by scene.\n", pk.scenes[pk.failed].filename);
+		res=pack_scenes(&pk);
+	}
+	if(!res)
+		fprintf(stderr, "%s: needs more than %u banks.\n", pk.scenes[pk.failed].filename, pk.window);
+	if(res<=0)
+		goto done;
+	qsort(pk.places, pk.nplaces, sizeof *pk.places, place_cmp);
+
+	if(!write_chr(&pk, out_filename) || !write_map(&pk, map_filename, bank_size))
+		goto done;
+
+	fprintf(stderr, "%zu tiles, %u unique, %u stored again: %u banks (at least %u)\n",
+		input_tiles, pk.ntiles, pk.copies, pk.nbanks, (pk.ntiles+pk.bank_tiles-1)/pk.bank_tiles);
+	ret=0;
+done:
+	for(i=0;i<(int)pk.nscenes;i++) {
+		if(pk.scenes[i].data)
+			unmap_file(pk.scenes[i].data, pk.scenes[i].len);
+		free(pk.scenes[i].uid);
+		free(pk.scenes[i].distinct);
+		free(pk.scenes[i].banks);
+	}
+	for(i=0;i<(int)pk.ntiles;i++) {
+		free(pk.tiles[i].scenes);
+		free(pk.tiles[i].locs);
+	}
+	free(pk.scenes);
+	free(pk.tiles);
+	free(pk.order);
+	free(pk.groups);
+	free(pk.used);
+	free(pk.cover);
+	free(pk.chr);
+	free(pk.places);
+	return ret;
+}
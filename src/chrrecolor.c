@@ -0,0 +1,214 @@
+/* chrrecolor.c
+ * remaps the colors of 2bpp CHR without decoding a pixel.
+ *
+ * a pixel's color is p0|p1<<1, from its bit in plane 0 and plane 1. each
+ * new plane is then some boolean function of the two old planes, and any
+ * function of two bits can be written in algebraic normal form:
+ *
+ *   new = d ^ (a & p0) ^ (b & p1) ^ (c & p0 & p1)
+ *
+ * with a, b, c and d each all zeros or all ones. the mapping is compiled
+ * to those four masks per plane once, then applied to whole 64-bit planes,
+ * so every tile costs a few ANDs and XORs however the colors move.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chrjob.h"
+#include "planar.h"
+#include "pool.h"
+#include "util.h"
+
+#define PROG_NAME "chrrecolor"
+
+/* a new plane in algebraic normal form over the old ones */
+struct plane_expr {
+	uint64_t a, b, c, d;
+};
+
+static int verbose_fl;
+
+/* parse "0321", the new color of each old color in order, or a list of
+ * old=new pairs like "1=3,3=1" that leaves the other colors alone */
+static int parse_map(const char *s, unsigned map[4]) {
+	unsigned i;
+
+	if(strlen(s)==4 && !strchr(s, '=')) {
+		for(i=0;i<4;i++) {
+			if(s[i]<'0' || s[i]>'3')
+				return 0;
+			map[i]=s[i]-'0';
+		}
+		return 1;
+	}
+	for(i=0;i<4;i++)
+		map[i]=i;
+	for(;;) {
+		if(s[0]<'0' || s[0]>'3' || s[1]!='=' || s[2]<'0' || s[2]>'3')
+			return 0;
+		map[s[0]-'0']=s[2]-'0';
+		s+=3;
+		if(!*s)
+			return 1;
+		if(*s++!=',')
+			return 0;
+	}
+}
+
+/* the masks for one bit of the new colors. t is its truth table: bit c is
+ * the value for old color c. */
+static void compile_plane(struct plane_expr *e, unsigned t) {
+	unsigned t0=t&1, t1=t>>1&1, t2=t>>2&1, t3=t>>3&1;
+
+	e->d=t0?~0ull:0;
+	e->a=t0^t1?~0ull:0;
+	e->b=t0^t2?~0ull:0;
+	e->c=t0^t1^t2^t3?~0ull:0;
+}
+
+static void compile_map(struct plane_expr expr[2], const unsigned map[4]) {
+	unsigned plane, c, t;
+
+	for(plane=0;plane<2;plane++) {
+		for(c=0,t=0;c<4;c++)
+			t|=(map[c]>>plane&1)<<c;
+		compile_plane(&expr[plane], t);
+	}
+}
+
+static void print_plane(FILE *f, unsigned plane, const struct plane_expr *e) {
+	const char *sep="";
+
+	fprintf(f, "plane %u =", plane);
+	if(e->d) {
+		fprintf(f, " 1");
+		sep=" ^";
+	}
+	if(e->a) {
+		fprintf(f, "%s p0", sep);
+		sep=" ^";
+	}
+	if(e->b) {
+		fprintf(f, "%s p1", sep);
+		sep=" ^";
+	}
+	if(e->c) {
+		fprintf(f, "%s p0&p1", sep);
+		sep=" ^";
+	}
+	fprintf(f, "%s\n", *sep?"":" 0");
+}
+
+/* chr_job kernel, arg is the two plane expressions */
+static void recolor_tiles(void *arg, const unsigned char *src, unsigned char *dst, size_t first, size_t end) {
+	const struct plane_expr *e0=arg, *e1=e0+1;
+	size_t t;
+
+	for(t=first;t<end;t++) {
+		const unsigned char *s=src+t*PLANAR_TILE_SIZE;
+		unsigned char *d=dst+t*PLANAR_TILE_SIZE;
+		uint64_t p0=planar_load(s), p1=planar_load(s+8), both=p0&p1;
+
+		planar_store(d, e0->d^(e0->a&p0)^(e0->b&p1)^(e0->c&both));
+		planar_store(d+8, e1->d^(e1->a&p0)^(e1->b&p1)^(e1->c&both));
+	}
+}
+
+static int recolor(const char *filename, const char *out_filename, struct plane_expr expr[2], unsigned threads) {
+	const struct chr_job job={NULL, recolor_tiles, expr};
+	size_t tiles;
+
+	if(!chr_job_file(filename, out_filename, &job, threads, &tiles))
+		return 0;
+	if(verbose_fl)
+		fprintf(stderr, "%s: %zu tiles\n", out_filename, tiles);
+	return 1;
+}
+
+static void usage(void) {
+	fprintf(stderr,
+		"usage: " PROG_NAME " [-v] [-j <n>] -m <map> [-o <f>] <file>...\n"
+	);
+
+	fprintf(stderr,
+		"-m <map>    the new color of each old color, as 4 digits (\"0321\"\n"
+		"            swaps 1 and 3) or old=new pairs (\"1=3,3=1\").\n"
+		"-o <f>      output file, with a single input (default file-recolor).\n"
+		"-j <n>      number of threads (default is one per processor).\n"
+		"-v          verbose, shows the plane expressions.\n"
+		"an iNES (.nes) file has its CHR-ROM recolored and the rest copied.\n"
+	);
+}
+
+int main(int argc, char **argv) {
+	const char *map_str=NULL, *out_filename=NULL;
+	unsigned threads=pool_threads(), map[4];
+	struct plane_expr expr[2];
+	char out_tmp[4096];
+	char *endptr;
+	int c, i, ret=0;
+
+	while((c=getopt(argc, argv, "hvm:o:j:"))!=-1) {
+		switch(c) {
+			case 'v':
+				verbose_fl++;
+				break;
+			case 'm':
+				map_str=optarg;
+				break;
+			case 'o':
+				out_filename=optarg;
+				break;
+			case 'j':
+				threads=strtoul(optarg, &endptr, 10);
+				if(*endptr || !threads) {
+					fprintf(stderr, "Error: -j takes a positive number.\n");
+					usage();
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'h':
+			default:
+				usage();
+				return EXIT_FAILURE;
+		}
+	}
+
+	if(optind==argc || !map_str) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	if(out_filename && optind+1!=argc) {
+		fprintf(stderr, "Error: -o takes a single input file.\n");
+		return EXIT_FAILURE;
+	}
+	if(!parse_map(map_str, map)) {
+		fprintf(stderr, "Error: -m takes 4 colors like 0321 or pairs like 1=3,3=1.\n");
+		usage();
+		return EXIT_FAILURE;
+	}
+	compile_map(expr, map);
+	if(verbose_fl) {
+		print_plane(stderr, 0, &expr[0]);
+		print_plane(stderr, 1, &expr[1]);
+	}
+
+	for(i=optind;i<argc;i++) {
+		const char *out=out_filename;
+
+		if(!out) {
+			if(!make_suffixed_name(out_tmp, sizeof out_tmp, argv[i], "-recolor")) {
+				fprintf(stderr, "%s:name too long.\n", argv[i]);
+				ret=EXIT_FAILURE;
+				continue;
+			}
+			out=out_tmp;
+		}
+		if(!recolor(argv[i], out, expr, threads))
+			ret=EXIT_FAILURE;
+	}
+	return ret;
+}
@@ -4,10 +4,16 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <setjmp.h>
 
+#include "chrcodec.h"
 #include "image.h"
+#include "ines.h"
 #include "log.h"
+#include "palette.h"
+#include "pool.h"
+#include "util.h"
 
 #if defined(WIN32) || defined(__WIN32__)
 #error Supply an implementation of getopt()
@@ -23,6 +29,7 @@
 #define DEFAULT_H 8
 #define DEFAULT_BPP 2
 #define DEFAULT_COLUMNS 16
+#define DEFAULT_COLORS "0f,00,10,30"
 
 /* macro to turn a macro into a string */
 #define _TOSTR(x) #x
@@ -38,6 +45,27 @@ struct prog_opts
 	int tile_w, tile_h;
 	int tiles_per_row;
 	const char *out_filename;
+	unsigned bank_size; /* pages by size in bytes */
+	unsigned page_tiles; /* or by tiles */
+	unsigned page_height; /* or by height in pixels */
+	unsigned threads;
+	const char *colors, *palette_filename;
+	int transparent_fl;
+	struct palette *pal; /* NULL for grayscale */
+	int codec;
+};
+
+/* pages of CHR, each converted to its own PNG */
+struct page_job
+{
+	const struct prog_opts *po;
+	const char *filename;
+	const unsigned char *data;
+	size_t len;
+	size_t page_size; /* in bytes, 0 for a single sheet */
+	unsigned count;
+	unsigned digits; /* in the page numbers */
+	int failed;
 };
 
 /*
@@ -47,7 +75,7 @@ static void
 usage(void)
 {
 	fprintf(stderr, 
-		"usage: chrtopng [-hv] [-b <bbp>] [-o <f>] [-t <NxM>] [-w <width>] [file ...]\n"
+		"usage: chrtopng [-hva] [-b <bbp>] [-o <f>] [-t <NxM>] [-w <width>] [-B <K> | -P <n> | -H <h>] [-j <n>] [-c <colors>] [-p <pal>] [-z <codec>] [file ...]\n"
 	);
 
 	fprintf(stderr,
@@ -55,6 +83,17 @@ usage(void)
 		"-o <f>      output file (default '" DEFAULT_OUTFILE "').\n"
 		"-t <NxM>    size of tile (default " TOSTR(DEFAULT_W) "x" TOSTR(DEFAULT_H) ").\n"
 		"-w <width>  tiles per row (default " TOSTR(DEFAULT_COLUMNS) ").\n"
+		"-B <K>      write one PNG per 4 or 8K bank, numbered after the output name.\n"
+		"-P <n>      write one PNG per n tiles, numbered the same way.\n"
+		"-H <h>      write one PNG per h pixels of height, numbered the same way.\n"
+		"-j <n>      threads for the pages (default is one per processor).\n"
+		"-c <colors> write an indexed PNG with these colors, NES color numbers\n"
+		"            in hex or #rrggbb, comma separated (default " DEFAULT_COLORS ").\n"
+		"-p <pal>    NES palette file to look the colors up in.\n"
+		"-a          color 0 is transparent.\n"
+		"-z <codec>  the CHR is compressed with rle, lzss or tile (default none).\n"
+		"the indexed PNG uses the fewest bits that hold the colors in the tiles.\n"
+		"an iNES (.nes) file is read straight from its CHR-ROM.\n"
 	);
 }
 
@@ -68,7 +107,7 @@ parse_args(struct prog_opts *po, int argc, char **argv)
 	const char *tmp;
 	char *endptr;
 
-	while ((c=getopt(argc, argv, "hvb:o:t:w:"))>0)
+	while ((c=getopt(argc, argv, "hvab:o:t:w:B:P:H:j:c:p:z:"))>0)
 	{
 		switch (c)
 		{
@@ -78,6 +117,24 @@ parse_args(struct prog_opts *po, int argc, char **argv)
 			case 'v':
 				po->verbose_fl++;
 				break;
+			case 'a':
+				po->transparent_fl=1;
+				break;
+			case 'c':
+				po->colors=optarg;
+				break;
+			case 'z':
+				po->codec=codec_lookup(optarg);
+				if (po->codec<0)
+				{
+					fprintf(stderr, "Error: unknown codec '%s'.\n", optarg);
+					usage();
+					return 0;
+				}
+				break;
+			case 'p':
+				po->palette_filename=optarg;
+				break;
 			case 'b':
 				po->in_bpp=strtoul(optarg, &endptr, 10);
 				if (*endptr)
@@ -114,14 +171,240 @@ parse_args(struct prog_opts *po, int argc, char **argv)
 					return 0;
 				}
 				break;
+			case 'B':
+				po->bank_size=strtoul(optarg, &endptr, 10)*1024;
+				if (*endptr || (po->bank_size!=4096 && po->bank_size!=8192))
+				{
+					fprintf(stderr, "Error: -B takes 4 or 8.\n");
+					usage();
+					return 0;
+				}
+				break;
+			case 'P':
+				po->page_tiles=strtoul(optarg, &endptr, 10);
+				if (*endptr || !po->page_tiles)
+				{
+					fprintf(stderr, "Error: -P takes a positive number.\n");
+					usage();
+					return 0;
+				}
+				break;
+			case 'H':
+				po->page_height=strtoul(optarg, &endptr, 10);
+				if (*endptr || !po->page_height)
+				{
+					fprintf(stderr, "Error: -H takes a positive number.\n");
+					usage();
+					return 0;
+				}
+				break;
+			case 'j':
+				po->threads=strtoul(optarg, &endptr, 10);
+				if (*endptr || !po->threads)
+				{
+					fprintf(stderr, "Error: -j takes a positive number.\n");
+					usage();
+					return 0;
+				}
+				break;
 			default:
 				usage();
 				return 0; /* failure */
 		}
 	}
+	if (!!po->bank_size+!!po->page_tiles+!!po->page_height>1)
+	{
+		fprintf(stderr, "Error: only one of -B, -P and -H may be given.\n");
+		usage();
+		return 0;
+	}
 	return 1; /* success */
 }
 
+/*
+ * name of the PNG for a page: out.png becomes out-03.png
+ */
+static int
+page_file_name(char *dest, size_t max, const char *filename, unsigned page, unsigned digits)
+{
+	char suffix[32];
+
+	snprintf(suffix, sizeof suffix, "-%0*u.png", digits, page);
+	return make_file_name(dest, max, filename, suffix);
+}
+
+/*
+ * bytes of CHR in one tile
+ */
+static size_t
+tile_bytes(const struct prog_opts *po)
+{
+	return (size_t)(po->tile_w*po->in_bpp+7)/8*po->tile_h;
+}
+
+/*
+ * bytes of CHR on each page, or 0 for a single sheet
+ */
+static size_t
+page_size(const struct prog_opts *po)
+{
+	size_t tilebytes=tile_bytes(po);
+	unsigned rows;
+
+	if (po->bank_size)
+	{
+		return po->bank_size;
+	}
+	if (po->page_tiles)
+	{
+		return po->page_tiles*tilebytes;
+	}
+	if (po->page_height)
+	{
+		/* whole rows of tiles, at least one */
+		rows=po->page_height/po->tile_h;
+		return (rows?rows:1)*po->tiles_per_row*tilebytes;
+	}
+	return 0;
+}
+
+static void
+page_job(void *arg, unsigned index)
+{
+	struct page_job *job=arg;
+	const struct prog_opts *po=job->po;
+	struct image img;
+	char out_filename[512];
+	size_t ofs=(size_t)index*job->page_size;
+	size_t len=job->len-ofs<job->page_size?job->len-ofs:job->page_size;
+
+	if (!page_file_name(out_filename, sizeof out_filename, po->out_filename, index, job->digits))
+	{
+		fprintf(stderr, "%s:name too long\n", po->out_filename);
+		job->failed=1;
+		return;
+	}
+	if (!load_chr_data(job->filename, job->data+ofs, len, &img, po->tile_w, po->tile_h, po->in_bpp, po->tiles_per_row))
+	{
+		job->failed=1;
+		return;
+	}
+	if (!save_png_indexed(out_filename, &img, po->pal))
+	{
+		fprintf(stderr, "Could not write image '%s'\n", out_filename);
+		job->failed=1;
+	}
+	image_destroy(&img);
+}
+
+/*
+ * convert one file, as one sheet or a sheet per page
+ */
+static int
+convert(const struct prog_opts *po, const char *filename)
+{
+	struct image curr_img;
+	struct page_job job;
+	unsigned n;
+	unsigned char *data, *unpacked=NULL;
+	size_t len, ofs;
+	int ret=0;
+
+	data=map_file(filename, &len);
+	if (!data)
+	{
+		return 0;
+	}
+	memset(&job, 0, sizeof job);
+	job.po=po;
+	job.filename=filename;
+	if (!ines_find_chr(filename, data, len, &ofs, &job.len))
+	{
+		goto done;
+	}
+	job.data=data+ofs;
+	if (po->codec!=CODEC_NONE)
+	{
+		unpacked=codec_decompress(po->codec, filename, job.data, job.len, &job.len);
+		if (!unpacked)
+		{
+			goto done;
+		}
+		job.data=unpacked;
+	}
+
+	job.page_size=page_size(po);
+	if (job.page_size)
+	{
+		/* as load_chr_data() would for a single sheet */
+		if (job.len<tile_bytes(po))
+		{
+			fprintf(stderr, "%s:no tiles\n", filename);
+			goto done;
+		}
+		/* each page decodes and compresses on its own thread */
+		job.count=(job.len+job.page_size-1)/job.page_size;
+		for (job.digits=1,n=job.count-1; n>=10; n/=10)
+		{
+			job.digits++;
+		}
+		if (job.digits<2)
+		{
+			job.digits=2;
+		}
+		if (pool_run(po->threads, job.count, page_job, &job))
+		{
+			goto done;
+		}
+		ret=!job.failed;
+		goto done;
+	}
+
+	if (!load_chr_data(filename, job.data, job.len, &curr_img, po->tile_w, po->tile_h, po->in_bpp, po->tiles_per_row))
+	{
+		goto done;
+	}
+	if (!save_png_indexed(po->out_filename, &curr_img, po->pal))
+	{
+		fprintf(stderr, "Could not write image '%s'\n", po->out_filename);
+	}
+	else
+	{
+		ret=1;
+	}
+	image_destroy(&curr_img);
+done:
+	free(unpacked);
+	unmap_file(data, len);
+	return ret;
+}
+
+/*
+ * build the palette if any color option was given
+ */
+static int
+setup_palette(struct prog_opts *po, struct palette *pal)
+{
+	unsigned char master[PALETTE_NES_COLORS][3];
+
+	if (!po->colors && !po->palette_filename && !po->transparent_fl)
+	{
+		return 1; /* grayscale */
+	}
+	memcpy(master, nes_palette, sizeof master);
+	if (po->palette_filename && !palette_load_nes(po->palette_filename, master))
+	{
+		return 0;
+	}
+	if (!palette_parse(pal, po->colors?po->colors:DEFAULT_COLORS, master))
+	{
+		return 0;
+	}
+	pal->transparent=po->transparent_fl?0:-1;
+	po->pal=pal;
+	return 1;
+}
+
 /*
  * main
  */
@@ -129,8 +412,8 @@ int
 main(int argc, char **argv)
 {
 	struct prog_opts prog_opts;
+	struct palette pal;
 	int i;
-	struct image curr_img;
 
 	/* configure defaults */
 	prog_opts.verbose_fl=0;
@@ -139,12 +422,25 @@ main(int argc, char **argv)
 	prog_opts.in_bpp=DEFAULT_BPP;
 	prog_opts.tiles_per_row=DEFAULT_COLUMNS;
 	prog_opts.out_filename=DEFAULT_OUTFILE;
+	prog_opts.bank_size=0;
+	prog_opts.page_tiles=0;
+	prog_opts.page_height=0;
+	prog_opts.threads=pool_threads();
+	prog_opts.colors=NULL;
+	prog_opts.palette_filename=NULL;
+	prog_opts.transparent_fl=0;
+	prog_opts.pal=NULL;
+	prog_opts.codec=CODEC_NONE;
 
 	/* load command-line configuration */
 	if (!parse_args(&prog_opts, argc, argv))
 	{
 		return EXIT_FAILURE;
 	}
+	if (!setup_palette(&prog_opts, &pal))
+	{
+		return EXIT_FAILURE;
+	}
 
 	TRACE("opts: %ux%u@%u '%s'\n", prog_opts.tile_w, prog_opts.tile_h, prog_opts.in_bpp, prog_opts.out_filename);
 
@@ -157,17 +453,11 @@ main(int argc, char **argv)
 	{
 		for (i=optind; i<argc; i++)
 		{
-			if (!load_chr(argv[i], &curr_img, prog_opts.tile_w, prog_opts.tile_h, prog_opts.in_bpp, prog_opts.tiles_per_row))
-			{
-				fprintf(stderr, "Could not load image '%s'\n", argv[i]);
-				return EXIT_FAILURE;
-			}
-			if (!save_png(prog_opts.out_filename, &curr_img))
+			if (!convert(&prog_opts, argv[i]))
 			{
-				fprintf(stderr, "Could not write image '%s'\n", prog_opts.out_filename);
+				fprintf(stderr, "Could not convert '%s'\n", argv[i]);
 				return EXIT_FAILURE;
 			}
-			image_destroy(&curr_img);
 		}
 	}
 
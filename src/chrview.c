@@ -0,0 +1,775 @@
+/* chrview.c
+ * shows a CHR file, the CHR-ROM of an iNES file or a grayscale or indexed
+ * PNG in the terminal.
+ *
+ * by default each text cell is two pixels, the upper half block drawn in
+ * the top pixel's color over the bottom pixel's, in 24-bit color. with
+ * sixel every pixel is drawn as it is, on terminals that support it.
+ *
+ * on a terminal the sheet can be scrolled. every frame is built in one
+ * buffer and written at once. half-block frames only send the cells that
+ * changed since the last frame: a vertical scroll first moves the screen
+ * with the terminal's own scroll, then fills in what is new. a sixel
+ * frame is a single image of the whole window.
+ */
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "ines.h"
+#include "palette.h"
+#include "util.h"
+
+#define PROG_NAME "chrview"
+#define DEFAULT_COLUMNS 16
+#define DEFAULT_COLORS "0f,00,10,30"
+#define TILE 8 /* pixels scrolled per step */
+
+#define _TOSTR(x) #x
+#define TOSTR(x) _TOSTR(x)
+
+#define COLOR_NONE 0xff000000u /* outside the sheet: terminal default */
+#define CELL_UNKNOWN UINT64_MAX /* not on screen as far as we know */
+
+enum mode {
+	MODE_AUTO,
+	MODE_HALF,
+	MODE_SIXEL,
+};
+
+/* the frame being built, written with one write() */
+struct outbuf {
+	char *data;
+	size_t len, max;
+	int failed;
+};
+
+struct view {
+	const char *filename;
+	struct image img;
+	struct palette png_pal; /* PLTE of an indexed PNG, count 0 otherwise */
+	int is_chr;
+	uint32_t colors[256]; /* 0xrrggbb of each pixel value */
+	unsigned scale;
+	int sixel;
+	unsigned top, left; /* first image row and column shown */
+	unsigned rows, cols; /* of the terminal, the last row is the status */
+	unsigned cell_w, cell_h; /* pixels per cell, for sixel */
+	uint64_t *cells; /* what each cell shows, top<<32|bottom */
+	char status[512];
+	/* colors the terminal is set to */
+	uint32_t sgr_fg, sgr_bg;
+};
+
+static struct termios saved_termios;
+static volatile sig_atomic_t resized, quit;
+
+static void out_put(struct outbuf *b, const char *s, size_t len) {
+	if(b->failed)
+		return;
+	if(b->len+len>b->max) {
+		size_t n=b->max?b->max:65536;
+		char *tmp;
+
+		while(n<b->len+len)
+			n*=2;
+		tmp=realloc(b->data, n);
+		if(!tmp) {
+			perror("realloc()");
+			b->failed=1;
+			return;
+		}
+		b->data=tmp;
+		b->max=n;
+	}
+	memcpy(b->data+b->len, s, len);
+	b->len+=len;
+}
+
+static void out_str(struct outbuf *b, const char *s) {
+	out_put(b, s, strlen(s));
+}
+
+static void out_printf(struct outbuf *b, const char *fmt, ...) {
+	char tmp[256];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n=vsnprintf(tmp, sizeof tmp, fmt, ap);
+	va_end(ap);
+	if(n>0)
+		out_put(b, tmp, (size_t)n<sizeof tmp?(size_t)n:sizeof tmp-1);
+}
+
+/* write the frame out and empty the buffer */
+static int out_flush(struct outbuf *b, int fd) {
+	size_t done=0;
+	ssize_t n;
+
+	if(b->failed)
+		return 0;
+	while(done<b->len) {
+		n=write(fd, b->data+done, b->len-done);
+		if(n<0) {
+			if(errno==EINTR)
+				continue;
+			perror("write()");
+			return 0;
+		}
+		done+=n;
+	}
+	b->len=0;
+	return 1;
+}
+
+/* color of a screen pixel, COLOR_NONE past the edge of the sheet */
+static uint32_t pixel_color(const struct view *v, unsigned x, unsigned y) {
+	unsigned ix=v->left+x/v->scale, iy=v->top+y/v->scale;
+
+	if(ix>=v->img.xres || iy>=v->img.yres)
+		return COLOR_NONE;
+	return v->colors[image_get_pixel(&v->img, ix, iy)];
+}
+
+static void set_colors(struct view *v, struct outbuf *b, uint32_t fg, uint32_t bg) {
+	if(fg!=v->sgr_fg) {
+		if(fg==COLOR_NONE)
+			out_str(b, "\033[39m");
+		else
+			out_printf(b, "\033[38;2;%u;%u;%um", fg>>16, fg>>8&255, fg&255);
+		v->sgr_fg=fg;
+	}
+	if(bg!=v->sgr_bg) {
+		if(bg==COLOR_NONE)
+			out_str(b, "\033[49m");
+		else
+			out_printf(b, "\033[48;2;%u;%u;%um", bg>>16, bg>>8&255, bg&255);
+		v->sgr_bg=bg;
+	}
+}
+
+/* one cell of two pixels. only the colors that change are sent. */
+static void put_cell(struct view *v, struct outbuf *b, uint32_t top, uint32_t bottom) {
+	if(top==bottom) {
+		set_colors(v, b, v->sgr_fg, top);
+		out_str(b, " ");
+	} else if(top==COLOR_NONE) {
+		set_colors(v, b, bottom, COLOR_NONE);
+		out_str(b, "\342\226\204"); /* U+2584 lower half block */
+	} else {
+		set_colors(v, b, top, bottom);
+		out_str(b, "\342\226\200"); /* U+2580 upper half block */
+	}
+}
+
+/* image rows shown on the screen */
+static unsigned visible_rows(const struct view *v) {
+	unsigned rows=v->rows>1?v->rows-1:1;
+
+	if(v->sixel)
+		return rows*v->cell_h/v->scale;
+	return rows*2/v->scale;
+}
+
+static unsigned visible_cols(const struct view *v) {
+	if(v->sixel)
+		return v->cols*v->cell_w/v->scale;
+	return v->cols/v->scale;
+}
+
+static void draw_status(struct view *v, struct outbuf *b) {
+	char line[sizeof v->status];
+	unsigned last=v->top+visible_rows(v);
+
+	if(last>v->img.yres)
+		last=v->img.yres;
+	if(v->is_chr) {
+		unsigned per_row=v->img.xres/8;
+
+		snprintf(line, sizeof line, " %s  tiles $%x-$%x of $%x  j/k space/b g/G h/l q",
+			v->filename, v->top/8*per_row, last?(last+7)/8*per_row-1:0, v->img.yres/8*per_row);
+	} else {
+		snprintf(line, sizeof line, " %s  rows %u-%u of %u  j/k space/b g/G h/l q",
+			v->filename, v->top, last?last-1:0, v->img.yres);
+	}
+	if(strlen(line)>v->cols)
+		line[v->cols]=0;
+	if(!strcmp(line, v->status))
+		return;
+	strcpy(v->status, line);
+	set_colors(v, b, COLOR_NONE, COLOR_NONE);
+	out_printf(b, "\033[%u;1H\033[7m%s\033[K\033[27m", v->rows, line);
+}
+
+/* send the cells that differ from what is on the screen */
+static void draw_cells(struct view *v, struct outbuf *b) {
+	unsigned x, y, cur_x=~0u, cur_y=~0u;
+
+	for(y=0;y+1<v->rows;y++) {
+		for(x=0;x<v->cols;x++) {
+			uint32_t top=pixel_color(v, x, 2*y), bottom=pixel_color(v, x, 2*y+1);
+			uint64_t cell=(uint64_t)top<<32|bottom;
+			uint64_t *old=&v->cells[(size_t)y*v->cols+x];
+
+			if(cell==*old)
+				continue;
+			*old=cell;
+			if(x!=cur_x || y!=cur_y)
+				out_printf(b, "\033[%u;%uH", y+1, x+1);
+			put_cell(v, b, top, bottom);
+			cur_x=x+1;
+			cur_y=y;
+		}
+	}
+}
+
+/* move what is on the screen by lines text rows, up for a positive count,
+ * so only the newly uncovered rows need drawing */
+static void scroll_cells(struct view *v, struct outbuf *b, int lines) {
+	unsigned rows=v->rows-1, n=lines<0?-lines:lines, y;
+	size_t row=v->cols;
+
+	if(!lines || !rows)
+		return;
+	if(n>=rows) {
+		for(y=0;y<rows*row;y++)
+			v->cells[y]=CELL_UNKNOWN;
+		return;
+	}
+	set_colors(v, b, COLOR_NONE, COLOR_NONE);
+	out_printf(b, "\033[1;%ur\033[%u%c\033[r", rows, n, lines>0?'S':'T');
+	if(lines>0) {
+		memmove(v->cells, v->cells+n*row, (rows-n)*row*sizeof *v->cells);
+		for(y=(rows-n)*row;y<rows*row;y++)
+			v->cells[y]=CELL_UNKNOWN;
+	} else {
+		memmove(v->cells+n*row, v->cells, (rows-n)*row*sizeof *v->cells);
+		for(y=0;y<n*row;y++)
+			v->cells[y]=CELL_UNKNOWN;
+	}
+}
+
+/* sixel of the screen pixels width x height. the register of each pixel
+ * value is the value, and one past the last value is for outside. */
+static void draw_sixel(struct view *v, struct outbuf *b, unsigned width, unsigned height) {
+	unsigned values=v->img.bpp<8?1u<<v->img.bpp:256, outside=values<256?values:255;
+	unsigned char *band, used[257];
+	unsigned x, y, k, r;
+
+	band=malloc((size_t)width*6+1);
+	if(!band) {
+		perror("malloc()");
+		b->failed=1;
+		return;
+	}
+	out_printf(b, "\033P0;1;0q\"1;1;%u;%u", width, height);
+	for(r=0;r<values;r++) {
+		uint32_t c=v->colors[r];
+
+		out_printf(b, "#%u;2;%u;%u;%u", r, ((c>>16)*100+127)/255, ((c>>8&255)*100+127)/255, ((c&255)*100+127)/255);
+	}
+	if(outside==values)
+		out_printf(b, "#%u;2;0;0;0", outside);
+
+	for(y=0;y<height;y+=6) {
+		int first=1;
+
+		memset(used, 0, sizeof used);
+		for(k=0;k<6;k++) {
+			for(x=0;x<width;x++) {
+				unsigned ix=v->left+x/v->scale, iy=v->top+(y+k)/v->scale;
+				unsigned reg=ix<v->img.xres && iy<v->img.yres?image_get_pixel(&v->img, ix, iy):outside;
+
+				band[k*width+x]=reg;
+				used[reg]=1;
+			}
+		}
+		for(r=0;r<=outside;r++) {
+			unsigned run=0, last=0, end;
+
+			if(!used[r])
+				continue;
+			if(!first)
+				out_str(b, "$");
+			first=0;
+			out_printf(b, "#%u", r);
+			/* trailing empty columns need not be sent */
+			for(end=width;end;end--) {
+				for(k=0;k<6 && (y+k>=height || band[k*width+end-1]!=r);k++) ;
+				if(k<6)
+					break;
+			}
+			for(x=0;x<=end;x++) {
+				unsigned bits=0;
+
+				if(x<end) {
+					for(k=0;k<6;k++)
+						if(y+k<height && band[k*width+x]==r)
+							bits|=1<<k;
+					if(run && bits==last) {
+						run++;
+						continue;
+					}
+				}
+				if(run>3) {
+					out_printf(b, "!%u%c", run, 63+last);
+				} else {
+					for(;run;run--)
+						out_put(b, (char[]){63+last}, 1);
+				}
+				run=1;
+				last=bits;
+			}
+		}
+		out_str(b, "-");
+	}
+	out_str(b, "\033\\");
+	free(band);
+}
+
+static void draw_frame(struct view *v, struct outbuf *b) {
+	if(v->sixel) {
+		unsigned rows=v->rows>1?v->rows-1:1;
+
+		set_colors(v, b, COLOR_NONE, COLOR_NONE);
+		out_str(b, "\033[H");
+		draw_sixel(v, b, v->cols*v->cell_w, rows*v->cell_h);
+	} else {
+		draw_cells(v, b);
+	}
+	draw_status(v, b);
+}
+
+/* the whole sheet, once, for output that isn't a terminal or for -1 */
+static int print_sheet(struct view *v, int fd) {
+	struct outbuf b={NULL, 0, 0, 0};
+	unsigned x, y;
+
+	v->top=v->left=0;
+	v->sgr_fg=v->sgr_bg=COLOR_NONE;
+	if(v->sixel) {
+		draw_sixel(v, &b, v->img.xres*v->scale, v->img.yres*v->scale);
+		out_str(&b, "\n");
+	} else {
+		for(y=0;y<v->img.yres*v->scale;y+=2) {
+			for(x=0;x<v->img.xres*v->scale;x++)
+				put_cell(v, &b, pixel_color(v, x, y), pixel_color(v, x, y+1));
+			set_colors(v, &b, COLOR_NONE, COLOR_NONE);
+			out_str(&b, "\n");
+		}
+	}
+	x=out_flush(&b, fd);
+	free(b.data);
+	return x;
+}
+
+static void on_resize(int sig) {
+	(void)sig;
+	resized=1;
+}
+
+static void on_quit(int sig) {
+	(void)sig;
+	quit=1;
+}
+
+static void term_restore(void) {
+	static const char s[]="\033[0m\033[r\033[?25h\033[?1049l";
+
+	if(write(STDOUT_FILENO, s, sizeof s-1)<0)
+		return;
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_termios);
+}
+
+static int term_setup(void) {
+	static const char s[]="\033[?1049h\033[?25l\033[0m\033[2J";
+	struct termios t;
+	struct sigaction sa;
+
+	if(tcgetattr(STDIN_FILENO, &saved_termios)) {
+		perror("tcgetattr()");
+		return 0;
+	}
+	t=saved_termios;
+	t.c_lflag&=~(ICANON|ECHO);
+	t.c_cc[VMIN]=1;
+	t.c_cc[VTIME]=0;
+	if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &t)) {
+		perror("tcsetattr()");
+		return 0;
+	}
+	/* no SA_RESTART, so a signal wakes up the read() for keys */
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler=on_resize;
+	sigaction(SIGWINCH, &sa, NULL);
+	sa.sa_handler=on_quit;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	atexit(term_restore);
+	return write(STDOUT_FILENO, s, sizeof s-1)>0;
+}
+
+/* ask the terminal for its attributes, 4 among them means sixel */
+static int term_has_sixel(void) {
+	char reply[128], *p;
+	size_t len=0;
+	struct timeval tv;
+	fd_set fds;
+	ssize_t n;
+
+	if(write(STDOUT_FILENO, "\033[c", 3)!=3)
+		return 0;
+	while(len<sizeof reply-1) {
+		FD_ZERO(&fds);
+		FD_SET(STDIN_FILENO, &fds);
+		tv.tv_sec=0;
+		tv.tv_usec=300000;
+		if(select(STDIN_FILENO+1, &fds, NULL, NULL, &tv)<=0)
+			break;
+		n=read(STDIN_FILENO, reply+len, sizeof reply-1-len);
+		if(n<=0)
+			break;
+		len+=n;
+		reply[len]=0;
+		if(strchr(reply, 'c'))
+			break;
+	}
+	reply[len]=0;
+	p=strstr(reply, "\033[?");
+	if(!p)
+		return 0;
+	for(p+=3;*p && *p!='c';) {
+		if(strtoul(p, &p, 10)==4)
+			return 1;
+		if(*p==';')
+			p++;
+		else
+			break;
+	}
+	return 0;
+}
+
+static void term_size(struct view *v) {
+	struct winsize ws;
+
+	v->rows=24;
+	v->cols=80;
+	v->cell_w=10;
+	v->cell_h=20;
+	if(!ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) && ws.ws_row && ws.ws_col) {
+		v->rows=ws.ws_row;
+		v->cols=ws.ws_col;
+		if(ws.ws_xpixel && ws.ws_ypixel) {
+			v->cell_w=ws.ws_xpixel/ws.ws_col;
+			v->cell_h=ws.ws_ypixel/ws.ws_row;
+		}
+	}
+	/* sixel goes down in bands of 6 */
+	if(v->cell_h>6)
+		v->cell_h-=v->cell_h%6;
+}
+
+static unsigned max_top(const struct view *v) {
+	unsigned rows=visible_rows(v);
+
+	return v->img.yres>rows?(v->img.yres-rows+TILE-1)/TILE*TILE:0;
+}
+
+static unsigned max_left(const struct view *v) {
+	unsigned cols=visible_cols(v);
+
+	return v->img.xres>cols?(v->img.xres-cols+TILE-1)/TILE*TILE:0;
+}
+
+/* @returns 0 to quit */
+static int handle_key(struct view *v, const char *key, size_t len) {
+	unsigned page=visible_rows(v)/TILE*TILE;
+	long top=v->top, left=v->left;
+
+	if(!page)
+		page=TILE;
+	if(len==1) {
+		switch(key[0]) {
+			case 'q':
+			case 27:
+				return 0;
+			case 'j':
+				top+=TILE;
+				break;
+			case 'k':
+				top-=TILE;
+				break;
+			case 'l':
+				left+=TILE;
+				break;
+			case 'h':
+				left-=TILE;
+				break;
+			case ' ':
+				top+=page;
+				break;
+			case 'b':
+				top-=page;
+				break;
+			case 'g':
+				top=0;
+				break;
+			case 'G':
+				top=max_top(v);
+				break;
+		}
+	} else if(len>=3 && key[0]==27 && key[1]=='[') {
+		switch(key[2]) {
+			case 'A':
+				top-=TILE;
+				break;
+			case 'B':
+				top+=TILE;
+				break;
+			case 'C':
+				left+=TILE;
+				break;
+			case 'D':
+				left-=TILE;
+				break;
+			case 'H':
+				top=0;
+				break;
+			case 'F':
+				top=max_top(v);
+				break;
+			case '5':
+				top-=page;
+				break;
+			case '6':
+				top+=page;
+				break;
+		}
+	}
+	if(top>(long)max_top(v))
+		top=max_top(v);
+	if(top<0)
+		top=0;
+	if(left>(long)max_left(v))
+		left=max_left(v);
+	if(left<0)
+		left=0;
+	v->top=top;
+	v->left=left;
+	return 1;
+}
+
+static int browse(struct view *v) {
+	struct outbuf b={NULL, 0, 0, 0};
+	char key[16];
+	ssize_t n;
+	size_t i;
+	int ret=0;
+
+	resized=1;
+	while(!quit) {
+		if(resized) {
+			uint64_t *tmp;
+
+			resized=0;
+			term_size(v);
+			tmp=realloc(v->cells, (size_t)v->rows*v->cols*sizeof *tmp);
+			if(!tmp) {
+				perror("realloc()");
+				break;
+			}
+			v->cells=tmp;
+			for(i=0;i<(size_t)v->rows*v->cols;i++)
+				v->cells[i]=CELL_UNKNOWN;
+			v->status[0]=0;
+			handle_key(v, "", 0); /* clamp to the new size */
+			out_str(&b, "\033[0m\033[2J");
+			v->sgr_fg=v->sgr_bg=COLOR_NONE;
+		}
+		draw_frame(v, &b);
+		if(!out_flush(&b, STDOUT_FILENO))
+			goto done;
+
+		n=read(STDIN_FILENO, key, sizeof key);
+		if(n<0 && errno==EINTR)
+			continue;
+		if(n<=0)
+			break;
+		{
+			unsigned old_top=v->top;
+
+			if(!handle_key(v, key, n))
+				break;
+			/* a whole number of text rows can be scrolled on screen */
+			if(!v->sixel && v->top!=old_top && ((long)v->top-old_top)*v->scale%2==0)
+				scroll_cells(v, &b, ((long)v->top-old_top)*(long)v->scale/2);
+		}
+	}
+	ret=1;
+done:
+	free(b.data);
+	return ret;
+}
+
+static int load_sheet(struct view *v, const char *filename, unsigned tiles_per_row) {
+	unsigned char *data;
+	const char *ext=file_extension(filename);
+	size_t len, ofs, chr_len;
+	int ret=0;
+
+	v->filename=filename;
+	if(ext && !strcasecmp(ext, ".png")) {
+		v->is_chr=0;
+		return load_png_indexed(filename, &v->img, &v->png_pal);
+	}
+	v->is_chr=1;
+	data=map_file(filename, &len);
+	if(!data)
+		return 0;
+	if(ines_find_chr(filename, data, len, &ofs, &chr_len))
+		ret=load_chr_data(filename, data+ofs, chr_len, &v->img, 8, 8, 2, tiles_per_row);
+	unmap_file(data, len);
+	return ret;
+}
+
+/* the palette colors first, the values past them as a gray ramp. a PNG
+ * keeps its own PLTE, or its gray levels, unless colors were given. */
+static int setup_colors(struct view *v, const char *colors, const char *palette_filename) {
+	unsigned char master[PALETTE_NES_COLORS][3];
+	struct palette pal;
+	unsigned i, max=v->img.bpp<8?(1u<<v->img.bpp)-1:255;
+
+	if(!v->is_chr && !colors && !palette_filename) {
+		pal=v->png_pal;
+	} else {
+		memcpy(master, nes_palette, sizeof master);
+		if(palette_filename && !palette_load_nes(palette_filename, master))
+			return 0;
+		if(!palette_parse(&pal, colors?colors:DEFAULT_COLORS, master))
+			return 0;
+	}
+	for(i=0;i<256;i++) {
+		if(i<pal.count) {
+			v->colors[i]=(uint32_t)pal.rgb[i][0]<<16|pal.rgb[i][1]<<8|pal.rgb[i][2];
+		} else {
+			unsigned g=i<=max?i*255/max:255;
+
+			v->colors[i]=g<<16|g<<8|g;
+		}
+	}
+	return 1;
+}
+
+static void usage(void) {
+	fprintf(stderr,
+		"usage: " PROG_NAME " [-1] [-m half|sixel|auto] [-s <n>] [-w <width>] [-c <colors>] [-p <pal>] <file>\n"
+	);
+
+	fprintf(stderr,
+		"-1          print the whole sheet and exit, as when not on a terminal.\n"
+		"-m <mode>   half blocks in 24-bit color, sixel, or sixel if the\n"
+		"            terminal says it has it (default auto).\n"
+		"-s <n>      scale each pixel up n times (default 1, 2 for sixel).\n"
+		"-w <width>  tiles per row (default " TOSTR(DEFAULT_COLUMNS) ").\n"
+		"-c <colors> NES color numbers in hex or #rrggbb, comma separated\n"
+		"            (default " DEFAULT_COLORS ", a PNG keeps its own palette\n"
+		"            or gray levels).\n"
+		"-p <pal>    NES palette file to look the colors up in.\n"
+		"PNGs are grayscale or indexed.\n"
+		"keys: j/k or arrows scroll a tile row, space/b a page, g/G go to\n"
+		"the top or bottom, h/l scroll sideways, q quits.\n"
+	);
+}
+
+int main(int argc, char **argv) {
+	const char *colors=NULL, *palette_filename=NULL;
+	unsigned tiles_per_row=DEFAULT_COLUMNS, scale=0;
+	enum mode mode=MODE_AUTO;
+	struct view v;
+	int interactive, once=0, c, ret;
+	char *endptr;
+
+	while((c=getopt(argc, argv, "h1m:s:w:c:p:"))!=-1) {
+		switch(c) {
+			case '1':
+				once=1;
+				break;
+			case 'm':
+				if(!strcmp(optarg, "half")) {
+					mode=MODE_HALF;
+				} else if(!strcmp(optarg, "sixel")) {
+					mode=MODE_SIXEL;
+				} else if(!strcmp(optarg, "auto")) {
+					mode=MODE_AUTO;
+				} else {
+					fprintf(stderr, "Error: -m takes half, sixel or auto.\n");
+					usage();
+					return EXIT_FAILURE;
+				}
+				break;
+			case 's':
+				scale=strtoul(optarg, &endptr, 10);
+				if(*endptr || !scale || scale>16) {
+					fprintf(stderr, "Error: -s takes a number from 1 to 16.\n");
+					usage();
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'w':
+				tiles_per_row=strtoul(optarg, &endptr, 10);
+				if(*endptr || !tiles_per_row) {
+					fprintf(stderr, "Error: -w takes a positive number.\n");
+					usage();
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'c':
+				colors=optarg;
+				break;
+			case 'p':
+				palette_filename=optarg;
+				break;
+			case 'h':
+			default:
+				usage();
+				return EXIT_FAILURE;
+		}
+	}
+	if(optind+1!=argc) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	memset(&v, 0, sizeof v);
+	if(!load_sheet(&v, argv[optind], tiles_per_row))
+		return EXIT_FAILURE;
+	if(!setup_colors(&v, colors, palette_filename)) {
+		image_destroy(&v.img);
+		return EXIT_FAILURE;
+	}
+
+	interactive=!once && isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+	if(interactive && !term_setup()) {
+		image_destroy(&v.img);
+		return EXIT_FAILURE;
+	}
+	v.sixel=mode==MODE_SIXEL || (mode==MODE_AUTO && interactive && term_has_sixel());
+	v.scale=scale?scale:v.sixel?2:1;
+
+	ret=interactive?browse(&v):print_sheet(&v, STDOUT_FILENO);
+	free(v.cells);
+	image_destroy(&v.img);
+	return ret?0:EXIT_FAILURE;
+}
@@ -0,0 +1,271 @@
+/* chrxform.c
+ * flips, rotates and transposes 2bpp CHR tiles in place of a PNG round
+ * trip, working on each plane as a 64-bit word.
+ *
+ * a horizontal flip reverses the bits of each row, a vertical flip the
+ * order of the rows (a byte swap), and the diagonal mirrors and quarter
+ * turns are an 8x8 bit matrix transpose combined with one of the flips.
+ * every tile is a few dozen register operations.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chrjob.h"
+#include "planar.h"
+#include "pool.h"
+#include "util.h"
+
+#define PROG_NAME "chrxform"
+
+enum xform {
+	XFORM_H,	/* mirror left to right */
+	XFORM_V,	/* mirror top to bottom */
+	XFORM_HV,	/* half turn */
+	XFORM_T,	/* mirror across the main diagonal */
+	XFORM_CW,	/* quarter turn clockwise */
+	XFORM_CCW,	/* quarter turn counter-clockwise */
+};
+
+static const char *xform_names[]={"h", "v", "hv", "t", "cw", "ccw"};
+
+/* tiles first to last */
+struct tile_range {
+	size_t first, last;
+};
+
+struct xform_job {
+	enum xform op;
+	const struct tile_range *ranges;	/* NULL for every tile */
+	unsigned range_count;
+	struct tile_range all;
+};
+
+static int verbose_fl;
+
+static inline __attribute__((always_inline)) uint64_t xform_plane(enum xform op, uint64_t p) {
+	switch(op) {
+		case XFORM_H:
+			return planar_hflip(p);
+		case XFORM_V:
+			return planar_vflip(p);
+		case XFORM_HV:
+			return planar_vflip(planar_hflip(p));
+		case XFORM_T:
+			return planar_antitranspose(planar_vflip(planar_hflip(p)));
+		case XFORM_CW:
+			return planar_antitranspose(planar_hflip(p));
+		case XFORM_CCW:
+			return planar_antitranspose(planar_vflip(p));
+	}
+	return p;
+}
+
+/* inlined with a constant op, so each loop is straight-line code */
+static inline __attribute__((always_inline)) void xform_run(enum xform op, const unsigned char *src, unsigned char *dst, size_t tiles) {
+	size_t t;
+
+	for(t=0;t<tiles;t++,src+=PLANAR_TILE_SIZE,dst+=PLANAR_TILE_SIZE) {
+		planar_store(dst, xform_plane(op, planar_load(src)));
+		planar_store(dst+8, xform_plane(op, planar_load(src+8)));
+	}
+}
+
+static void xform_tiles(enum xform op, const unsigned char *src, unsigned char *dst, size_t tiles) {
+	switch(op) {
+		case XFORM_H:
+			xform_run(XFORM_H, src, dst, tiles);
+			break;
+		case XFORM_V:
+			xform_run(XFORM_V, src, dst, tiles);
+			break;
+		case XFORM_HV:
+			xform_run(XFORM_HV, src, dst, tiles);
+			break;
+		case XFORM_T:
+			xform_run(XFORM_T, src, dst, tiles);
+			break;
+		case XFORM_CW:
+			xform_run(XFORM_CW, src, dst, tiles);
+			break;
+		case XFORM_CCW:
+			xform_run(XFORM_CCW, src, dst, tiles);
+			break;
+	}
+}
+
+/* chr_job prepare, checks the ranges against this file's tiles */
+static int xform_prepare(void *arg, const char *filename, size_t tiles) {
+	struct xform_job *job=arg;
+	unsigned i;
+
+	if(!job->ranges) {
+		job->all.first=0;
+		job->all.last=tiles?tiles-1:0;
+		job->range_count=tiles?1:0;
+		return 1;
+	}
+	for(i=0;i<job->range_count;i++) {
+		if(job->ranges[i].last>=tiles) {
+			fprintf(stderr, "%s:no tile %zu, there are %zu.\n", filename, job->ranges[i].last, tiles);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* chr_job kernel, the part of every range that falls in tiles start to end-1 */
+static void xform_kernel(void *arg, const unsigned char *src, unsigned char *dst, size_t start, size_t end) {
+	const struct xform_job *job=arg;
+	const struct tile_range *ranges=job->ranges?job->ranges:&job->all;
+	size_t first, last;
+	unsigned i;
+
+	for(i=0;i<job->range_count;i++) {
+		first=ranges[i].first>start?ranges[i].first:start;
+		last=ranges[i].last+1<end?ranges[i].last+1:end;
+		if(first<last)
+			xform_tiles(job->op, src+first*PLANAR_TILE_SIZE, dst+first*PLANAR_TILE_SIZE, last-first);
+	}
+}
+
+/* parse "0-15,0x20,40-47" */
+static int parse_ranges(const char *s, struct tile_range **ranges, unsigned *count) {
+	unsigned n=1;
+	const char *p;
+	char *endptr;
+
+	for(p=s;*p;p++)
+		if(*p==',')
+			n++;
+	*ranges=malloc(n*sizeof **ranges);
+	if(!*ranges) {
+		perror("malloc()");
+		return 0;
+	}
+	for(*count=0;*count<n;(*count)++) {
+		struct tile_range *r=&(*ranges)[*count];
+
+		r->first=strtoul(s, &endptr, 0);
+		if(endptr==s)
+			return 0;
+		r->last=r->first;
+		if(*endptr=='-') {
+			s=endptr+1;
+			r->last=strtoul(s, &endptr, 0);
+			if(endptr==s || r->last<r->first)
+				return 0;
+		}
+		if(*endptr!=(*count+1<n?',':'\0'))
+			return 0;
+		s=endptr+1;
+	}
+	return 1;
+}
+
+static int xform_file(const char *filename, const char *out_filename, enum xform op, const struct tile_range *ranges, unsigned range_count, unsigned threads) {
+	struct xform_job xj={op, ranges, range_count, {0, 0}};
+	const struct chr_job job={xform_prepare, xform_kernel, &xj};
+	size_t tiles;
+
+	if(!chr_job_file(filename, out_filename, &job, threads, &tiles))
+		return 0;
+	if(verbose_fl)
+		fprintf(stderr, "%s: %s of %zu tiles\n", out_filename, xform_names[op], tiles);
+	return 1;
+}
+
+static void usage(void) {
+	fprintf(stderr,
+		"usage: " PROG_NAME " [-v] [-j <n>] -x <op> [-r <tiles>] [-o <f>] <file>...\n"
+	);
+
+	fprintf(stderr,
+		"-x <op>     h flips left to right, v top to bottom, hv turns half way,\n"
+		"            t mirrors across the diagonal, cw and ccw turn a quarter.\n"
+		"-r <tiles>  only these tiles, like 0-15,0x20,40-47 (default all).\n"
+		"-o <f>      output file, with a single input (default file-xform).\n"
+		"-j <n>      number of threads (default is one per processor).\n"
+		"-v          verbose.\n"
+		"an iNES (.nes) file has its CHR-ROM transformed and the rest copied.\n"
+	);
+}
+
+int main(int argc, char **argv) {
+	const char *op_str=NULL, *range_str=NULL, *out_filename=NULL;
+	unsigned threads=pool_threads(), range_count=0, op;
+	struct tile_range *ranges=NULL;
+	char out_tmp[4096];
+	char *endptr;
+	int c, i, ret=0;
+
+	while((c=getopt(argc, argv, "hvx:r:o:j:"))!=-1) {
+		switch(c) {
+			case 'v':
+				verbose_fl++;
+				break;
+			case 'x':
+				op_str=optarg;
+				break;
+			case 'r':
+				range_str=optarg;
+				break;
+			case 'o':
+				out_filename=optarg;
+				break;
+			case 'j':
+				threads=strtoul(optarg, &endptr, 10);
+				if(*endptr || !threads) {
+					fprintf(stderr, "Error: -j takes a positive number.\n");
+					usage();
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'h':
+			default:
+				usage();
+				return EXIT_FAILURE;
+		}
+	}
+
+	if(optind==argc || !op_str) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	for(op=0;op<sizeof xform_names/sizeof *xform_names;op++)
+		if(!strcmp(op_str, xform_names[op]))
+			break;
+	if(op==sizeof xform_names/sizeof *xform_names) {
+		fprintf(stderr, "Error: unknown transform '%s'.\n", op_str);
+		usage();
+		return EXIT_FAILURE;
+	}
+	if(out_filename && optind+1!=argc) {
+		fprintf(stderr, "Error: -o takes a single input file.\n");
+		return EXIT_FAILURE;
+	}
+	if(range_str && !parse_ranges(range_str, &ranges, &range_count)) {
+		fprintf(stderr, "Error: -r takes tile numbers and ranges like 0-15,0x20.\n");
+		free(ranges);
+		return EXIT_FAILURE;
+	}
+
+	for(i=optind;i<argc;i++) {
+		const char *out=out_filename;
+
+		if(!out) {
+			if(!make_suffixed_name(out_tmp, sizeof out_tmp, argv[i], "-xform")) {
+				fprintf(stderr, "%s:name too long.\n", argv[i]);
+				ret=EXIT_FAILURE;
+				continue;
+			}
+			out=out_tmp;
+		}
+		if(!xform_file(argv[i], out, op, ranges, range_count, threads))
+			ret=EXIT_FAILURE;
+	}
+	free(ranges);
+	return ret;
+}
@@ -0,0 +1,243 @@
+/* conflict.c
+ * report which IPS patches in a set write to the same bytes.
+ *
+ * Every patch is loaded into its own record map, and adjacent records are
+ * merged into touched ranges. All ranges are sorted by start and swept
+ * left to right, keeping the ranges still open in a heap ordered by end.
+ * Each range is compared only with the open ranges it overlaps, so the
+ * work is O(n log n) plus the number of conflicts found.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "ips.h"
+
+#define MATRIX_MAX 64	/* widest matrix worth printing */
+
+struct range {
+	unsigned start, end;	/* end is exclusive */
+	unsigned patch;
+};
+
+struct conflict {
+	unsigned a, b;		/* patch indexes, a < b */
+	unsigned start, end;
+};
+
+struct conflicts {
+	struct conflict *list;
+	size_t count, max;
+};
+
+static int range_cmp(const void *a, const void *b)
+{
+	const struct range *x = a, *y = b;
+
+	if (x->start != y->start)
+		return x->start < y->start ? -1 : 1;
+	return x->patch < y->patch ? -1 : x->patch > y->patch;
+}
+
+static int conflict_cmp(const void *a, const void *b)
+{
+	const struct conflict *x = a, *y = b;
+
+	if (x->a != y->a)
+		return x->a < y->a ? -1 : 1;
+	if (x->b != y->b)
+		return x->b < y->b ? -1 : 1;
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* heap of open ranges, smallest end on top */
+static void heap_push(struct range **heap, size_t *count, struct range *r)
+{
+	size_t i = (*count)++;
+
+	while (i > 0 && heap[(i - 1) / 2]->end > r->end) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = r;
+}
+
+static void heap_pop(struct range **heap, size_t *count)
+{
+	struct range *last = heap[--(*count)];
+	size_t i = 0, child;
+
+	while ((child = i * 2 + 1) < *count) {
+		if (child + 1 < *count && heap[child + 1]->end < heap[child]->end)
+			child++;
+		if (heap[child]->end >= last->end)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = last;
+}
+
+static int add_conflict(struct conflicts *c, const struct range *x,
+	const struct range *y)
+{
+	struct conflict *n;
+
+	if (c->count == c->max) {
+		size_t max = c->max ? c->max * 2 : 256;
+
+		n = realloc(c->list, max * sizeof(*n));
+		if (!n) {
+			perror("realloc()");
+			return -1;
+		}
+		c->list = n;
+		c->max = max;
+	}
+	n = &c->list[c->count++];
+	n->a = x->patch < y->patch ? x->patch : y->patch;
+	n->b = x->patch < y->patch ? y->patch : x->patch;
+	n->start = x->start > y->start ? x->start : y->start;
+	n->end = x->end < y->end ? x->end : y->end;
+	return 0;
+}
+
+/* collect the touched ranges of every patch */
+static struct range *load_ranges(char **patchfiles, int npatches,
+	size_t *count)
+{
+	struct range *ranges = NULL, *tmp;
+	size_t max = 0;
+	int i;
+
+	*count = 0;
+	for (i = 0; i < npatches; i++) {
+		struct patch *patchhead = NULL, *curr;
+
+		if (load_patch(patchfiles[i], &patchhead)) {
+			error("%s: Error loading patch\n", patchfiles[i]);
+			free_patch(patchhead);
+			free(ranges);
+			return NULL;
+		}
+		for (curr = patchhead; curr; curr = curr->next) {
+			if (*count && ranges[*count - 1].patch == (unsigned)i &&
+				ranges[*count - 1].end == curr->offset) {
+				ranges[*count - 1].end += curr->len;
+				continue;
+			}
+			if (*count == max) {
+				max = max ? max * 2 : 1024;
+				tmp = realloc(ranges, max * sizeof(*ranges));
+				if (!tmp) {
+					perror("realloc()");
+					free_patch(patchhead);
+					free(ranges);
+					return NULL;
+				}
+				ranges = tmp;
+			}
+			ranges[*count].start = curr->offset;
+			ranges[*count].end = curr->offset + curr->len;
+			ranges[*count].patch = i;
+			(*count)++;
+		}
+		free_patch(patchhead);
+	}
+
+	if (!ranges)
+		ranges = malloc(sizeof(*ranges)); /* no records at all */
+	return ranges;
+}
+
+static void print_report(char **patchfiles, int npatches,
+	struct conflicts *c)
+{
+	unsigned char *matrix = NULL;
+	size_t i, j;
+	int a, b;
+
+	if (npatches <= MATRIX_MAX)
+		matrix = calloc(npatches, npatches);
+
+	qsort(c->list, c->count, sizeof(*c->list), conflict_cmp);
+	for (i = 0; i < c->count; i = j) {
+		unsigned long bytes = 0, ranges = 0;
+
+		/* merge touching ranges of the same pair while printing */
+		printf("%s <-> %s:\n", patchfiles[c->list[i].a],
+			patchfiles[c->list[i].b]);
+		for (j = i; j < c->count && c->list[j].a == c->list[i].a &&
+			c->list[j].b == c->list[i].b; ) {
+			unsigned start = c->list[j].start, end = c->list[j].end;
+
+			for (j++; j < c->count && c->list[j].a == c->list[i].a &&
+				c->list[j].b == c->list[i].b &&
+				c->list[j].start <= end; j++) {
+				if (c->list[j].end > end)
+					end = c->list[j].end;
+			}
+			printf("  %06x-%06x\n", start, end - 1);
+			bytes += end - start;
+			ranges++;
+		}
+		printf("  %lu ranges, %lu bytes\n", ranges, bytes);
+		if (matrix) {
+			matrix[c->list[i].a * npatches + c->list[i].b] = 1;
+			matrix[c->list[i].b * npatches + c->list[i].a] = 1;
+		}
+	}
+
+	if (!c->count)
+		printf("no conflicts\n");
+
+	if (matrix && c->count) {
+		printf("\n");
+		for (a = 0; a < npatches; a++) {
+			printf("%3d ", a);
+			for (b = 0; b < npatches; b++)
+				putchar(a == b ? '\\' :
+					matrix[a * npatches + b] ? 'X' : '.');
+			printf("  %s\n", patchfiles[a]);
+		}
+	}
+	free(matrix);
+}
+
+int conflicts(char **patchfiles, int npatches)
+{
+	struct conflicts c = { NULL, 0, 0 };
+	struct range *ranges, **heap;
+	size_t count, open = 0, i, j;
+	int e = 0;
+
+	ranges = load_ranges(patchfiles, npatches, &count);
+	if (!ranges)
+		return -1;
+	verbose("%zd ranges in %d patches\n", count, npatches);
+
+	heap = malloc((count ? count : 1) * sizeof(*heap));
+	if (!heap) {
+		perror("malloc()");
+		free(ranges);
+		return -1;
+	}
+
+	qsort(ranges, count, sizeof(*ranges), range_cmp);
+	for (i = 0; i < count && !e; i++) {
+		while (open && heap[0]->end <= ranges[i].start)
+			heap_pop(heap, &open);
+		for (j = 0; j < open && !e; j++) {
+			if (heap[j]->patch != ranges[i].patch)
+				e = add_conflict(&c, heap[j], &ranges[i]);
+		}
+		heap_push(heap, &open, &ranges[i]);
+	}
+
+	if (!e)
+		print_report(patchfiles, npatches, &c);
+
+	free(c.list);
+	free(heap);
+	free(ranges);
+	return e;
+}
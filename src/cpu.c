@@ -0,0 +1,42 @@
+/* cpu.c
+ * finds the instruction set extensions the kernels can use.
+ *
+ * kernels for newer extensions are compiled with target attributes next to
+ * their portable versions, so one binary runs everywhere. the choice is
+ * made once, from a constructor or an init function, before any threads
+ * start. NESTOOLS_CPU=generic in the environment turns the extensions off,
+ * for comparing against the portable kernels.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+/* call before starting threads */
+unsigned cpu_features(void) {
+	static unsigned features;
+	static int ready;
+	unsigned found=0;
+	const char *env;
+
+	if(ready)
+		return features;
+	env=getenv("NESTOOLS_CPU");
+	if(!env || strcmp(env, "generic")) {
+#ifdef HAVE_CPU_DISPATCH
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("ssse3"))
+			found|=CPU_SSSE3;
+		if(__builtin_cpu_supports("popcnt"))
+			found|=CPU_POPCNT;
+		if(__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+			found|=CPU_PCLMUL;
+		if(__builtin_cpu_supports("avx2"))
+			found|=CPU_AVX2;
+#endif
+	}
+	/* ready only once features is complete */
+	features=found;
+	ready=1;
+	return features;
+}
@@ -0,0 +1,12 @@
+/* cpu.h
+ * instruction set extensions found at run time, for picking kernels.
+ */
+#ifndef CPU_H
+#define CPU_H
+#define CPU_SSSE3 1
+#define CPU_POPCNT 2
+#define CPU_PCLMUL 4
+#define CPU_AVX2 8
+
+unsigned cpu_features(void);
+#endif
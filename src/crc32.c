@@ -0,0 +1,132 @@
+/* crc32.c
+ * slice-by-8 CRC-32, reflected polynomial 0xEDB88320.
+ *
+ * Eight bytes are folded per step using eight 256-entry tables, where
+ * table k holds the CRC of a byte followed by k zero bytes.
+ *
+ * with PCLMULQDQ, long runs are folded 64 bytes per step by carry-less
+ * multiplication and finished with a Barrett reduction, as in Intel's
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ".
+ */
+#include <stddef.h>
+#include <stdint.h>
+#ifdef HAVE_CPU_DISPATCH
+#include <immintrin.h>
+#endif
+#include "cpu.h"
+#include "crc32.h"
+
+#define CRC32_POLY 0xedb88320u
+
+static uint32_t crc_table[8][256];
+static int crc_table_ready;
+static int crc_pclmul;
+
+/* build the tables. call once before using crc32_update() from threads. */
+void crc32_init(void) {
+	uint32_t c;
+	unsigned i, k;
+
+	if(crc_table_ready) return;
+
+	for(i=0;i<256;i++) {
+		c=i;
+		for(k=0;k<8;k++)
+			c=(c&1)?(c>>1)^CRC32_POLY:c>>1;
+		crc_table[0][i]=c;
+	}
+	for(i=0;i<256;i++) {
+		for(k=1;k<8;k++)
+			crc_table[k][i]=(crc_table[k-1][i]>>8)^crc_table[0][crc_table[k-1][i]&0xff];
+	}
+	crc_pclmul=(cpu_features()&CPU_PCLMUL)!=0;
+	crc_table_ready=1;
+}
+
+#ifdef HAVE_CPU_DISPATCH
+/* fold len bytes into the (inverted) crc. len is at least 64 and a
+ * multiple of 16. the constants are x^n mod P for the fold distances,
+ * bit-reflected. */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_fold(uint32_t crc, const unsigned char *p, size_t len) {
+	const __m128i k1k2=_mm_set_epi64x(0x1c6e41596, 0x154442bd4); /* 512 bits */
+	const __m128i k3k4=_mm_set_epi64x(0xccaa009e, 0x1751997d0); /* 128 bits */
+	const __m128i k5=_mm_set_epi64x(0, 0x163cd6124); /* 64 bits */
+	const __m128i poly=_mm_set_epi64x(0x1f7011641, 0x1db710641); /* mu, P */
+	const __m128i mask32=_mm_set_epi32(0, 0, 0, -1);
+	__m128i x1, x2, x3, x4, t1, t2, t3, t4;
+
+	x1=_mm_xor_si128(_mm_loadu_si128((const __m128i*)p), _mm_cvtsi32_si128(crc));
+	x2=_mm_loadu_si128((const __m128i*)(p+16));
+	x3=_mm_loadu_si128((const __m128i*)(p+32));
+	x4=_mm_loadu_si128((const __m128i*)(p+48));
+	for(p+=64,len-=64;len>=64;p+=64,len-=64) {
+		t1=_mm_clmulepi64_si128(x1, k1k2, 0x00);
+		t2=_mm_clmulepi64_si128(x2, k1k2, 0x00);
+		t3=_mm_clmulepi64_si128(x3, k1k2, 0x00);
+		t4=_mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1=_mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2=_mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3=_mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4=_mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1=_mm_xor_si128(_mm_xor_si128(x1, t1), _mm_loadu_si128((const __m128i*)p));
+		x2=_mm_xor_si128(_mm_xor_si128(x2, t2), _mm_loadu_si128((const __m128i*)(p+16)));
+		x3=_mm_xor_si128(_mm_xor_si128(x3, t3), _mm_loadu_si128((const __m128i*)(p+32)));
+		x4=_mm_xor_si128(_mm_xor_si128(x4, t4), _mm_loadu_si128((const __m128i*)(p+48)));
+	}
+
+	/* fold the four lanes into one, then any 16 byte blocks left */
+	t1=_mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1=_mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), t1), x2);
+	t1=_mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1=_mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), t1), x3);
+	t1=_mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1=_mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), t1), x4);
+	for(;len>=16;p+=16,len-=16) {
+		t1=_mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1=_mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), t1), _mm_loadu_si128((const __m128i*)p));
+	}
+
+	/* 128 bits to 64 */
+	x1=_mm_xor_si128(_mm_srli_si128(x1, 8), _mm_clmulepi64_si128(x1, k3k4, 0x10));
+	x1=_mm_xor_si128(_mm_srli_si128(x1, 4), _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5, 0x00));
+
+	/* Barrett reduction to 32 */
+	t1=_mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+	t1=_mm_clmulepi64_si128(_mm_and_si128(t1, mask32), poly, 0x00);
+	return _mm_extract_epi32(_mm_xor_si128(x1, t1), 1);
+}
+#endif
+
+/* continue a CRC. start with crc=0. */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+	const unsigned char *p=data;
+	uint32_t a, b;
+
+	crc32_init();
+
+	crc=~crc;
+#ifdef HAVE_CPU_DISPATCH
+	if(crc_pclmul && len>=64) {
+		size_t n=len&~(size_t)15;
+
+		crc=crc32_fold(crc, p, n);
+		p+=n;
+		len-=n;
+	}
+#endif
+	while(len>=8) {
+		a=crc^(p[0]|(uint32_t)p[1]<<8|(uint32_t)p[2]<<16|(uint32_t)p[3]<<24);
+		b=p[4]|(uint32_t)p[5]<<8|(uint32_t)p[6]<<16|(uint32_t)p[7]<<24;
+		crc=crc_table[7][a&0xff]^crc_table[6][(a>>8)&0xff]^
+			crc_table[5][(a>>16)&0xff]^crc_table[4][a>>24]^
+			crc_table[3][b&0xff]^crc_table[2][(b>>8)&0xff]^
+			crc_table[1][(b>>16)&0xff]^crc_table[0][b>>24];
+		p+=8;
+		len-=8;
+	}
+	while(len--)
+		crc=crc_table[0][(crc^*p++)&0xff]^(crc>>8);
+
+	return ~crc;
+}
@@ -0,0 +1,10 @@
+/* crc32.h
+ * CRC-32 (IEEE 802.3, as used by zip, PNG, BPS and UPS).
+ */
+#ifndef CRC32_H
+#define CRC32_H
+#include <stddef.h>
+#include <stdint.h>
+void crc32_init(void);
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len);
+#endif
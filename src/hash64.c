@@ -0,0 +1,85 @@
+/* hash64.c
+ * fast non-cryptographic 64-bit hash. this follows XXH64: four lanes over
+ * 32-byte stripes, then the tail and a final avalanche. input is always
+ * read little-endian so hashes stored on disk are portable.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include "hash64.h"
+
+#define P1 0x9e3779b185ebca87ull
+#define P2 0xc2b2ae3d27d4eb4full
+#define P3 0x165667b19e3779f9ull
+#define P4 0x85ebca77c2b2ae63ull
+#define P5 0x27d4eb2f165667c5ull
+
+static inline uint64_t rotl64(uint64_t x, unsigned r) {
+	return (x<<r)|(x>>(64-r));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+	return (uint64_t)p[0]|((uint64_t)p[1]<<8)|((uint64_t)p[2]<<16)|((uint64_t)p[3]<<24)
+		|((uint64_t)p[4]<<32)|((uint64_t)p[5]<<40)|((uint64_t)p[6]<<48)|((uint64_t)p[7]<<56);
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+	return (uint32_t)p[0]|((uint32_t)p[1]<<8)|((uint32_t)p[2]<<16)|((uint32_t)p[3]<<24);
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+	acc+=input*P2;
+	acc=rotl64(acc, 31);
+	return acc*P1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t val) {
+	acc^=round64(0, val);
+	return acc*P1+P4;
+}
+
+uint64_t hash64(const void *data, size_t len, uint64_t seed) {
+	const unsigned char *p=data, *end=p+len;
+	uint64_t h;
+
+	if(len>=32) {
+		const unsigned char *limit=end-32;
+		uint64_t v1=seed+P1+P2, v2=seed+P2, v3=seed, v4=seed-P1;
+
+		do {
+			v1=round64(v1, read64(p));
+			v2=round64(v2, read64(p+8));
+			v3=round64(v3, read64(p+16));
+			v4=round64(v4, read64(p+24));
+			p+=32;
+		} while(p<=limit);
+		h=rotl64(v1, 1)+rotl64(v2, 7)+rotl64(v3, 12)+rotl64(v4, 18);
+		h=merge64(h, v1);
+		h=merge64(h, v2);
+		h=merge64(h, v3);
+		h=merge64(h, v4);
+	} else {
+		h=seed+P5;
+	}
+	h+=len;
+
+	for(;p+8<=end;p+=8) {
+		h^=round64(0, read64(p));
+		h=rotl64(h, 27)*P1+P4;
+	}
+	if(p+4<=end) {
+		h^=read32(p)*P1;
+		h=rotl64(h, 23)*P2+P3;
+		p+=4;
+	}
+	for(;p<end;p++) {
+		h^=*p*P5;
+		h=rotl64(h, 11)*P1;
+	}
+
+	h^=h>>33;
+	h*=P2;
+	h^=h>>29;
+	h*=P3;
+	h^=h>>32;
+	return h;
+}
@@ -0,0 +1,9 @@
+/* hash64.h
+ * fast non-cryptographic 64-bit hash (the XXH64 construction).
+ */
+#ifndef HASH64_H
+#define HASH64_H
+#include <stddef.h>
+#include <stdint.h>
+uint64_t hash64(const void *data, size_t len, uint64_t seed);
+#endif
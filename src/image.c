@@ -8,11 +8,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <png.h>
 
 #include "image.h"
 #include "log.h"
+#include "palette.h"
+#include "planar.h"
 #include "util.h"
 
 static inline size_t calc_rowbytes(unsigned width, unsigned bpp) {
@@ -46,6 +49,10 @@ static unsigned get_pixel(const struct image *img, unsigned x, unsigned y) {
 	return ret;
 }
 
+unsigned image_get_pixel(const struct image *img, unsigned x, unsigned y) {
+	return get_pixel(img, x, y);
+}
+
 /* get pixel from a planar buffer
  * len is the length of the whole interlaced region in bytes
  * set endian to 1 for NES PPU's endian */
@@ -58,19 +65,14 @@ static unsigned get_pixel_planar(const unsigned char *ptr, unsigned bpp, size_t
 	assert(bpp > 0 && bpp <= 32);
 	assert(y < len*w/bpp);
 
-	/* 1 bit per plane */
-	pixel_index=x%8;
+	/* 1 bit per plane, the NES PPU keeps the first pixel in the MSB */
+	pixel_index=endian ? 7-x%8 : x%8;
 	x/=8;
 
-	/* this works out to swap bytes because of the planar nature */
-	if((w*bpp)/8>1 && endian)
-		pixel_index^=1<<bpp;
-
 	ptr=ptr+x+y*((w+7)/8); /* treat as 1bpp for rowbytes */
 	g=0;
 	for(i=0;i<bpp;i++,ptr+=(len/bpp)) {
-		g<<=1;
-		g|=(*ptr>>pixel_index)&1;
+		g|=((*ptr>>pixel_index)&1)<<i; /* first plane is the low bit */
 	}
 #if 0 /* diagnostic junk */
 	TRACE("(%u,%u)=0x%x pi=%d ptr=%p w=%d\n", x*8+pixel_index, y, g, pixel_index, ptr, w);
@@ -93,7 +95,7 @@ static void put_pixel(struct image *img, unsigned x, unsigned y, unsigned c) {
 	}
 
 	pixels_per_byte=8/img->bpp;
-	pixel_index=x%pixels_per_byte; /* which pixel */
+	pixel_index=(~x)%pixels_per_byte; /* which pixel - MSB is the low order pixel */
 	x/=pixels_per_byte;
 
 	c&=(1<<img->bpp)-1; /* mask off unnecessary bits */
@@ -157,14 +159,19 @@ void image_destroy(struct image *img) {
 	img->image_data=NULL;
 }
 
-/* loads a PNG as an 8bpp image.
- * img - pointer to an uninitialized structure (will be overwritten) */
-int load_png(const char *filename, struct image *img) {
+/* loads a grayscale or indexed PNG at its own bit depth.
+ * img - pointer to an uninitialized structure (will be overwritten)
+ * pal - if not NULL gets the PLTE of an indexed PNG, a count of 0 for
+ *       grayscale */
+int load_png_indexed(const char *filename, struct image *img, struct palette *pal) {
 	FILE *f;
 	png_structp png_ptr=NULL;
 	png_infop info_ptr=NULL;
 	png_bytep *row_pointers=NULL, image_data=NULL;
+	png_colorp plte;
+	png_bytep trans;
 	int ret=0; /* default to failure */
+	int color_type, entries, trans_count;
 	unsigned i;
 
 	/* use this member to know if we should free the struct */
@@ -200,6 +207,29 @@ int load_png(const char *filename, struct image *img) {
 
 	png_read_info(png_ptr, info_ptr);
 
+	/* before the transformations, stripping alpha drops the tRNS */
+	color_type=png_get_color_type(png_ptr, info_ptr);
+	if(pal) {
+		pal->count=0;
+		pal->transparent=-1;
+		if(color_type==PNG_COLOR_TYPE_PALETTE && png_get_PLTE(png_ptr, info_ptr, &plte, &entries)) {
+			for(i=0;i<(unsigned)entries && i<256;i++) {
+				pal->rgb[i][0]=plte[i].red;
+				pal->rgb[i][1]=plte[i].green;
+				pal->rgb[i][2]=plte[i].blue;
+			}
+			pal->count=i;
+			if(png_get_tRNS(png_ptr, info_ptr, &trans, &trans_count, NULL)) {
+				for(i=0;i<(unsigned)trans_count;i++) {
+					if(!trans[i]) {
+						pal->transparent=i;
+						break;
+					}
+				}
+			}
+		}
+	}
+
 	png_set_strip_alpha(png_ptr);
 
 	/* strip 16-bit depths down to 8-bit */
@@ -210,6 +240,13 @@ int load_png(const char *filename, struct image *img) {
 	/* update info with requested transformations */
 	png_read_update_info(png_ptr, info_ptr);
 
+	/* a pixel is a color index or a gray level, color can't be told apart */
+	color_type=png_get_color_type(png_ptr, info_ptr);
+	if(color_type!=PNG_COLOR_TYPE_GRAY && color_type!=PNG_COLOR_TYPE_PALETTE) {
+		fprintf(stderr, "%s:only grayscale and indexed PNGs are supported.\n", filename);
+		goto failure;
+	}
+
 	DEBUG("%s:%ux%u,%u\n",
 		filename,
 		(unsigned)info_ptr->width, (unsigned)info_ptr->height,
@@ -244,77 +281,72 @@ failure:
 	return ret;
 }
 
-/* load interlaced CHR data */
-int load_chr(const char *filename, struct image *img, unsigned tile_width, unsigned tile_height, unsigned bpp, unsigned tiles_per_row) {
-	FILE *f=NULL;
+int load_png(const char *filename, struct image *img) {
+	return load_png_indexed(filename, img, NULL);
+}
+
+/* the common case, NES tiles, decoded in batches by the fastest kernel */
+static void load_chr_2bpp(const unsigned char *data, unsigned total_tiles, struct image *img, unsigned tiles_per_row) {
+	unsigned char buf[256*PLANAR_TILE_SIZE];
+	unsigned i, n, k, r;
+
+	for(i=0;i<total_tiles;i+=n) {
+		n=total_tiles-i<256 ? total_tiles-i : 256;
+		planar_decode_2bpp(data+(size_t)i*PLANAR_TILE_SIZE, buf, n);
+		for(k=0;k<n;k++) {
+			unsigned char *dest=img->image_data+(size_t)(i+k)/tiles_per_row*8*img->rowbytes+(i+k)%tiles_per_row*2;
+
+			for(r=0;r<8;r++)
+				memcpy(dest+r*img->rowbytes, buf+k*PLANAR_TILE_SIZE+r*2, 2);
+		}
+	}
+}
+
+/* decode interlaced CHR data already in memory */
+int load_chr_data(const char *filename, const unsigned char *data, size_t len, struct image *img, unsigned tile_width, unsigned tile_height, unsigned bpp, unsigned tiles_per_row) {
 	unsigned height, width, i, total_tiles;
-	long len;
-	unsigned char *inbuf=NULL, *currtile;
+	const unsigned char *currtile;
 	const size_t tilebytes=calc_rowbytes(tile_width, bpp)*tile_height;
-	size_t res;
 
 	assert(img != NULL);
 
 	/* at least 1 tile per row */
 	if(tiles_per_row<1) tiles_per_row=1;
 
-	f=fopen(filename, "rb");
-	if(!f) {
-		PERROR(filename);
-		return 0; /* failure */
-	}
-
-	len=filesize(filename, f);
-	if(len<0) {
-		fclose(f);
-		return 0; /* failure */
-	}
-
 	/* check that there are an even number of tiles in the input file */
 	total_tiles=len/tilebytes;
 	if((len%tilebytes) != 0) {
-		fprintf(stderr, "%s:file size %lu does contain an even number of %ux%u,%ubpp tiles\n", filename, len, tile_width, tile_height, bpp);
-		goto failure;
+		fprintf(stderr, "%s:file size %zu does contain an even number of %ux%u,%ubpp tiles\n", filename, len, tile_width, tile_height, bpp);
+		return 0;
+	}
+	if(!total_tiles) {
+		fprintf(stderr, "%s:no tiles\n", filename);
+		return 0;
 	}
 
 	/* calculate the number of tiles and how many we can fit on a sheet */
 	width=tiles_per_row*tile_width;
 	height=tile_height*((total_tiles+tiles_per_row-1)/tiles_per_row); /* round up */
 
-	DEBUG("%s:tile_width = %d, tile_height = %d, tiles_per_row = %d, total_tiles = %d, bpp = %d, len = %ld, width = %d, height = %d\n", filename, tile_width, tile_height, tiles_per_row, total_tiles, bpp, len, width, height);
-
-	/* allocate a buffer for CHR data */
-	inbuf=calloc(1, len);
-	if(!inbuf) {
-		PERROR("malloc()");
-		goto failure;
-	}
-
-	/* read the data */
-	res=fread(inbuf, 1, len, f);
-	if(ferror(f)) {
-		PERROR(filename);
-		goto failure;
-	}
-	if(res!=(size_t)len) {
-		fprintf(stderr, "%s:short read\n", filename);
-		goto failure;
-	}
+	DEBUG("%s:tile_width = %d, tile_height = %d, tiles_per_row = %d, total_tiles = %d, bpp = %d, len = %zu, width = %d, height = %d\n", filename, tile_width, tile_height, tiles_per_row, total_tiles, bpp, len, width, height);
 
 	/* output image */
 	if(!image_create(img, width, height, bpp, 0)) {
 		fprintf(stderr, "%s:Could not create image (%ux%u,%u).\n", filename, width, height, bpp);
-		goto failure;
+		return 0;
 	}
 	DEBUG("Loading image %ux%u,%ubpp\n", img->xres, img->yres, img->bpp);
 
+	if(tile_width==8 && tile_height==8 && bpp==2) {
+		load_chr_2bpp(data, total_tiles, img, tiles_per_row);
+		return 1; /* success */
+	}
+
 	/* convert the planar input data into regular data */
-	TRACE("tiles = %d\n", len/tilebytes);
-	for(currtile=inbuf,i=0;i<len/tilebytes;i++,currtile+=tilebytes) {
-		size_t ofs;
+	TRACE("tiles = %d\n", total_tiles);
+	for(currtile=data,i=0;i<total_tiles;i++,currtile+=tilebytes) {
 		unsigned g, x, y;
 
-		// TRACE("inbuf=%p ofs=%zd i=%d tilebytes=%zd\n", inbuf, ofs, i, tilebytes);
 		for(y=0;y<tile_height;y++) {
 			for(x=0;x<tile_width;x++) {
 				unsigned ix, iy; /* destination image x, y */
@@ -329,30 +361,23 @@ int load_chr(const char *filename, struct image *img, unsigned tile_width, unsig
 		}
 	}
 
-#if 0 /* diagnostic junk */
-	TRACE("i0: %#x i1: %#x i2: %#x i3: %#x\n", inbuf[0], inbuf[1], inbuf[2], inbuf[3]);
-	inbuf[0]=0x33;
-	inbuf[1]=0x33;
-	inbuf[2]=0x33;
-	inbuf[3]=0x33;
-	TRACE("g0: %#x g1: %#x g2: %#x g3: %#x\n",
-		get_pixel(img, 0, 0),
-		get_pixel(img, 1, 0),
-		get_pixel(img, 2, 0),
-		get_pixel(img, 3, 0)
-	);
-#endif
+	return 1; /* success */
+}
 
-	free(inbuf);
-	fclose(f);
+/* load interlaced CHR data */
+int load_chr(const char *filename, struct image *img, unsigned tile_width, unsigned tile_height, unsigned bpp, unsigned tiles_per_row) {
+	unsigned char *data;
+	size_t len;
+	int ret;
 
-	return 1; /* success */
+	data=map_file(filename, &len);
+	if(!data)
+		return 0; /* failure */
 
-failure:
-	free(inbuf);
-	fclose(f);
+	ret=load_chr_data(filename, data, len, img, tile_width, tile_height, bpp, tiles_per_row);
+	unmap_file(data, len);
 
-	return 0;
+	return ret;
 }
 
 /* copy a tile area from img to dest */
@@ -444,9 +469,121 @@ failure:
 	return 0; /* failure */
 }
 
-static void user_error_fn(png_structp png_ptr __attribute__((unused)), png_const_charp error_msg) {
+/**
+ * convert an image to 2bpp tiles in memory, in the order save_chr() writes them.
+ * @returns a malloc()ed buffer of *len bytes, or NULL on error */
+unsigned char *image_to_chr(const char *filename, struct image *img, unsigned tile_w, unsigned tile_h, size_t *len) {
+	const unsigned bpp=2; /* output bpp, as save_chr() */
+	const size_t tilebytes=tile_h*calc_rowbytes(tile_w, bpp);
+	unsigned tx, ty, rows, cols;
+	unsigned char *buf, *p;
+
+	assert(tile_w > 0 && tile_h > 0);
+
+	cols=img->xres/tile_w;
+	rows=img->yres/tile_h;
+	if((img->xres%tile_w)!=0 && (img->yres%tile_h)!=0) {
+		fprintf(stderr, "%s:image size %ux%u not a multiple of tiles size %ux%u\n", filename, img->xres, img->yres, tile_w, tile_h);
+		return NULL;
+	}
+
+	buf=malloc((size_t)rows*cols*tilebytes+1);
+	if(!buf) {
+		PERROR("malloc()");
+		return NULL;
+	}
+	for(p=buf,ty=0;ty<rows;ty++) {
+		for(tx=0;tx<cols;tx++,p+=tilebytes) {
+			if(!copy_chr_tile(img, tx*tile_w, ty*tile_h, p, tile_w, tile_h, bpp)) {
+				free(buf);
+				return NULL;
+			}
+		}
+	}
+	*len=(size_t)rows*cols*tilebytes;
+	return buf;
+}
+
+/* true if the tile at x, y differs between two images of the same size */
+static int tile_changed(const struct image *a, const struct image *b, unsigned x, unsigned y, unsigned tile_w, unsigned tile_h) {
+	unsigned i, j;
+
+	if((x*a->bpp)%8==0 && (tile_w*a->bpp)%8==0) {
+		const size_t ofs=x*a->bpp/8, len=tile_w*a->bpp/8;
+
+		for(j=y;j<y+tile_h;j++)
+			if(memcmp(a->image_data+j*a->rowbytes+ofs, b->image_data+j*b->rowbytes+ofs, len))
+				return 1;
+		return 0;
+	}
+	for(j=y;j<y+tile_h;j++)
+		for(i=x;i<x+tile_w;i++)
+			if(get_pixel(a, i, j)!=get_pixel(b, i, j))
+				return 1;
+	return 0;
+}
+
+/* write the tiles of img that differ from prev into fd, a CHR file that
+ * save_chr() made from prev. runs of changed tiles go out in one pwrite().
+ * @returns the number of tiles written, or -1 on error */
+long update_chr(const char *filename, int fd, const struct image *prev, struct image *img, unsigned tile_w, unsigned tile_h) {
+	const unsigned bpp=2; /* output bpp, as save_chr() */
+	const size_t tilebytes=tile_h*calc_rowbytes(tile_w, bpp);
+	unsigned cols, total, t, run;
+	unsigned char *buf;
+	long count=0;
+
+	assert(tile_w > 0 && tile_h > 0);
+
+	if(prev->xres!=img->xres || prev->yres!=img->yres || prev->bpp!=img->bpp) {
+		fprintf(stderr, "%s:image size changed\n", filename);
+		return -1;
+	}
+	cols=img->xres/tile_w;
+	total=cols*(img->yres/tile_h);
+
+	buf=malloc(total*tilebytes);
+	if(!buf) {
+		PERROR("malloc()");
+		return -1;
+	}
+	for(t=0;t<total;t+=run) {
+		off_t ofs=(off_t)t*tilebytes;
+		ssize_t res;
+		size_t len;
+
+		for(run=0;t+run<total;run++) {
+			unsigned x=(t+run)%cols*tile_w, y=(t+run)/cols*tile_h;
+
+			if(!tile_changed(prev, img, x, y, tile_w, tile_h))
+				break;
+			copy_chr_tile(img, x, y, buf+run*tilebytes, tile_w, tile_h, bpp);
+		}
+		if(!run) {
+			run=1;
+			continue;
+		}
+		count+=run;
+		for(len=run*tilebytes;len;len-=res,ofs+=res) {
+			res=pwrite(fd, buf+(ofs-(off_t)t*tilebytes), len, ofs);
+			if(res<0 && errno==EINTR) {
+				res=0;
+				continue;
+			}
+			if(res<=0) {
+				PERROR(filename);
+				free(buf);
+				return -1;
+			}
+		}
+	}
+	free(buf);
+	return count;
+}
+
+static void user_error_fn(png_structp png_ptr, png_const_charp error_msg) {
 	fprintf(stderr, "ERROR:%s\n", error_msg);
-	exit(EXIT_FAILURE); /* TODO: return back to save_png */
+	longjmp(png_jmpbuf(png_ptr), 1); /* back to write_png */
 }
 
 static void user_warning_fn(png_structp png_ptr __attribute__((unused)), png_const_charp warning_msg) {
@@ -461,7 +598,7 @@ static void do_png_time(png_structp png_ptr, png_infop info_ptr) {
 
 	/* for tIME */
 	time(&t);
-	tm=*gmtime(&t);
+	gmtime_r(&t, &tm); /* banks are saved from several threads */
 	pt.year=tm.tm_year+1900;
 	pt.month=tm.tm_mon;
 	pt.day=tm.tm_mday;
@@ -471,17 +608,91 @@ static void do_png_time(png_structp png_ptr, png_infop info_ptr) {
 	png_set_tIME(png_ptr, info_ptr, &pt);
 }
 
-int save_png(const char *filename, struct image *img) {
+/* highest color index used in img */
+static unsigned max_color(const struct image *img) {
+	unsigned x, y, c, max=0;
+
+	for(y=0;y<img->yres;y++) {
+		for(x=0;x<img->xres;x++) {
+			c=get_pixel(img, x, y);
+			if(c>max)
+				max=c;
+		}
+	}
+	return max;
+}
+
+/* smallest PNG bit depth that can hold color */
+static unsigned min_bit_depth(unsigned color) {
+	unsigned depth;
+
+	for(depth=1;depth<8 && color>>depth;depth*=2) ;
+	return depth;
+}
+
+/* repack one row of img at a different bit depth, MSB is the first pixel */
+static void pack_row(const struct image *img, unsigned y, unsigned char *dest, unsigned depth) {
+	unsigned x, shift=8;
+
+	memset(dest, 0, calc_rowbytes(img->xres, depth));
+	for(x=0;x<img->xres;x++) {
+		shift-=depth;
+		*dest|=get_pixel(img, x, y)<<shift;
+		if(!shift) {
+			shift=8;
+			dest++;
+		}
+	}
+}
+
+/* smallest depth of an indexed PNG that holds the colors img uses, or 0 if
+ * pal doesn't have them all */
+static unsigned indexed_depth(const char *filename, const struct image *img, const struct palette *pal) {
+	unsigned used=max_color(img)+1;
+
+	if(used>pal->count) {
+		fprintf(stderr, "%s:color %u is used but the palette has %u.\n", filename, used-1, pal->count);
+		return 0;
+	}
+	return min_bit_depth(used-1);
+}
+
+/* write img as grayscale at its own depth, or if pal is given as an indexed
+ * image at the smallest depth that holds the colors actually used.
+ * everything the error path reads is set up before setjmp(), and only
+ * assigned once, so a longjmp() can't leave it clobbered. */
+static int write_png(const char *filename, struct image *img, const struct palette *pal) {
+	const unsigned depth=pal ? indexed_depth(filename, img, pal) : img->bpp;
+	/* any entries the bit depth can reach are kept for editors */
+	const unsigned entries=pal && depth ? (pal->count<(1u<<depth) ? pal->count : 1u<<depth) : 0;
 	FILE *f=NULL;
 	unsigned y;
-	unsigned char *p;
 	png_structp png_ptr;
 	png_infop info_ptr;
-	png_bytep rowdata=NULL;
+	png_bytep rowdata;
+	png_color plte[256];
+	png_byte trans[256];
+
+	if(!depth)
+		return 0; /* failure */
+	for(y=0;y<entries;y++) {
+		plte[y].red=pal->rgb[y][0];
+		plte[y].green=pal->rgb[y][1];
+		plte[y].blue=pal->rgb[y][2];
+		trans[y]=(int)y==pal->transparent ? 0 : 255;
+	}
+
+	/* a row repacked to a form png likes, when the depth changes */
+	rowdata=depth!=img->bpp ? malloc(calc_rowbytes(img->xres, depth)) : NULL;
+	if(depth!=img->bpp && !rowdata) {
+		PERROR("malloc()");
+		return 0; /* failure */
+	}
 
 	f=fopen(filename, "wb");
 	if(!f) {
 		PERROR(filename);
+		free(rowdata);
 		return 0; /* failure */
 	}
 
@@ -503,14 +714,17 @@ int save_png(const char *filename, struct image *img) {
 
 	png_set_compression_level(png_ptr, Z_BEST_COMPRESSION);
 
-	fprintf(stderr, "%s:writing %ux%u,%u\n", filename, img->xres, img->yres, img->bpp);
+	fprintf(stderr, "%s:writing %ux%u,%u%s\n", filename, img->xres, img->yres, depth, pal ? " indexed" : "");
 
-	png_set_IHDR(png_ptr, info_ptr, img->xres, img->yres, img->bpp, PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-
-	/* for PNG_COLOR_TYPE_PALETTE:
-	 * png_set_PLTE(png_ptr, info_ptr, pal, 2);
-	 * png_set_tRNS(png_ptr, info_ptr, trans, 1, ??);
-	 */
+	if(pal) {
+		png_set_IHDR(png_ptr, info_ptr, img->xres, img->yres, depth, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+		png_set_PLTE(png_ptr, info_ptr, plte, entries);
+		/* tRNS can stop after the transparent entry */
+		if(pal->transparent>=0 && (unsigned)pal->transparent<entries)
+			png_set_tRNS(png_ptr, info_ptr, trans, pal->transparent+1, NULL);
+	} else {
+		png_set_IHDR(png_ptr, info_ptr, img->xres, img->yres, depth, PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	}
 
 	/* warn editors not to muck with the values */
 	png_set_sRGB_gAMA_and_cHRM(png_ptr, info_ptr, PNG_sRGB_INTENT_ABSOLUTE);
@@ -519,23 +733,29 @@ int save_png(const char *filename, struct image *img) {
 
 	png_write_info(png_ptr, info_ptr);
 
-	/* convert data to a form png likes */
-	rowdata=malloc(img->rowbytes);
-
 	assert(img->rowbytes >= calc_rowbytes(img->xres, img->bpp)); /* verify the data structure makes sense */
 
-	p=img->image_data;
-	for(y=0;y<img->yres;y++) {
-		png_write_row(png_ptr, img->image_data+img->rowbytes*y);
+	if(!rowdata) {
+		for(y=0;y<img->yres;y++) {
+			png_write_row(png_ptr, img->image_data+img->rowbytes*y);
+		}
+	} else {
+		for(y=0;y<img->yres;y++) {
+			pack_row(img, y, rowdata, depth);
+			png_write_row(png_ptr, rowdata);
+		}
 	}
 
-	free(rowdata);
-
 	png_write_end(png_ptr, info_ptr);
 
 	png_destroy_write_struct(&png_ptr, &info_ptr);
 
-	fclose(f);
+	free(rowdata);
+
+	if(fclose(f)) {
+		PERROR(filename);
+		return 0; /* failure */
+	}
 
 	return 1; /* success */
 failure2:
@@ -546,3 +766,11 @@ failure1:
 	fclose(f);
 	return 0; /* failure */
 }
+
+int save_png(const char *filename, struct image *img) {
+	return write_png(filename, img, NULL);
+}
+
+int save_png_indexed(const char *filename, struct image *img, const struct palette *pal) {
+	return write_png(filename, img, pal);
+}
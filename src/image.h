@@ -3,6 +3,9 @@
  */
 #ifndef IMAGE_H
 #define IMAGE_H
+#include <stddef.h>
+struct palette;
+
 struct image {
 	unsigned xres, yres, bpp, rowbytes;
 	unsigned char *image_data;
@@ -11,8 +14,14 @@ struct image {
 int image_create(struct image *img, unsigned width, unsigned height, unsigned bpp, unsigned rowbytes);
 int image_create_from_data(struct image *img, unsigned width, unsigned height, unsigned bpp, unsigned rowbytes, unsigned char *data);
 void image_destroy(struct image *img);
+unsigned image_get_pixel(const struct image *img, unsigned x, unsigned y);
 int load_png(const char *filename, struct image *img);
+int load_png_indexed(const char *filename, struct image *img, struct palette *pal);
+int load_chr_data(const char *filename, const unsigned char *data, size_t len, struct image *img, unsigned tile_width, unsigned tile_height, unsigned bpp, unsigned tiles_per_row);
 int load_chr(const char *filename, struct image *img, unsigned width, unsigned tile_height, unsigned bpp, unsigned tiles_per_row);
 int save_png(const char *filename, struct image *img);
+int save_png_indexed(const char *filename, struct image *img, const struct palette *pal);
 int save_chr(const char *filename, struct image *img, unsigned tile_w, unsigned tile_h);
+unsigned char *image_to_chr(const char *filename, struct image *img, unsigned tile_w, unsigned tile_h, size_t *len);
+long update_chr(const char *filename, int fd, const struct image *prev, struct image *img, unsigned tile_w, unsigned tile_h);
 #endif
@@ -0,0 +1,259 @@
+/* ines.c
+ * reads and writes iNES 1.0 and NES 2.0 headers.
+ *
+ * NES 2.0 is identified by %10 in bits 2-3 of byte 7 and adds:
+ *  byte 8  - mapper bits 8-11 (low nibble), submapper (high nibble)
+ *  byte 9  - PRG-ROM size MSB (low nibble), CHR-ROM size MSB (high nibble)
+ *            an MSB of $F means byte 4/5 is %EEEEEEMM: 2^E * (MM*2+1) bytes
+ *  byte 10 - PRG-RAM shift (low nibble), PRG-NVRAM shift (high nibble)
+ *  byte 11 - CHR-RAM shift (low nibble), CHR-NVRAM shift (high nibble)
+ *            a shift count of n means 64<<n bytes, 0 means none
+ *  byte 12 - CPU/PPU timing (bits 0-1)
+ */
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ines.h"
+
+#define INES_MAGIC "NES\x1a"
+
+/* largest unit count before the MSB nibble becomes $F */
+#define INES_MAX_UNITS 0xeff
+
+static int decode_rom_size(uint64_t *size, unsigned lsb, unsigned msb, unsigned unit) {
+	unsigned e, mm;
+
+	if(msb!=0xf) {
+		*size=(uint64_t)((msb<<8)|lsb)*unit;
+		return 1;
+	}
+	/* exponent-multiplier notation */
+	e=lsb>>2;
+	mm=lsb&3;
+	if(e>60) {
+		fprintf(stderr, "ROM size 2^%u*%u is too large.\n", e, mm*2+1);
+		return 0;
+	}
+	*size=(uint64_t)(mm*2+1)<<e;
+	return 1;
+}
+
+static uint64_t decode_ram_shift(unsigned shift) {
+	return shift ? (uint64_t)64<<shift : 0;
+}
+
+int ines_decode(struct ines_hdr *hdr, const unsigned char buf[INES_HDR_SIZE]) {
+	if(memcmp(buf, INES_MAGIC, strlen(INES_MAGIC))) {
+		fprintf(stderr, "Not an iNES file.\n");
+		return 0;
+	}
+
+	memset(hdr, 0, sizeof *hdr);
+	hdr->mirroring=buf[6]&1;
+	hdr->battery_fl=(buf[6]>>1)&1;
+	hdr->trainer_fl=(buf[6]>>2)&1; /* 512-byte trainer is before the PRG ROM */
+	hdr->four_screen_fl=(buf[6]>>3)&1;
+	hdr->mapper=((buf[6]>>4)&15)|(buf[7]&0xf0);
+	hdr->console_type=buf[7]&3;
+
+	if((buf[7]&0x0c)==0x08) {
+		hdr->nes2_fl=1;
+		hdr->mapper|=(buf[8]&15)<<8;
+		hdr->submapper=buf[8]>>4;
+		if(!decode_rom_size(&hdr->prg_rom_size, buf[4], buf[9]&15, 16384))
+			return 0;
+		if(!decode_rom_size(&hdr->chr_rom_size, buf[5], buf[9]>>4, 8192))
+			return 0;
+		hdr->prg_ram_size=decode_ram_shift(buf[10]&15);
+		hdr->prg_nvram_size=decode_ram_shift(buf[10]>>4);
+		hdr->chr_ram_size=decode_ram_shift(buf[11]&15);
+		hdr->chr_nvram_size=decode_ram_shift(buf[11]>>4);
+		hdr->timing=buf[12]&3;
+	} else {
+		hdr->prg_rom_size=buf[4]*(uint64_t)16384;
+		hdr->chr_rom_size=buf[5]*(uint64_t)8192;
+		hdr->prg_ram_size=buf[8]*(uint64_t)8192;
+		/* old dumps have junk like "DiskDude!" in bytes 7-15, which makes
+		 * the upper mapper nibble meaningless. */
+		if((buf[7]&0x0c)==0x04 || buf[12] || buf[13] || buf[14] || buf[15])
+			hdr->mapper&=15;
+	}
+
+	return 1;
+}
+
+/* round size up to something the header can hold. */
+static int encode_rom_size(uint64_t *size, unsigned unit, unsigned nes2_fl, unsigned char *lsb, unsigned *msb) {
+	uint64_t units, best=0;
+	unsigned e, mm, best_lsb=0;
+
+	units=(*size+unit-1)/unit;
+	if(units<=(nes2_fl ? INES_MAX_UNITS : 255)) {
+		*lsb=units&255;
+		*msb=units>>8;
+		*size=units*unit;
+		return 1;
+	}
+	if(!nes2_fl)
+		return 0;
+
+	/* exponent-multiplier notation: smallest 2^E*(MM*2+1) that fits */
+	for(e=0;e<=60;e++) {
+		for(mm=0;mm<4;mm++) {
+			uint64_t v=(uint64_t)(mm*2+1)<<e;
+			if(v>=*size && (!best || v<best)) {
+				best=v;
+				best_lsb=(e<<2)|mm;
+			}
+		}
+	}
+	if(!best)
+		return 0;
+	*lsb=best_lsb;
+	*msb=0xf;
+	*size=best;
+	return 1;
+}
+
+static int encode_ram_shift(uint64_t *size, unsigned *shift) {
+	unsigned n;
+
+	if(!*size) {
+		*shift=0;
+		return 1;
+	}
+	for(n=1;n<16;n++) {
+		if(((uint64_t)64<<n)>=*size) {
+			*shift=n;
+			*size=(uint64_t)64<<n;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* true if fields in hdr can only be expressed in a NES 2.0 header */
+static int needs_nes2(const struct ines_hdr *hdr) {
+	return hdr->mapper>255 || hdr->submapper || hdr->timing
+		|| hdr->prg_rom_size>255*(uint64_t)16384
+		|| hdr->chr_rom_size>255*(uint64_t)8192
+		|| hdr->prg_ram_size>255*(uint64_t)8192
+		|| hdr->prg_nvram_size || hdr->chr_ram_size || hdr->chr_nvram_size;
+}
+
+/**
+ * fill buf with a header for hdr. a NES 2.0 header is written when
+ * hdr->nes2_fl is set or iNES 1.0 cannot describe the image, and nes2_fl
+ * is updated to match. ROM and RAM sizes are rounded up to what the header
+ * can express, so the caller knows how far to pad.
+ * @returns non-zero on success
+ */
+int ines_encode(unsigned char buf[INES_HDR_SIZE], struct ines_hdr *hdr) {
+	unsigned prg_msb, chr_msb, s0, s1;
+
+	if(needs_nes2(hdr))
+		hdr->nes2_fl=1;
+	if(hdr->mapper>4095 || hdr->submapper>15) {
+		fprintf(stderr, "Mapper %u.%u is out of range.\n", hdr->mapper, hdr->submapper);
+		return 0;
+	}
+
+	memset(buf, 0, INES_HDR_SIZE);
+	memcpy(buf, INES_MAGIC, strlen(INES_MAGIC));
+	if(!encode_rom_size(&hdr->prg_rom_size, 16384, hdr->nes2_fl, &buf[4], &prg_msb)
+	|| !encode_rom_size(&hdr->chr_rom_size, 8192, hdr->nes2_fl, &buf[5], &chr_msb)) {
+		fprintf(stderr, "ROM is too large for an iNES header.\n");
+		return 0;
+	}
+	buf[6]=(hdr->mirroring&1)|(hdr->battery_fl?2:0)|(hdr->trainer_fl?4:0)|(hdr->four_screen_fl?8:0)|((hdr->mapper&15)<<4);
+	buf[7]=(hdr->console_type&3)|(hdr->mapper&0xf0);
+
+	if(!hdr->nes2_fl) {
+		hdr->prg_ram_size=(hdr->prg_ram_size+8192-1)/8192*8192; /* round up to 8K */
+		buf[8]=hdr->prg_ram_size/8192;
+		return 1;
+	}
+
+	buf[7]|=0x08;
+	buf[8]=((hdr->mapper>>8)&15)|(hdr->submapper<<4);
+	buf[9]=prg_msb|(chr_msb<<4);
+	if(!encode_ram_shift(&hdr->prg_ram_size, &s0) || !encode_ram_shift(&hdr->prg_nvram_size, &s1)) {
+		fprintf(stderr, "PRG-RAM is too large for a NES 2.0 header.\n");
+		return 0;
+	}
+	buf[10]=s0|(s1<<4);
+	if(!encode_ram_shift(&hdr->chr_ram_size, &s0) || !encode_ram_shift(&hdr->chr_nvram_size, &s1)) {
+		fprintf(stderr, "CHR-RAM is too large for a NES 2.0 header.\n");
+		return 0;
+	}
+	buf[11]=s0|(s1<<4);
+	buf[12]=hdr->timing&3;
+
+	return 1;
+}
+
+/**
+ * @returns number of bytes the header says follow it.
+ */
+uint64_t ines_data_size(const struct ines_hdr *hdr) {
+	return (hdr->trainer_fl ? INES_TRAINER_SIZE : 0)+hdr->prg_rom_size+hdr->chr_rom_size;
+}
+
+/**
+ * find the CHR of a file mapped into memory. an iNES file gives its
+ * CHR-ROM, anything else is taken as a raw CHR dump.
+ * @returns non-zero on success, with the CHR at data+*ofs
+ */
+int ines_find_chr(const char *filename, const unsigned char *data, size_t len, size_t *ofs, size_t *chr_len) {
+	struct ines_hdr hdr;
+
+	if(len<INES_HDR_SIZE || memcmp(data, INES_MAGIC, strlen(INES_MAGIC))) {
+		*ofs=0;
+		*chr_len=len;
+		return 1;
+	}
+	if(!ines_decode(&hdr, data))
+		return 0;
+	if(len-INES_HDR_SIZE<ines_data_size(&hdr)) {
+		fprintf(stderr, "%s:Truncated file.\n", filename);
+		return 0;
+	}
+	if(!hdr.chr_rom_size) {
+		fprintf(stderr, "%s:no CHR-ROM, the game uses CHR-RAM.\n", filename);
+		return 0;
+	}
+	*ofs=INES_HDR_SIZE+(hdr.trainer_fl?INES_TRAINER_SIZE:0)+hdr.prg_rom_size;
+	*chr_len=hdr.chr_rom_size;
+	return 1;
+}
+
+static void print_size(FILE *out, const char *name, uint64_t size) {
+	if(size%1024)
+		fprintf(out, "  %s %" PRIu64 " bytes\n", name, size);
+	else
+		fprintf(out, "  %s %" PRIu64 "K\n", name, size/1024);
+}
+
+void ines_print(FILE *out, const struct ines_hdr *hdr) {
+	fprintf(out, "  Format=%s\n", hdr->nes2_fl ? "NES 2.0" : "iNES");
+	print_size(out, "PRG-ROM", hdr->prg_rom_size);
+	print_size(out, "CHR-ROM", hdr->chr_rom_size);
+	if(hdr->nes2_fl)
+		fprintf(out, "  Mapper=%u.%u\n", hdr->mapper, hdr->submapper);
+	else
+		fprintf(out, "  Mapper=%u\n", hdr->mapper);
+	fprintf(out, "  Trainer=%u\n", hdr->trainer_fl);
+	fprintf(out, "  Mirroring=%u\n", hdr->mirroring);
+	fprintf(out, "  Battery=%u\n", hdr->battery_fl);
+	fprintf(out, "  4-screen VRAM=%u\n", hdr->four_screen_fl);
+	if(hdr->prg_ram_size)
+		print_size(out, "PRG-RAM", hdr->prg_ram_size);
+	if(hdr->prg_nvram_size)
+		print_size(out, "PRG-NVRAM", hdr->prg_nvram_size);
+	if(hdr->chr_ram_size)
+		print_size(out, "CHR-RAM", hdr->chr_ram_size);
+	if(hdr->chr_nvram_size)
+		print_size(out, "CHR-NVRAM", hdr->chr_nvram_size);
+}
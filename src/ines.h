@@ -0,0 +1,27 @@
+#ifndef INES_H
+#define INES_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define INES_HDR_SIZE 16
+#define INES_TRAINER_SIZE 512
+
+/* fields of an iNES 1.0 or NES 2.0 header, sizes in bytes. */
+struct ines_hdr {
+	uint64_t prg_rom_size, chr_rom_size;
+	uint64_t prg_ram_size, prg_nvram_size;
+	uint64_t chr_ram_size, chr_nvram_size;
+	unsigned trainer_fl, battery_fl, four_screen_fl;
+	unsigned mirroring;
+	unsigned mapper, submapper;
+	unsigned console_type, timing;
+	unsigned nes2_fl;
+};
+
+int ines_decode(struct ines_hdr *hdr, const unsigned char buf[INES_HDR_SIZE]);
+int ines_encode(unsigned char buf[INES_HDR_SIZE], struct ines_hdr *hdr);
+uint64_t ines_data_size(const struct ines_hdr *hdr);
+int ines_find_chr(const char *filename, const unsigned char *data, size_t len, size_t *ofs, size_t *chr_len);
+void ines_print(FILE *out, const struct ines_hdr *hdr);
+#endif
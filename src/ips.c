@@ -14,14 +14,27 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE /* copy_file_range() */
 #include <assert.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h> /* FICLONE */
+#endif
+
+#include "crc32.h"
+#include "ips.h"
+#include "pool.h"
+#include "util.h"
 
 // TODO: rewrite these macros
 #define BYTE3_TO_UINT(bp) \
@@ -33,59 +46,127 @@
 	(((unsigned int)(bp)[0] << 8) & 0xff00) | \
 	((unsigned int) (bp)[1] & 0x00ff)
 
-#define error(...) do { \
-		if (verbose_level > 0) \
-			fprintf(stderr, __VA_ARGS__); \
-	} while(0)
-
-#define verbose(...) do { \
-		if (verbose_level > 1) \
-			fprintf(stderr, __VA_ARGS__); \
-	} while(0)
-
-#ifndef NDEBUG
-# define debug(...) do { \
-		if (verbose_level > 2) \
-			fprintf(stderr, __VA_ARGS__); \
-	} while(0)
-#else
-/* disable debug messages */
-# define debug(...)
-#endif
-
-enum patch_type {
-	PATCH_RLE,
-	PATCH_BIN,
+enum patch_format {
+	FORMAT_UNKNOWN,
+	FORMAT_IPS,
+	FORMAT_BPS,
+	FORMAT_UPS,
 };
 
-struct patch {
-	enum patch_type type;
-	unsigned offset;
-	unsigned len;
-	unsigned char *data;
-	struct patch *next;
+enum apply_mode {
+	MODE_STREAM,	/* rewrite the whole output from the input */
+	MODE_INPLACE,	/* write only the patched ranges into an existing file */
+	MODE_CLONE,	/* clone the input to the output, then patch in place */
 };
 
-static int verbose_level = 1;
+int verbose_level = 1;
 
-static void new_patch(struct patch **head, enum patch_type type,
-	unsigned offset, unsigned len, unsigned char *data)
+static struct patch *alloc_record(enum patch_type type, unsigned offset,
+	unsigned len, unsigned char *data)
 {
 	struct patch *new;
 
-	while (*head && (*head)->offset < offset)
-		head = &(*head)->next;
-
 	new = calloc(1, sizeof(*new));
+	if (!new) {
+		perror("calloc()");
+		exit(1);
+	}
 	new->type = type;
 	new->offset = offset;
 	new->len = len;
 	new->data = data;
+	return new;
+}
+
+/* split curr at offset, returning the tail as a new record */
+static struct patch *split_record(struct patch *curr, unsigned offset)
+{
+	unsigned cut = offset - curr->offset;
+	unsigned len = curr->len - cut;
+	unsigned char *data;
+
+	if (curr->type == PATCH_BIN) {
+		data = malloc(len);
+		if (data)
+			memcpy(data, curr->data + cut, len);
+	} else {
+		data = malloc(1);
+		if (data)
+			*data = *curr->data;
+	}
+	if (!data) {
+		perror("malloc()");
+		exit(1);
+	}
+	curr->len = cut;
+	return alloc_record(curr->type, offset, len, data);
+}
+
+/*
+ * add a record to the patch map. the map is kept sorted by offset with no
+ * overlaps; a new record overrides whatever earlier records wrote to the
+ * same bytes, so records within a patch and whole patches loaded later
+ * take precedence.
+ *
+ * cursor remembers where the previous record went. records are usually in
+ * ascending order, so searching from there keeps loading linear.
+ */
+static void new_patch(struct patch **head, struct patch ***cursor,
+	enum patch_type type, unsigned offset, unsigned len,
+	unsigned char *data)
+{
+	unsigned end = offset + len;
+	struct patch *curr, *new;
+
+	if (!len) {
+		free(data);
+		return;
+	}
+
+	if (*cursor && **cursor && (**cursor)->offset <= offset)
+		head = *cursor;
+
+	while (*head && (*head)->offset + (*head)->len <= offset)
+		head = &(*head)->next;
+
+	/* a record that starts before this one keeps its head */
+	curr = *head;
+	if (curr && curr->offset < offset) {
+		if (curr->offset + curr->len > end) {
+			struct patch *tail;
+
+			tail = split_record(curr, end);
+			tail->next = curr->next;
+			curr->next = tail;
+		}
+		curr->len = offset - curr->offset;
+		head = &curr->next;
+	}
+
+	/* drop records it covers, trim the one that runs past its end */
+	while ((curr = *head) && curr->offset < end) {
+		unsigned cut = end - curr->offset;
+
+		if (cut >= curr->len) {
+			*head = curr->next;
+			free(curr->data);
+			free(curr);
+			continue;
+		}
+		if (curr->type == PATCH_BIN)
+			memmove(curr->data, curr->data + cut, curr->len - cut);
+		curr->offset = end;
+		curr->len -= cut;
+		break;
+	}
+
+	new = alloc_record(type, offset, len, data);
 	new->next = *head;
 	*head = new;
+	*cursor = head;
 }
 
-static void free_patch(struct patch *head)
+void free_patch(struct patch *head)
 {
 	while (head) {
 		struct patch *curr = head;
@@ -97,7 +178,7 @@ static void free_patch(struct patch *head)
 }
 
 static int read_record(const char *patchfile, int fd, int *errout,
-	struct patch **patchhead)
+	struct patch **patchhead, struct patch ***cursor)
 {
 	int cnt;
 	unsigned char offset[3];
@@ -132,7 +213,7 @@ static int read_record(const char *patchfile, int fd, int *errout,
 			goto trunc_detected;
 		}
 
-		new_patch(patchhead, PATCH_BIN, offset_val, size_val, data);
+		new_patch(patchhead, cursor, PATCH_BIN, offset_val, size_val, data);
 	} else { /* RLE patch */
 		unsigned char rlesize[2];
 		unsigned rlesize_val;
@@ -144,13 +225,13 @@ static int read_record(const char *patchfile, int fd, int *errout,
 		rlesize_val = BYTE2_TO_UINT(rlesize);
 
 		value = malloc(1);
-		cnt = read(fd, &value, 1);
+		cnt = read(fd, value, 1);
 		if (cnt != 1) {
 			free(value);
 			goto trunc_detected;
 		}
 
-		new_patch(patchhead, PATCH_RLE, offset_val, rlesize_val, value);
+		new_patch(patchhead, cursor, PATCH_RLE, offset_val, rlesize_val, value);
 	}
 
 	*errout = 0;
@@ -161,8 +242,9 @@ trunc_detected:
 	return 0;
 }
 
-static int load_patch(const char *patchfile, struct patch **patchhead)
+int load_patch(const char *patchfile, struct patch **patchhead)
 {
+	struct patch **cursor = NULL;
 	int fd;
 	unsigned char header[5];
 	int cnt;
@@ -184,7 +266,7 @@ static int load_patch(const char *patchfile, struct patch **patchhead)
 	}
 
 	e = 0;
-	while (read_record(patchfile, fd, &e, patchhead)) ;
+	while (read_record(patchfile, fd, &e, patchhead, &cursor)) ;
 
 	if (e) {
 		error("%s: Error reading patch file\n", patchfile);
@@ -213,6 +295,8 @@ static int discard(const char *infile, int infd, size_t bytes)
 			perror(infile);
 			return -1;
 		}
+		if (!len)
+			break; /* patched past the end of the input */
 		bytes -= len;
 	}
 
@@ -240,6 +324,23 @@ static int copy_data(const void *data, const char *outfile, int outfd,
 	return 0;
 }
 
+static int fill_data(unsigned char fill, const char *outfile, int outfd,
+	size_t bytes)
+{
+	char buf[512];
+	int len;
+
+	debug("%s:bytes=%zd\n", __func__, bytes);
+	memset(buf, fill, sizeof(buf));
+	while (bytes) {
+		len = bytes > sizeof(buf) ? sizeof(buf) : bytes;
+		if (copy_data(buf, outfile, outfd, len))
+			return -1;
+		bytes -= len;
+	}
+	return 0;
+}
+
 static int copy_file(const char *infile, int infd, const char *outfile,
 	int outfd, size_t bytes)
 {
@@ -254,6 +355,8 @@ static int copy_file(const char *infile, int infd, const char *outfile,
 			perror(infile);
 			return -1;
 		}
+		if (!len) /* the patch writes past the end, zero the gap */
+			return fill_data(0, outfile, outfd, bytes);
 		if (copy_data(buf, outfile, outfd, len))
 			return -1;
 		bytes -= len;
@@ -282,23 +385,6 @@ static int copy_file_remaining(const char *infile, int infd,
 	return 0;
 }
 
-static int fill_data(unsigned char fill, const char *outfile, int outfd,
-	size_t bytes)
-{
-	char buf[512];
-	int len;
-
-	debug("%s:bytes=%zd\n", __func__, bytes);
-	memset(buf, fill, sizeof(buf));
-	while (bytes) {
-		len = bytes > sizeof(buf) ? sizeof(buf) : bytes;
-		if (copy_data(buf, outfile, outfd, len))
-			return -1;
-		bytes -= len;
-	}
-	return 0;
-}
-
 static int apply_patch(struct patch *patchhead, const char *infile, int infd,
 	const char *outfile, int outfd)
 {
@@ -345,23 +431,227 @@ static int apply_patch(struct patch *patchhead, const char *infile, int infd,
 	return 0;
 }
 
-static int patch(const char *patchfile, const char *infile,
-	const char *outfile)
+static int pwrite_data(const void *data, const char *outfile, int outfd,
+	size_t bytes, off_t offset)
+{
+	ssize_t res;
+
+	debug("%s:bytes=%zd offset=%lld\n", __func__, bytes, (long long)offset);
+	while (bytes > 0) {
+		res = pwrite(outfd, data, bytes, offset);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(outfile);
+			return -1;
+		}
+		data = (const unsigned char *)data + res;
+		bytes -= res;
+		offset += res;
+	}
+	return 0;
+}
+
+static int pfill_data(unsigned char fill, const char *outfile, int outfd,
+	size_t bytes, off_t offset)
+{
+	char buf[512];
+	int len;
+
+	memset(buf, fill, sizeof(buf));
+	while (bytes) {
+		len = bytes > sizeof(buf) ? sizeof(buf) : bytes;
+		if (pwrite_data(buf, outfile, outfd, len, offset))
+			return -1;
+		bytes -= len;
+		offset += len;
+	}
+	return 0;
+}
+
+/* write only the patched ranges, leaving the rest of outfd untouched */
+static int apply_patch_inplace(struct patch *patchhead, const char *outfile,
+	int outfd)
+{
+	struct patch *curr;
+	int e = 0;
+
+	for (curr = patchhead; curr; curr = curr->next) {
+		verbose("PATCH %d-%d\n", curr->offset,
+			curr->offset + curr->len - 1);
+		switch(curr->type) {
+		case PATCH_BIN:
+			e = pwrite_data(curr->data, outfile, outfd, curr->len,
+				curr->offset);
+			break;
+		case PATCH_RLE:
+			e = pfill_data(*curr->data, outfile, outfd, curr->len,
+				curr->offset);
+			break;
+		}
+		if (e)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* make outfile a copy of infile, sharing extents when the filesystem can */
+static int clone_file(const char *infile, int infd, const char *outfile,
+	int outfd)
+{
+#ifdef FICLONE
+	if (!ioctl(outfd, FICLONE, infd)) {
+		verbose("CLONE %s\n", outfile);
+		return 0;
+	}
+	debug("%s:FICLONE:%s\n", __func__, strerror(errno));
+#endif
+	{
+		struct stat st;
+
+		if (fstat(infd, &st)) {
+			perror(infile);
+			return -1;
+		}
+		verbose("COPY %s\n", outfile);
+		return copy_fd_range(infile, infd, 0, outfd, st.st_size) ? 0 : -1;
+	}
+}
+
+/* identify a patch file by its signature */
+static enum patch_format patch_format(const char *patchfile)
+{
+	unsigned char header[5];
+	int fd;
+	int cnt;
+
+	fd = open(patchfile, O_RDONLY);
+	if (fd < 0) {
+		perror(patchfile);
+		return FORMAT_UNKNOWN;
+	}
+	cnt = read(fd, header, sizeof(header));
+	close(fd);
+
+	if (cnt >= 5 && !memcmp(header, "PATCH", 5))
+		return FORMAT_IPS;
+	if (cnt >= 4 && !memcmp(header, "BPS1", 4))
+		return FORMAT_BPS;
+	if (cnt >= 4 && !memcmp(header, "UPS1", 4))
+		return FORMAT_UPS;
+
+	error("%s: Unknown patch format\n", patchfile);
+	return FORMAT_UNKNOWN;
+}
+
+/* BPS and UPS build the whole output in memory, so in-place and clone
+ * modes only decide where it is written. */
+static int apply_delta(const char *patchfile, enum patch_format format,
+	const unsigned char *patchdata, size_t patchlen, const char *infile,
+	const char *outfile, enum apply_mode mode)
 {
+	unsigned char *indata, *outdata = NULL;
+	size_t inlen, outlen = 0;
 	int e;
-	int infd, outfd;
+	int outfd;
+
+	indata = map_file(infile, &inlen);
+	if (!indata)
+		return -1;
+
+	if (format == FORMAT_BPS)
+		e = bps_apply(patchfile, patchdata, patchlen, indata, inlen,
+			&outdata, &outlen);
+	else
+		e = ups_apply(patchfile, patchdata, patchlen, indata, inlen,
+			&outdata, &outlen);
+	unmap_file(indata, inlen);
+	if (e)
+		return -1;
+
+	if (mode == MODE_INPLACE)
+		outfd = open(outfile, O_WRONLY | O_TRUNC);
+	else
+		outfd = open(outfile, O_CREAT | O_EXCL | O_WRONLY, 0666);
+	if (outfd < 0) {
+		perror(outfile);
+		free(outdata);
+		return -1;
+	}
+
+	verbose("WRITE 0-%zd\n", outlen - 1);
+	e = copy_data(outdata, outfile, outfd, outlen);
+	if (close(outfd)) {
+		perror(outfile);
+		e = -1;
+	}
+	free(outdata);
+	return e;
+}
+
+static int patch_delta(const char *patchfile, enum patch_format format,
+	const char *infile, const char *outfile, enum apply_mode mode)
+{
+	unsigned char *patchdata;
+	size_t patchlen;
+	int e;
+
+	patchdata = map_file(patchfile, &patchlen);
+	if (!patchdata)
+		return -1;
+	e = apply_delta(patchfile, format, patchdata, patchlen, infile,
+		outfile, mode);
+	unmap_file(patchdata, patchlen);
+	return e;
+}
+
+/* apply one or more patches in order. IPS patches are merged into a
+ * single map first so the input is only read and written once. */
+static int patch(char **patchfiles, int npatches, const char *infile,
+	const char *outfile, enum apply_mode mode)
+{
+	int e;
+	int i;
+	int infd = -1, outfd;
 	struct patch *patchhead = NULL;
+	enum patch_format format;
 
-	e = load_patch(patchfile, &patchhead);
-	if (e) {
-		error("%s: Error loading patch\n", patchfile);
+	for (i = 0; i < npatches; i++) {
+		format = patch_format(patchfiles[i]);
+		if (format == FORMAT_UNKNOWN)
+			return -1;
+		if (format == FORMAT_IPS)
+			continue;
+		if (npatches == 1)
+			return patch_delta(patchfiles[i], format, infile,
+				outfile, mode);
+		error("%s: Only IPS patches can be stacked\n", patchfiles[i]);
 		return -1;
 	}
 
+	for (i = 0; i < npatches; i++) {
+		e = load_patch(patchfiles[i], &patchhead);
+		if (e) {
+			error("%s: Error loading patch\n", patchfiles[i]);
+			goto out_free;
+		}
+	}
+
+	if (mode == MODE_INPLACE) {
+		outfd = open(outfile, O_WRONLY);
+		if (outfd < 0) {
+			perror(outfile);
+			goto out_free;
+		}
+		e = apply_patch_inplace(patchhead, outfile, outfd);
+		goto out_close_out;
+	}
+
 	infd = open(infile, O_RDONLY);
 	if (infd < 0) {
 		perror(infile);
-		return -1;
+		goto out_free;
 	}
 
 	outfd = open(outfile, O_CREAT | O_EXCL | O_WRONLY, 0666);
@@ -370,33 +660,232 @@ static int patch(const char *patchfile, const char *infile,
 		goto out_close_in;
 	}
 
-	e = apply_patch(patchhead, infile, infd, outfile, outfd);
+	if (mode == MODE_CLONE) {
+		e = clone_file(infile, infd, outfile, outfd);
+		if (!e)
+			e = apply_patch_inplace(patchhead, outfile, outfd);
+	} else {
+		e = apply_patch(patchhead, infile, infd, outfile, outfd);
+	}
 
-	close(outfd);
-	close(infd);
+out_close_out:
+	if (close(outfd)) {
+		perror(outfile);
+		e = -1;
+	}
+	if (infd >= 0)
+		close(infd);
 	free_patch(patchhead);
 	return e;
 out_close_in:
 	close(infd);
+out_free:
 	free_patch(patchhead);
 	return -1;
 }
 
+/*
+ * batch mode: one patch applied to many files
+ */
+
+enum batch_status {
+	BATCH_OK,
+	BATCH_EXTENDED,		/* ok, IPS records ran past the end */
+	BATCH_MISMATCH,		/* input size is not what the patch expects */
+	BATCH_FAILED,		/* details went to stderr */
+};
+
+struct batch_result {
+	enum batch_status status;
+	long long size;
+	unsigned long long expected;
+};
+
+struct batch {
+	const char *patchfile;
+	enum patch_format format;
+	struct patch *patchhead;	/* IPS */
+	unsigned char *patchdata;	/* BPS and UPS */
+	size_t patchlen;
+	uint64_t size_a, size_b;	/* BPS and UPS source and target */
+	char **files;
+	struct batch_result *results;
+};
+
+static void batch_job(void *arg, unsigned index)
+{
+	struct batch *b = arg;
+	const char *infile = b->files[index];
+	struct batch_result *result = &b->results[index];
+	char outfile[4096];
+	struct stat st;
+	int infd, outfd;
+	int e;
+
+	result->status = BATCH_FAILED;
+	if (!make_suffixed_name(outfile, sizeof(outfile), infile, "-patched")) {
+		error("%s: Name too long\n", infile);
+		return;
+	}
+	if (stat(infile, &st)) {
+		perror(infile);
+		return;
+	}
+	result->size = st.st_size;
+
+	if (b->format != FORMAT_IPS) {
+		if ((uint64_t)st.st_size != b->size_a &&
+			(b->format != FORMAT_UPS ||
+			(uint64_t)st.st_size != b->size_b)) {
+			result->status = BATCH_MISMATCH;
+			result->expected = b->size_a;
+			return;
+		}
+		e = apply_delta(b->patchfile, b->format, b->patchdata,
+			b->patchlen, infile, outfile, MODE_CLONE);
+		if (!e)
+			result->status = BATCH_OK;
+		return;
+	}
+
+	infd = open(infile, O_RDONLY);
+	if (infd < 0) {
+		perror(infile);
+		return;
+	}
+	outfd = open(outfile, O_CREAT | O_EXCL | O_WRONLY, 0666);
+	if (outfd < 0) {
+		perror(outfile);
+		close(infd);
+		return;
+	}
+	e = clone_file(infile, infd, outfile, outfd);
+	if (!e)
+		e = apply_patch_inplace(b->patchhead, outfile, outfd);
+	if (close(outfd)) {
+		perror(outfile);
+		e = -1;
+	}
+	close(infd);
+
+	if (!e) {
+		const struct patch *last = b->patchhead;
+
+		while (last && last->next)
+			last = last->next;
+		result->expected = last ? last->offset + last->len : 0;
+		if (result->expected > (unsigned long long)st.st_size)
+			result->status = BATCH_EXTENDED;
+		else
+			result->status = BATCH_OK;
+	}
+}
+
+/* parse the patch once, then patch every file on a worker pool */
+static int batch(const char *patchfile, char **files, int nfiles,
+	unsigned threads)
+{
+	struct batch b;
+	int failed = 0;
+	int i;
+
+	memset(&b, 0, sizeof(b));
+	b.patchfile = patchfile;
+	b.files = files;
+	b.format = patch_format(patchfile);
+	if (b.format == FORMAT_UNKNOWN)
+		return -1;
+
+	if (b.format == FORMAT_IPS) {
+		if (load_patch(patchfile, &b.patchhead)) {
+			error("%s: Error loading patch\n", patchfile);
+			free_patch(b.patchhead);
+			return -1;
+		}
+	} else {
+		b.patchdata = map_file(patchfile, &b.patchlen);
+		if (!b.patchdata)
+			return -1;
+		if (delta_sizes(patchfile, b.patchdata, b.patchlen,
+			&b.size_a, &b.size_b)) {
+			unmap_file(b.patchdata, b.patchlen);
+			return -1;
+		}
+	}
+
+	b.results = calloc(nfiles, sizeof(*b.results));
+	if (!b.results) {
+		perror("calloc()");
+		failed = 1;
+	} else {
+		crc32_init(); /* build the tables before the threads share them */
+		pool_run(threads, nfiles, batch_job, &b);
+		for (i = 0; i < nfiles; i++) {
+			const struct batch_result *r = &b.results[i];
+
+			switch (r->status) {
+			case BATCH_OK:
+				printf("%s: ok\n", files[i]);
+				break;
+			case BATCH_EXTENDED:
+				printf("%s: ok, size mismatch (%lld bytes, "
+					"extended to %llu)\n", files[i],
+					r->size, r->expected);
+				break;
+			case BATCH_MISMATCH:
+				printf("%s: size mismatch (%lld bytes, "
+					"patch expects %llu)\n", files[i],
+					r->size, r->expected);
+				failed++;
+				break;
+			case BATCH_FAILED:
+				printf("%s: failed\n", files[i]);
+				failed++;
+				break;
+			}
+		}
+	}
+
+	free(b.results);
+	free_patch(b.patchhead);
+	unmap_file(b.patchdata, b.patchlen);
+	return failed ? -1 : 0;
+}
+
 int main(int argc, char **argv)
 {
-	const char *patchfile = NULL;
 	const char *infile = NULL;
 	const char *outfile = NULL;
+	enum apply_mode mode = MODE_STREAM;
+	int create = 0;
+	int batch_mode = 0;
+	int analyze = 0;
+	unsigned threads = pool_threads();
+	const char *ext;
+	char *endptr;
+	int npatches;
 	int e;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "hvq")) != -1) {
+	while ((opt = getopt(argc, argv, "hvqircbxj:")) != -1) {
 		switch (opt) {
 		default:
 		case 'h':
 usage:
-			fprintf(stderr, "Usage: %s [-hvq] patchfile in out\n",
-				argv[0]);
+			fprintf(stderr, "Usage: %s [-hvqr] patchfile... in out\n"
+				"       %s [-hvq] -i patchfile... file\n"
+				"       %s [-hvq] [-j threads] -c orig modified patchfile\n"
+				"       %s [-hvq] [-j threads] -b patchfile file...\n"
+				"       %s [-hvq] -x patchfile...\n"
+				"  -i  patch file in place, writing only the patched ranges\n"
+				"  -r  clone in to out (reflink when possible), then patch in place\n"
+				"  -c  create a patch from orig to modified, BPS if patchfile\n"
+				"      ends in .bps, otherwise IPS\n"
+				"  -b  patch each file to file-patched, in parallel\n"
+				"  -x  report IPS patches that write to the same bytes\n"
+				"  -j  threads used for -b and to create BPS patches\n"
+				"Several IPS patches are applied in order in a single pass.\n",
+				argv[0], argv[0], argv[0], argv[0], argv[0]);
 			return 1;
 		case 'v':
 			verbose_level++;
@@ -404,17 +893,75 @@ usage:
 		case 'q':
 			verbose_level = 0;
 			break;
+		case 'i':
+			mode = MODE_INPLACE;
+			break;
+		case 'r':
+			mode = MODE_CLONE;
+			break;
+		case 'c':
+			create = 1;
+			break;
+		case 'b':
+			batch_mode = 1;
+			break;
+		case 'x':
+			analyze = 1;
+			break;
+		case 'j':
+			threads = strtoul(optarg, &endptr, 10);
+			if (*endptr || !threads)
+				goto usage;
+			break;
 		}
 	}
 
-	if ((optind + 2) >= argc)
-		goto usage;
+	if (create) {
+		if ((optind + 2) >= argc)
+			goto usage;
+		ext = file_extension(argv[optind + 2]);
+		if (ext && !strcasecmp(ext, ".bps"))
+			e = bps_create(argv[optind], argv[optind + 1],
+				argv[optind + 2], threads);
+		else
+			e = ips_create(argv[optind], argv[optind + 1],
+				argv[optind + 2]);
+		if (e) {
+			error("%s: Failed to create patch\n", argv[optind + 2]);
+			return 1;
+		}
+		return 0;
+	}
+
+	if (analyze) {
+		if (optind >= argc)
+			goto usage;
+		e = conflicts(argv + optind, argc - optind);
+		return e ? 1 : 0;
+	}
 
-	patchfile = argv[optind];
-	infile = argv[optind + 1];
-	outfile = argv[optind + 2];
+	if (batch_mode) {
+		if ((optind + 1) >= argc)
+			goto usage;
+		e = batch(argv[optind], argv + optind + 1, argc - optind - 1,
+			threads);
+		return e ? 1 : 0;
+	}
+
+	if (mode == MODE_INPLACE) {
+		if ((optind + 1) >= argc)
+			goto usage;
+		infile = outfile = argv[argc - 1];
+		npatches = argc - 1 - optind;
+	} else {
+		if ((optind + 2) >= argc)
+			goto usage;
+		infile = argv[argc - 2];
+		outfile = argv[argc - 1];
+		npatches = argc - 2 - optind;
+	}
 
-	e = patch(patchfile, infile, outfile);
+	e = patch(argv + optind, npatches, infile, outfile, mode);
 	if (e) {
 		error("%s: Failed to patch\n", outfile);
 		return 1;
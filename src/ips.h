@@ -0,0 +1,78 @@
+/* ips.h
+ * definitions shared by the modules of the ips patch tool.
+ */
+#ifndef IPS_H
+#define IPS_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define error(...) do { \
+		if (verbose_level > 0) \
+			fprintf(stderr, __VA_ARGS__); \
+	} while(0)
+
+#define verbose(...) do { \
+		if (verbose_level > 1) \
+			fprintf(stderr, __VA_ARGS__); \
+	} while(0)
+
+#ifndef NDEBUG
+# define debug(...) do { \
+		if (verbose_level > 2) \
+			fprintf(stderr, __VA_ARGS__); \
+	} while(0)
+#else
+/* disable debug messages */
+# define debug(...)
+#endif
+
+extern int verbose_level;
+
+enum patch_type {
+	PATCH_RLE,
+	PATCH_BIN,
+};
+
+/* IPS records, sorted by offset and never overlapping */
+struct patch {
+	enum patch_type type;
+	unsigned offset;
+	unsigned len;
+	unsigned char *data;
+	struct patch *next;
+};
+
+/* a patch being built in memory */
+struct buf {
+	unsigned char *data;
+	size_t len, max;
+};
+
+/* ips.c */
+int load_patch(const char *patchfile, struct patch **patchhead);
+void free_patch(struct patch *head);
+
+/* bps.c - BPS and UPS patches, applied from memory to a malloc'd buffer */
+int delta_sizes(const char *patchfile, const unsigned char *patch,
+	size_t patchlen, uint64_t *size_a, uint64_t *size_b);
+int bps_apply(const char *patchfile, const unsigned char *patch,
+	size_t patchlen, const unsigned char *src, size_t srclen,
+	unsigned char **out, size_t *outlen);
+int ups_apply(const char *patchfile, const unsigned char *patch,
+	size_t patchlen, const unsigned char *src, size_t srclen,
+	unsigned char **out, size_t *outlen);
+
+/* ipsdiff.c */
+int buf_put(struct buf *b, const void *data, size_t len);
+int buf_write(const struct buf *b, const char *outfile);
+int ips_create(const char *origfile, const char *modfile,
+	const char *outfile);
+
+/* bpsdiff.c */
+int bps_create(const char *origfile, const char *modfile,
+	const char *outfile, unsigned threads);
+
+/* conflict.c */
+int conflicts(char **patchfiles, int npatches);
+#endif
@@ -0,0 +1,417 @@
+/* ipsdiff.c
+ * create an IPS patch from an original and a modified file.
+ *
+ * Equal stretches are skipped with a vectorized compare. Changed regions
+ * are split into literal pieces and runs of a single byte value, then a
+ * small dynamic program picks which runs become RLE records so the patch
+ * comes out as small as the record overheads allow.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "ips.h"
+#include "util.h"
+
+#define IPS_MAX_OFFSET	0xffffffu	/* 24-bit offsets */
+#define IPS_MAX_LEN	0xffffu		/* 16-bit lengths */
+#define IPS_EOF_OFFSET	0x454f46u	/* "EOF" - would end the patch */
+#define BIN_OVERHEAD	5		/* offset + size */
+#define RLE_SIZE	8		/* offset + 0 + rle size + value */
+#define MIN_RUN		4		/* shorter runs never beat a literal */
+
+/* a changed region is cut into literal pieces and single-value runs */
+struct piece {
+	size_t offset, len;
+	int run;	/* all bytes equal */
+	int rle;	/* chosen encoding for runs */
+};
+
+int buf_put(struct buf *b, const void *data, size_t len)
+{
+	if (b->len + len > b->max) {
+		size_t max = b->max ? b->max * 2 : 4096;
+		unsigned char *tmp;
+
+		while (max < b->len + len)
+			max *= 2;
+		tmp = realloc(b->data, max);
+		if (!tmp) {
+			perror("realloc()");
+			return -1;
+		}
+		b->data = tmp;
+		b->max = max;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	return 0;
+}
+
+/* write a finished patch to a new file */
+int buf_write(const struct buf *b, const char *outfile)
+{
+	size_t pos;
+	int outfd;
+	int e = 0;
+
+	outfd = open(outfile, O_CREAT | O_EXCL | O_WRONLY, 0666);
+	if (outfd < 0) {
+		perror(outfile);
+		return -1;
+	}
+	for (pos = 0; pos < b->len; ) {
+		ssize_t res = write(outfd, b->data + pos, b->len - pos);
+
+		if (res < 0) {
+			perror(outfile);
+			e = -1;
+			break;
+		}
+		pos += res;
+	}
+	if (close(outfd)) {
+		perror(outfile);
+		e = -1;
+	}
+	verbose("%s: %zd bytes\n", outfile, b->len);
+	return e;
+}
+
+static int put_header(struct buf *b, size_t offset, size_t len)
+{
+	unsigned char hdr[5];
+
+	if (offset > IPS_MAX_OFFSET) {
+		error("Change at offset %zd is beyond the 16MB IPS limit, "
+			"use a .bps patch\n", offset);
+		return -1;
+	}
+	hdr[0] = offset >> 16;
+	hdr[1] = offset >> 8;
+	hdr[2] = offset;
+	hdr[3] = len >> 8;
+	hdr[4] = len;
+	return buf_put(b, hdr, sizeof(hdr));
+}
+
+/* find the first differing byte at or after pos */
+static size_t next_diff(const unsigned char *a, const unsigned char *b,
+	size_t pos, size_t len)
+{
+#ifdef __SSE2__
+	while (pos + 64 <= len) {
+		__m128i e0, e1, e2, e3;
+		unsigned mask;
+
+		e0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + pos)),
+			_mm_loadu_si128((const __m128i *)(b + pos)));
+		e1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + pos + 16)),
+			_mm_loadu_si128((const __m128i *)(b + pos + 16)));
+		e2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + pos + 32)),
+			_mm_loadu_si128((const __m128i *)(b + pos + 32)));
+		e3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + pos + 48)),
+			_mm_loadu_si128((const __m128i *)(b + pos + 48)));
+		mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(e0, e1),
+			_mm_and_si128(e2, e3)));
+		if (mask != 0xffff)
+			break; /* locate it below */
+		pos += 64;
+	}
+	while (pos + 16 <= len) {
+		unsigned mask;
+
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *)(a + pos)),
+			_mm_loadu_si128((const __m128i *)(b + pos))));
+		if (mask != 0xffff)
+			return pos + __builtin_ctz(~mask);
+		pos += 16;
+	}
+#else
+	while (pos + 8 <= len) {
+		uint64_t x, y;
+
+		memcpy(&x, a + pos, 8);
+		memcpy(&y, b + pos, 8);
+		if (x != y)
+			break;
+		pos += 8;
+	}
+#endif
+	while (pos < len && a[pos] == b[pos])
+		pos++;
+	return pos;
+}
+
+/* emit literal bytes, never starting a record at the "EOF" offset */
+static int emit_bin(struct buf *out, const unsigned char *mod, size_t offset,
+	size_t len)
+{
+	if (offset == IPS_EOF_OFFSET) {
+		offset--; /* pull in the unchanged byte before it */
+		len++;
+	}
+	while (len > 0) {
+		size_t n = len > IPS_MAX_LEN ? IPS_MAX_LEN : len;
+
+		if (offset + n == IPS_EOF_OFFSET && n < len)
+			n--; /* the next record would start at "EOF" */
+		verbose("PATCH %zd-%zd\n", offset, offset + n - 1);
+		if (put_header(out, offset, n) || buf_put(out, mod + offset, n))
+			return -1;
+		offset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int emit_rle(struct buf *out, const unsigned char *mod, size_t offset,
+	size_t len)
+{
+	unsigned char rle[3];
+
+	rle[2] = mod[offset];
+	if (offset == IPS_EOF_OFFSET) {
+		if (mod[offset - 1] == mod[offset]) {
+			offset--; /* extend the run backwards instead */
+			len++;
+		} else {
+			if (emit_bin(out, mod, offset, 1))
+				return -1;
+			offset++;
+			len--;
+		}
+	}
+	while (len > 0) {
+		size_t n = len > IPS_MAX_LEN ? IPS_MAX_LEN : len;
+
+		if (offset + n == IPS_EOF_OFFSET && n < len)
+			n--;
+		verbose("RLE %zd-%zd = %#x\n", offset, offset + n - 1, rle[2]);
+		rle[0] = n >> 8;
+		rle[1] = n;
+		if (put_header(out, offset, 0) || buf_put(out, rle, sizeof(rle)))
+			return -1;
+		offset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* choose RLE or literal for every run so the region encodes smallest.
+ * state 0 has no literal record open, state 1 is inside one. */
+static int plan_region(struct piece *pieces, size_t count)
+{
+	size_t (*cost)[2];
+	unsigned char (*from)[2];
+	size_t i;
+	int state;
+
+	cost = malloc((count + 1) * sizeof(*cost));
+	from = malloc((count + 1) * sizeof(*from));
+	if (!cost || !from) {
+		perror("malloc()");
+		free(cost);
+		free(from);
+		return -1;
+	}
+
+	cost[0][0] = 0;
+	cost[0][1] = SIZE_MAX / 2;
+	for (i = 0; i < count; i++) {
+		size_t len = pieces[i].len;
+		size_t lit_closed = cost[i][0] + BIN_OVERHEAD + len;
+		size_t lit_open = cost[i][1] + len;
+
+		/* as a literal we end up inside a record */
+		if (lit_closed <= lit_open) {
+			cost[i + 1][1] = lit_closed;
+			from[i + 1][1] = 0;
+		} else {
+			cost[i + 1][1] = lit_open;
+			from[i + 1][1] = 1;
+		}
+
+		/* as RLE the current record is closed */
+		cost[i + 1][0] = SIZE_MAX / 2;
+		if (pieces[i].run) {
+			size_t rle = RLE_SIZE * ((len + IPS_MAX_LEN - 1) /
+				IPS_MAX_LEN);
+
+			if (cost[i][0] <= cost[i][1]) {
+				cost[i + 1][0] = cost[i][0] + rle;
+				from[i + 1][0] = 0;
+			} else {
+				cost[i + 1][0] = cost[i][1] + rle;
+				from[i + 1][0] = 1;
+			}
+		}
+	}
+
+	state = cost[count][0] <= cost[count][1] ? 0 : 1;
+	for (i = count; i > 0; i--) {
+		pieces[i - 1].rle = !state;
+		state = from[i][state];
+	}
+
+	free(cost);
+	free(from);
+	return 0;
+}
+
+/* encode the changed bytes in mod[start..end) */
+static int encode_region(struct buf *out, const unsigned char *mod,
+	size_t start, size_t end)
+{
+	struct piece *pieces;
+	size_t count = 0, max = 16;
+	size_t pos, lit, i;
+	int e = 0;
+
+	pieces = malloc(max * sizeof(*pieces));
+	if (!pieces) {
+		perror("malloc()");
+		return -1;
+	}
+
+	/* split into literals and runs worth considering for RLE */
+	for (lit = pos = start; pos < end; ) {
+		size_t run = pos + 1;
+
+		while (run < end && mod[run] == mod[pos])
+			run++;
+		if (run - pos < MIN_RUN) {
+			pos = run;
+			continue;
+		}
+		if (count + 2 > max) {
+			struct piece *tmp;
+
+			max *= 2;
+			tmp = realloc(pieces, max * sizeof(*pieces));
+			if (!tmp) {
+				perror("realloc()");
+				free(pieces);
+				return -1;
+			}
+			pieces = tmp;
+		}
+		if (lit < pos) {
+			pieces[count].offset = lit;
+			pieces[count].len = pos - lit;
+			pieces[count++].run = 0;
+		}
+		pieces[count].offset = pos;
+		pieces[count].len = run - pos;
+		pieces[count++].run = 1;
+		lit = pos = run;
+	}
+	if (lit < end) {
+		if (count + 1 > max) {
+			struct piece *tmp;
+
+			tmp = realloc(pieces, ++max * sizeof(*pieces));
+			if (!tmp) {
+				perror("realloc()");
+				free(pieces);
+				return -1;
+			}
+			pieces = tmp;
+		}
+		pieces[count].offset = lit;
+		pieces[count].len = end - lit;
+		pieces[count++].run = 0;
+	}
+
+	if (plan_region(pieces, count)) {
+		free(pieces);
+		return -1;
+	}
+
+	/* merge neighbouring literals into records */
+	for (i = 0; i < count && !e; ) {
+		size_t j;
+
+		if (pieces[i].run && pieces[i].rle) {
+			e = emit_rle(out, mod, pieces[i].offset, pieces[i].len);
+			i++;
+			continue;
+		}
+		for (j = i + 1; j < count && !(pieces[j].run && pieces[j].rle); )
+			j++;
+		e = emit_bin(out, mod, pieces[i].offset,
+			pieces[j - 1].offset + pieces[j - 1].len -
+			pieces[i].offset);
+		i = j;
+	}
+
+	free(pieces);
+	return e;
+}
+
+int ips_create(const char *origfile, const char *modfile,
+	const char *outfile)
+{
+	unsigned char *orig, *mod;
+	size_t origlen, modlen, len, pos, end;
+	struct buf out = { NULL, 0, 0 };
+	int e = -1;
+
+	orig = map_file(origfile, &origlen);
+	if (!orig)
+		return -1;
+	mod = map_file(modfile, &modlen);
+	if (!mod)
+		goto out_unmap_orig;
+
+	if (modlen < origlen) {
+		error("%s: Smaller than %s, IPS cannot truncate, "
+			"use a .bps patch\n", modfile, origfile);
+		goto out_unmap;
+	}
+
+	if (buf_put(&out, "PATCH", 5))
+		goto out_unmap;
+
+	len = origlen;
+	for (pos = next_diff(orig, mod, 0, len); pos < modlen; ) {
+		/* extend the region until a gap too long to be worth a new
+		 * record header; bytes past the original always differ */
+		end = pos + 1;
+		while (end < modlen) {
+			size_t next;
+
+			if (end >= len || orig[end] != mod[end]) {
+				end++;
+				continue;
+			}
+			next = next_diff(orig, mod, end, len);
+			if (next == modlen || next - end >= BIN_OVERHEAD)
+				break;
+			end = next;
+		}
+
+		if (encode_region(&out, mod, pos, end))
+			goto out_unmap;
+
+		pos = end < len ? next_diff(orig, mod, end, len) : end;
+	}
+
+	if (buf_put(&out, "EOF", 3))
+		goto out_unmap;
+
+	e = buf_write(&out, outfile);
+
+out_unmap:
+	free(out.data);
+	unmap_file(mod, modlen);
+out_unmap_orig:
+	unmap_file(orig, origlen);
+	return e;
+}
@@ -4,17 +4,26 @@
  * PUBLIC DOMAIN - April 29, 2009 - Jon Mayo
  *
  */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
+#include "ines.h"
 #include "util.h"
 
 #define PROG_NAME "nescombine"
 
-#define INES_MAGIC "NES\x1a"
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 /* macro to turn a macro into a string */
 #define _TOSTR(x) #x
@@ -26,112 +35,140 @@
 struct prog_opts {
 	int verbose_fl;
 	const char *out_filename;
-	unsigned mapper, extended_mapper, ram_size;
+	unsigned mapper, submapper, nes2_fl;
+	unsigned mirroring, four_screen_fl, battery_fl;
+	uint64_t ram_size, chr_ram_size;
 };
 
-static int write_ines(FILE *out_f, const char *filename, unsigned prg_rom_size, const void *prg_base, unsigned chr_rom_size, const void *chr_base, unsigned mapper, unsigned extended_mapper, unsigned ram_size) {
-	size_t res;
-	unsigned char ines_hdr[16], zeropad[16384];
+/* a PRG or CHR file mapped into memory */
+struct piece {
+	const char *filename;
+	unsigned char *data;
+	size_t len;
+};
 
-	memset(ines_hdr, 0, sizeof ines_hdr);
-	memcpy(ines_hdr+0, INES_MAGIC, strlen(INES_MAGIC));
-	ines_hdr[4]=(prg_rom_size+16384-1)/16384; /* PRG segments - round up to 16K bounrdy */
-	ines_hdr[5]=(chr_rom_size+8192-1)/8192; /* CHR segments - round up to 8K boundry */
-	ines_hdr[6]=mapper;
-	ines_hdr[7]=extended_mapper;
-	ines_hdr[8]=(ram_size+8192-1)/8192; /* RAM segments - round up to 8K boundry */
+/* write all of iov, at most IOV_MAX entries per call. iov is modified. */
+static int writev_all(int fd, const char *filename, struct iovec *iov, int count) {
+	ssize_t res;
 
-	if(fwrite(ines_hdr, 1l, sizeof ines_hdr, out_f)!=sizeof ines_hdr) {
-		fprintf(stderr, "Short write.\n");
-		return 0;
+	while(count>0) {
+		res=writev(fd, iov, count<IOV_MAX?count:IOV_MAX);
+		if(res<0 && errno==EINTR) continue;
+		if(res<0) {
+			perror(filename);
+			return 0;
+		}
+		/* skip what was written, a short write can stop mid-entry */
+		while(count>0 && (size_t)res>=iov->iov_len) {
+			res-=iov->iov_len;
+			iov++;
+			count--;
+		}
+		if(count>0) {
+			iov->iov_base=(char*)iov->iov_base+res;
+			iov->iov_len-=res;
+		}
 	}
+	return 1;
+}
 
-	fprintf(stderr, "%s:\n", filename);
-	fprintf(stderr, "  PRG-ROM %ldK\n", ines_hdr[4]*16l);
-	fprintf(stderr, "  CHR-ROM %ldK\n", ines_hdr[5]*8l);
-
-	memset(zeropad, 0, sizeof zeropad); /* holds empty data used for padding */
-
-	/* write PRG */
-	res=fwrite(prg_base, 1, prg_rom_size, out_f);
-	if(ferror(out_f)) goto error_f; /* IO error */
-	/* pad PRG to 16k boundry */
-	fwrite(zeropad, 1, (prg_rom_size%16384), out_f);
-	if(ferror(out_f)) goto error_f; /* IO error */
+/* add an iovec for each piece, then one from zeropad up to total bytes */
+static int add_pieces(struct iovec *iov, const struct piece *pieces, unsigned count, uint64_t total, void *zeropad) {
+	unsigned i;
+	int n=0;
+	uint64_t len=0;
+
+	for(i=0;i<count;i++) {
+		if(!pieces[i].len)
+			continue;
+		iov[n].iov_base=pieces[i].data;
+		iov[n].iov_len=pieces[i].len;
+		len+=pieces[i].len;
+		n++;
+	}
+	if(total>len) {
+		iov[n].iov_base=zeropad;
+		iov[n].iov_len=total-len;
+		n++;
+	}
+	return n;
+}
 
-	/* write CHR */
-	res=fwrite(chr_base, 1, chr_rom_size, out_f);
-	if(ferror(out_f)) goto error_f; /* IO error */
-	/* pad CHR to 8k boundry */
-	fwrite(zeropad, 1, (chr_rom_size%8192), out_f);
-	if(ferror(out_f)) goto error_f; /* IO error */
+static uint64_t pieces_size(const struct piece *pieces, unsigned count) {
+	uint64_t total=0;
+	unsigned i;
 
-	return 1; /* success */
-error_f:
-	perror(filename);
-	return 0; /* IO error */
+	for(i=0;i<count;i++)
+		total+=pieces[i].len;
+	return total;
 }
 
-/* update len and data with new data */
-static int file_append(const char *filename, size_t *len, unsigned char **data) {
-	FILE *f;
-	long buflen;
-	unsigned char *tmp;
-	size_t res;
-
-	if(!len || !data || !filename) {
-		fprintf(stderr, "%s():garbage args\n", __func__);
+/* the image is written with one writev(): the header, each input straight
+ * from its mapping, and zero-fill taken from an anonymous mapping so the
+ * padding costs no copies either. */
+static int write_ines(int out_fd, const char *filename, struct ines_hdr *hdr, const struct piece *prg, unsigned prg_count, const struct piece *chr, unsigned chr_count) {
+	unsigned char buf[INES_HDR_SIZE];
+	uint64_t prg_len, chr_len, pad;
+	struct iovec *iov;
+	void *zeropad=NULL;
+	int n, res;
+
+	/* sizes are rounded up to what the header can express */
+	prg_len=hdr->prg_rom_size=pieces_size(prg, prg_count);
+	chr_len=hdr->chr_rom_size=pieces_size(chr, chr_count);
+	if(!ines_encode(buf, hdr))
 		return 0;
-	}
 
-	/* open the file */
-	f=fopen(filename, "rb");
-	if(!f) {
-		perror(filename);
-		return 0; /* failure */
+	fprintf(stderr, "%s:\n", filename);
+	ines_print(stderr, hdr);
+
+	pad=hdr->prg_rom_size-prg_len;
+	if(hdr->chr_rom_size-chr_len>pad)
+		pad=hdr->chr_rom_size-chr_len;
+	if(pad) {
+		zeropad=mmap(NULL, pad, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if(zeropad==MAP_FAILED) {
+			perror("mmap()");
+			return 0;
+		}
 	}
-
-	/* first time into the loop try and use the entire filesize for the buffer */
-	buflen=filesize(filename, f);
-	if(buflen<0) {
-		fclose(f);
-		return 0; /* failure */
+	iov=malloc((prg_count+chr_count+3)*sizeof *iov);
+	if(!iov) {
+		perror("malloc()");
+		if(zeropad)
+			munmap(zeropad, pad);
+		return 0;
 	}
-	buflen++; /* read more than the file size to cause EOF to be detected in the fread loop */
-
-	do {
-		/* resize the buffer */
-		tmp=realloc(*data, *len+buflen);
-		if(!tmp) {
-			perror("realloc()");
-			fclose(f);
-			return 0; /* failure - leave the old pointer alone */
-		}
-		*data=tmp; /* success - use the new pointer */
-
-		/* load the data */
-		res=fread(*data+*len, 1, buflen, f);
-		if(ferror(f)) { /* check for errors */
-			perror(filename);
-			fclose(f);
-			return 0; /* failure */
-		}
 
-		/* successfuly read the data - update the length */
-		*len+=res;
-
-		/* fprintf(stderr, "DEBUG:buflen=%ld res=%zd\n", buflen, res); */
-
-		if(res<buflen) {
-			break; /* treat short reads as EOF */
-		}
+	iov[0].iov_base=buf;
+	iov[0].iov_len=sizeof buf;
+	n=1;
+	n+=add_pieces(iov+n, prg, prg_count, hdr->prg_rom_size, zeropad); /* PRG, padded */
+	n+=add_pieces(iov+n, chr, chr_count, hdr->chr_rom_size, zeropad); /* CHR, padded */
+	res=writev_all(out_fd, filename, iov, n);
+
+	free(iov);
+	if(zeropad)
+		munmap(zeropad, pad);
+	return res;
+}
 
-		buflen=32768; /* if we loop we should try to read 32K at a time */
-	} while(!feof(f));
+/* map filename and add it to the list */
+static int add_piece(const char *filename, struct piece *pieces, unsigned *count) {
+	pieces[*count].filename=filename;
+	pieces[*count].data=map_file(filename, &pieces[*count].len);
+	if(!pieces[*count].data)
+		return 0;
+	(*count)++;
+	return 1;
+}
 
+static void free_pieces(struct piece *pieces, unsigned count) {
+	unsigned i;
 
-	fclose(f);
-	return 1; /* success */
+	for(i=0;i<count;i++)
+		unmap_file(pieces[i].data, pieces[i].len);
+	free(pieces);
 }
 
 /*
@@ -139,14 +176,20 @@ static int file_append(const char *filename, size_t *len, unsigned char **data)
  */
 static void usage(void) {
 	fprintf(stderr,
-		"usage: " PROG_NAME "[-o <f>] [-m <M>] [-x <X>] [-r <sz>] [file ...]\n"
+		"usage: " PROG_NAME " [-2B] [-o <f>] [-m <M>] [-x <X>] [-M h|v|4] [-r <sz>] [-c <sz>] [file ...]\n"
 	);
 
 	fprintf(stderr,
+		"-2          write a NES 2.0 header even if iNES 1.0 would do.\n"
 		"-o <f>      output file (default is basename of first file).\n"
-		"-m <M>      mapper number (default is 0).\n"
-		"-x <X>      extended mapper number (default is 0).\n"
-		"-r <R>      RAM size (default is 0, rounded up in 8K chunks).\n"
+		"-m <M>      mapper number, 0 to 4095 (default is 0).\n"
+		"-x <X>      NES 2.0 submapper number (default is 0).\n"
+		"-M <mir>    nametable mirroring, h horizontal, v vertical or 4 for\n"
+		"            four-screen VRAM (default is h).\n"
+		"-B          battery-backed PRG-RAM.\n"
+		"-r <R>      PRG-RAM size (default is 0, rounded up in 8K chunks,\n"
+		"            or to a power of two for NES 2.0).\n"
+		"-c <C>      NES 2.0 CHR-RAM size (default is 0).\n"
 	);
 }
 
@@ -158,8 +201,30 @@ static int parse_args(struct prog_opts *po, int argc, char **argv) {
 	const char *tmp;
 	char *endptr;
 
-	while ((c=getopt(argc, argv, "hvo:m:r:x:"))>0) {
+	while ((c=getopt(argc, argv, "2BhvM:o:m:r:x:c:"))>0) {
 		switch (c) {
+			case '2':
+				po->nes2_fl=1;
+				break;
+			case 'B':
+				po->battery_fl=1;
+				break;
+			case 'M':
+				if (!strcmp(optarg, "h")) {
+					po->mirroring=0;
+					po->four_screen_fl=0;
+				} else if (!strcmp(optarg, "v")) {
+					po->mirroring=1;
+					po->four_screen_fl=0;
+				} else if (!strcmp(optarg, "4")) {
+					po->mirroring=0;
+					po->four_screen_fl=1;
+				} else {
+					fprintf(stderr, "Error: -M takes h, v or 4.\n");
+					usage();
+					return 0;
+				}
+				break;
 			case 'h':
 				usage();
 				return 0; /* treat as a failure */
@@ -178,7 +243,7 @@ static int parse_args(struct prog_opts *po, int argc, char **argv) {
 				}
 				break;
 			case 'x':
-				po->extended_mapper=strtoul(optarg, &endptr, 10);
+				po->submapper=strtoul(optarg, &endptr, 10);
 				if (*endptr) {
 					fprintf(stderr, "Error: -x takes a decimal number.\n");
 					usage();
@@ -186,13 +251,21 @@ static int parse_args(struct prog_opts *po, int argc, char **argv) {
 				}
 				break;
 			case 'r':
-				po->ram_size=strtoul(optarg, &endptr, 0);
+				po->ram_size=strtoull(optarg, &endptr, 0);
 				if (*endptr) {
 					fprintf(stderr, "Error: -r takes a number.\n");
 					usage();
 					return 0;
 				}
 				break;
+			case 'c':
+				po->chr_ram_size=strtoull(optarg, &endptr, 0);
+				if (*endptr) {
+					fprintf(stderr, "Error: -c takes a number.\n");
+					usage();
+					return 0;
+				}
+				break;
 			default:
 				usage();
 				return 0; /* failure */
@@ -202,12 +275,12 @@ static int parse_args(struct prog_opts *po, int argc, char **argv) {
 }
 
 int main(int argc, char **argv) {
-	int i;
-	FILE *out_f;
+	int i, out_fd;
 	char out_filename_tmp[512]; /* temp space for a filename */
-	struct prog_opts po={0, NULL};
-	unsigned char *prg_base=NULL, *chr_base=NULL;
-	size_t prg_rom_size=0, chr_rom_size=0;
+	struct prog_opts po={0};
+	struct ines_hdr hdr;
+	struct piece *prg, *chr;
+	unsigned prg_count=0, chr_count=0;
 
 
 	if(!parse_args(&po, argc, argv)) {
@@ -225,20 +298,25 @@ int main(int argc, char **argv) {
 		po.out_filename=out_filename_tmp;
 	}
 
-	/* load all the files */
+	prg=calloc(argc, sizeof *prg);
+	chr=calloc(argc, sizeof *chr);
+	if(!prg || !chr) {
+		perror("calloc()");
+		return EXIT_FAILURE;
+	}
+
+	/* map all the files */
 	for(i=optind;i<argc;i++) {
 		const char *ext;
 
 		ext=file_extension(argv[i]);
 		if(ext && !strcasecmp(ext, ".chr")) {
-			/* TODO: load CHR */
-			if(!file_append(argv[i], &chr_rom_size, &chr_base)) {
+			if(!add_piece(argv[i], chr, &chr_count)) {
 				usage();
 				return EXIT_FAILURE;
 			}
 		} else if(ext && !strcasecmp(ext, ".prg")) {
-			/* TODO: load PRG */
-			if(!file_append(argv[i], &prg_rom_size, &prg_base)) {
+			if(!add_piece(argv[i], prg, &prg_count)) {
 				usage();
 				return EXIT_FAILURE;
 			}
@@ -249,17 +327,33 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	memset(&hdr, 0, sizeof hdr);
+	hdr.nes2_fl=po.nes2_fl;
+	hdr.mapper=po.mapper;
+	hdr.submapper=po.submapper;
+	hdr.mirroring=po.mirroring;
+	hdr.four_screen_fl=po.four_screen_fl;
+	hdr.battery_fl=po.battery_fl;
+	hdr.prg_ram_size=po.ram_size;
+	hdr.chr_ram_size=po.chr_ram_size;
+
 	/* create the output */
-	out_f=fopen(po.out_filename, "wb");
-	if(!out_f) {
-		perror(argv[i]);
+	out_fd=open(po.out_filename, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if(out_fd<0) {
+		perror(po.out_filename);
 		return EXIT_FAILURE;
 	}
 
-	if(!write_ines(out_f, po.out_filename, prg_rom_size, prg_base, chr_rom_size, chr_base, po.mapper, po.extended_mapper, po.ram_size)) {
+	if(!write_ines(out_fd, po.out_filename, &hdr, prg, prg_count, chr, chr_count)) {
+		close(out_fd);
 		return EXIT_FAILURE;
 	}
 
-	fclose(out_f);
+	if(close(out_fd)) {
+		perror(po.out_filename);
+		return EXIT_FAILURE;
+	}
+	free_pieces(prg, prg_count);
+	free_pieces(chr, chr_count);
 	return 0;
 }
@@ -0,0 +1,523 @@
+/* nesindex.c
+ * indexes a library of iNES files so files sharing a header, PRG, CHR or
+ * individual 1K CHR banks can be found without rescanning the library.
+ *
+ * nesindex [-j threads] -o index dir...
+ *   walks each dir for .nes files, hashes them on a pool of threads and
+ *   writes a sorted index.
+ * nesindex -q index file...
+ *   lists the indexed files that share data with each file. a .nes file is
+ *   matched on its PRG, CHR and CHR banks, any other file as a CHR dump.
+ *
+ * Index file format (all numbers little-endian):
+ *  +--------+------+------------------------------------------+
+ *  | Offset | Size | Content(s)                               |
+ *  +--------+------+------------------------------------------+
+ *  |   0    |  8   | 'NESIDX1' $00                            |
+ *  |   8    |  4   | number of files                          |
+ *  |  12    |  4   | number of entries                        |
+ *  |  16    |  4   | size of string table                     |
+ *  |  20    | 4*F  | string table offset of each file's path  |
+ *  |  ...   | 20*E | entries sorted by hash, crc, kind, file  |
+ *  |        |      |   8 hash64, 4 crc32, 4 file number,      |
+ *  |        |      |   4 kind<<24 | 1K bank number          |
+ *  |  ...   |      | string table, NUL terminated paths       |
+ *  +--------+------+------------------------------------------+
+ */
+#define _XOPEN_SOURCE 700
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "crc32.h"
+#include "hash64.h"
+#include "ines.h"
+#include "pool.h"
+#include "util.h"
+
+#define PROG_NAME "nesindex"
+#define INDEX_MAGIC "NESIDX1"
+#define INDEX_HDR_SIZE 20
+#define ENTRY_SIZE 20
+#define BANK_SIZE 1024
+
+enum kind {
+	KIND_HEADER,
+	KIND_PRG,
+	KIND_CHR,
+	KIND_BANK,
+};
+
+static const char *kind_names[]={"header", "prg", "chr", "bank"};
+
+struct entry {
+	uint64_t hash;
+	uint32_t crc;
+	uint32_t file;
+	uint32_t kind_bank; /* kind<<24 | bank */
+};
+
+/* one .nes file found by the walk, and the entries hashed from it */
+struct rom {
+	char *path;
+	struct entry *entries;
+	unsigned count;
+	int failed;
+};
+
+static int verbose_fl;
+
+/* nftw() has no user argument, so the walk collects into these */
+static struct rom *roms;
+static unsigned rom_count, rom_max;
+
+static void hash_entry(struct entry *e, uint32_t file, unsigned kind, unsigned bank, const unsigned char *data, size_t len) {
+	e->hash=hash64(data, len, 0);
+	e->crc=crc32_update(0, data, len);
+	e->file=file;
+	e->kind_bank=(kind<<24)|bank;
+}
+
+/* a bank of all $00 or all $FF would match half the library */
+static int blank_bank(const unsigned char *p, size_t len) {
+	size_t i;
+
+	if(p[0]!=0 && p[0]!=0xff)
+		return 0;
+	for(i=1;i<len;i++)
+		if(p[i]!=p[0])
+			return 0;
+	return 1;
+}
+
+/* hash the PRG, CHR and CHR banks of an image already in memory. with no
+ * header the whole buffer is treated as CHR. */
+static unsigned hash_image(struct entry *out, uint32_t file, const struct ines_hdr *hdr, const unsigned char *data, size_t len) {
+	const unsigned char *prg, *chr;
+	size_t chr_len, i;
+	unsigned n=0;
+
+	if(hdr) {
+		hash_entry(&out[n++], file, KIND_HEADER, 0, data, INES_HDR_SIZE);
+		prg=data+INES_HDR_SIZE+(hdr->trainer_fl?INES_TRAINER_SIZE:0);
+		chr=prg+hdr->prg_rom_size;
+		chr_len=hdr->chr_rom_size;
+		if(hdr->prg_rom_size)
+			hash_entry(&out[n++], file, KIND_PRG, 0, prg, hdr->prg_rom_size);
+	} else {
+		chr=data;
+		chr_len=len;
+	}
+	if(chr_len) /* CHR-RAM boards have nothing to share */
+		hash_entry(&out[n++], file, KIND_CHR, 0, chr, chr_len);
+	for(i=0;i+BANK_SIZE<=chr_len;i+=BANK_SIZE) {
+		if(!blank_bank(chr+i, BANK_SIZE))
+			hash_entry(&out[n++], file, KIND_BANK, i/BANK_SIZE, chr+i, BANK_SIZE);
+	}
+	return n;
+}
+
+/* upper bound on entries hash_image() makes */
+static size_t image_entries(uint64_t chr_len) {
+	return 3+chr_len/BANK_SIZE;
+}
+
+/* map a file and check that an iNES header fits it.
+ * @returns 1 for iNES, 0 for anything else, -1 on error */
+static int load_image(const char *filename, unsigned char **data, size_t *len, struct ines_hdr *hdr) {
+	*data=map_file(filename, len);
+	if(!*data)
+		return -1;
+	if(*len<INES_HDR_SIZE || memcmp(*data, "NES\x1a", 4))
+		return 0;
+	if(!ines_decode(hdr, *data))
+		goto bad;
+	if(*len-INES_HDR_SIZE<ines_data_size(hdr)) {
+		fprintf(stderr, "%s:Truncated file.\n", filename);
+		goto bad;
+	}
+	return 1;
+bad:
+	unmap_file(*data, *len);
+	return -1;
+}
+
+static void index_job(void *arg, unsigned index) {
+	struct rom *rom=&roms[index];
+	struct ines_hdr hdr;
+	unsigned char *data;
+	size_t len;
+	int res;
+
+	(void)arg;
+	res=load_image(rom->path, &data, &len, &hdr);
+	if(res<=0) {
+		if(res==0) {
+			fprintf(stderr, "%s:Not an iNES file.\n", rom->path);
+			unmap_file(data, len);
+		}
+		rom->failed=1;
+		return;
+	}
+	rom->entries=malloc(image_entries(hdr.chr_rom_size)*sizeof *rom->entries);
+	if(!rom->entries) {
+		perror(rom->path);
+		rom->failed=1;
+	} else {
+		rom->count=hash_image(rom->entries, index, &hdr, data, len);
+	}
+	unmap_file(data, len);
+}
+
+static int walk_file(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+	const char *ext;
+
+	(void)sb;
+	(void)ftwbuf;
+	if(typeflag!=FTW_F)
+		return 0;
+	ext=file_extension(fpath);
+	if(!ext || strcasecmp(ext, ".nes"))
+		return 0;
+
+	if(rom_count==rom_max) {
+		struct rom *tmp;
+		unsigned max=rom_max?rom_max*2:256;
+
+		tmp=realloc(roms, max*sizeof *roms);
+		if(!tmp) {
+			perror("realloc()");
+			return -1;
+		}
+		roms=tmp;
+		rom_max=max;
+	}
+	memset(&roms[rom_count], 0, sizeof *roms);
+	roms[rom_count].path=strdup(fpath);
+	if(!roms[rom_count].path) {
+		perror("strdup()");
+		return -1;
+	}
+	rom_count++;
+	return 0;
+}
+
+static int entry_cmp(const void *a, const void *b) {
+	const struct entry *x=a, *y=b;
+
+	if(x->hash!=y->hash)
+		return x->hash<y->hash?-1:1;
+	if(x->crc!=y->crc)
+		return x->crc<y->crc?-1:1;
+	if(x->kind_bank!=y->kind_bank)
+		return x->kind_bank<y->kind_bank?-1:1;
+	if(x->file!=y->file)
+		return x->file<y->file?-1:1;
+	return 0;
+}
+
+static void put32(FILE *f, uint32_t v) {
+	unsigned char b[4]={v, v>>8, v>>16, v>>24};
+	fwrite(b, 1, sizeof b, f);
+}
+
+static void put64(FILE *f, uint64_t v) {
+	put32(f, v);
+	put32(f, v>>32);
+}
+
+static uint32_t get32(const unsigned char *p) {
+	return (uint32_t)p[0]|((uint32_t)p[1]<<8)|((uint32_t)p[2]<<16)|((uint32_t)p[3]<<24);
+}
+
+static uint64_t get64(const unsigned char *p) {
+	return get32(p)|((uint64_t)get32(p+4)<<32);
+}
+
+static int write_index(const char *filename, struct entry *entries, size_t count) {
+	FILE *f;
+	unsigned i;
+	uint32_t ofs;
+	size_t j;
+
+	f=fopen(filename, "wb");
+	if(!f) {
+		perror(filename);
+		return 0;
+	}
+
+	fwrite(INDEX_MAGIC, 1, sizeof INDEX_MAGIC, f);
+	put32(f, rom_count);
+	put32(f, count);
+	for(i=0, ofs=0;i<rom_count;i++)
+		ofs+=strlen(roms[i].path)+1;
+	put32(f, ofs);
+	for(i=0, ofs=0;i<rom_count;i++) {
+		put32(f, ofs);
+		ofs+=strlen(roms[i].path)+1;
+	}
+	for(j=0;j<count;j++) {
+		put64(f, entries[j].hash);
+		put32(f, entries[j].crc);
+		put32(f, entries[j].file);
+		put32(f, entries[j].kind_bank);
+	}
+	for(i=0;i<rom_count;i++)
+		fwrite(roms[i].path, 1, strlen(roms[i].path)+1, f);
+
+	if(ferror(f) || fclose(f)) {
+		perror(filename);
+		return 0;
+	}
+	return 1;
+}
+
+static int build(const char *out_filename, char **dirs, int ndirs, unsigned threads) {
+	struct entry *entries;
+	size_t count=0;
+	unsigned i;
+	int d, res;
+
+	for(d=0;d<ndirs;d++) {
+		if(nftw(dirs[d], walk_file, 64, FTW_PHYS)) {
+			perror(dirs[d]);
+			return 0;
+		}
+	}
+
+	crc32_init(); /* build the tables before the threads share them */
+	if(pool_run(threads, rom_count, index_job, NULL))
+		return 0;
+
+	for(i=0;i<rom_count;i++)
+		count+=roms[i].count;
+	entries=malloc((count?count:1)*sizeof *entries);
+	if(!entries) {
+		perror("malloc()");
+		return 0;
+	}
+	for(i=0, count=0;i<rom_count;i++) {
+		if(roms[i].count)
+			memcpy(entries+count, roms[i].entries, roms[i].count*sizeof *entries);
+		count+=roms[i].count;
+		free(roms[i].entries);
+	}
+	qsort(entries, count, sizeof *entries, entry_cmp);
+
+	res=write_index(out_filename, entries, count);
+	if(res && verbose_fl)
+		fprintf(stderr, "%s: %u files, %zu entries\n", out_filename, rom_count, count);
+	free(entries);
+	return res;
+}
+
+/* an index mapped in memory */
+struct index {
+	unsigned char *data;
+	size_t len;
+	uint32_t files, count;
+	const unsigned char *names, *entries, *strings;
+	uint32_t strings_len;
+};
+
+static int open_index(const char *filename, struct index *idx) {
+	idx->data=map_file(filename, &idx->len);
+	if(!idx->data)
+		return 0;
+	if(idx->len<INDEX_HDR_SIZE || memcmp(idx->data, INDEX_MAGIC, sizeof INDEX_MAGIC))
+		goto bad;
+	idx->files=get32(idx->data+8);
+	idx->count=get32(idx->data+12);
+	idx->strings_len=get32(idx->data+16);
+	if((uint64_t)INDEX_HDR_SIZE+4ull*idx->files+(uint64_t)ENTRY_SIZE*idx->count+idx->strings_len!=idx->len)
+		goto bad;
+	idx->names=idx->data+INDEX_HDR_SIZE;
+	idx->entries=idx->names+4*idx->files;
+	idx->strings=idx->entries+ENTRY_SIZE*idx->count;
+	if(idx->strings_len && idx->strings[idx->strings_len-1])
+		goto bad;
+	return 1;
+bad:
+	fprintf(stderr, "%s:Not a valid index.\n", filename);
+	unmap_file(idx->data, idx->len);
+	return 0;
+}
+
+static const char *index_path(const struct index *idx, uint32_t file) {
+	uint32_t ofs;
+
+	if(file>=idx->files)
+		return "?";
+	ofs=get32(idx->names+4*file);
+	return ofs<idx->strings_len?(const char *)idx->strings+ofs:"?";
+}
+
+/* decode entry i of the index */
+static void index_entry(const struct index *idx, uint32_t i, struct entry *e) {
+	const unsigned char *p=idx->entries+(size_t)ENTRY_SIZE*i;
+
+	e->hash=get64(p);
+	e->crc=get32(p+8);
+	e->file=get32(p+12);
+	e->kind_bank=get32(p+16);
+}
+
+/* @returns index of the first entry with the same hash and crc as key */
+static uint32_t index_find(const struct index *idx, const struct entry *key) {
+	uint32_t lo=0, hi=idx->count, mid;
+	struct entry e;
+
+	while(lo<hi) {
+		mid=lo+(hi-lo)/2;
+		index_entry(idx, mid, &e);
+		if(e.hash<key->hash || (e.hash==key->hash && e.crc<key->crc))
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	return lo;
+}
+
+/* count of banks each indexed file shares with the query */
+struct bank_hits {
+	uint32_t *hits;
+	uint32_t *last; /* query bank that last hit each file, so a file
+	                   holding the same bank twice only counts once */
+};
+
+static void query_entry(const struct index *idx, const struct entry *key, struct bank_hits *bh, unsigned qbank) {
+	unsigned kind=key->kind_bank>>24;
+	struct entry e;
+	uint32_t i;
+
+	for(i=index_find(idx, key);i<idx->count;i++) {
+		index_entry(idx, i, &e);
+		if(e.hash!=key->hash || e.crc!=key->crc)
+			break;
+		if(e.kind_bank>>24!=kind)
+			continue;
+		if(kind==KIND_BANK) {
+			if(e.file<idx->files && bh->last[e.file]!=qbank+1) {
+				bh->last[e.file]=qbank+1;
+				bh->hits[e.file]++;
+			}
+		} else {
+			printf("  %s %08x %s\n", kind_names[kind], (unsigned)e.crc, index_path(idx, e.file));
+		}
+	}
+}
+
+static int query(const struct index *idx, const char *filename) {
+	struct ines_hdr hdr;
+	unsigned char *data;
+	size_t len;
+	struct entry *entries;
+	struct bank_hits bh;
+	unsigned n, i, banks=0;
+	int res;
+
+	res=load_image(filename, &data, &len, &hdr);
+	if(res<0)
+		return 0;
+	entries=malloc(image_entries(res?hdr.chr_rom_size:len)*sizeof *entries);
+	bh.hits=calloc(idx->files?idx->files:1, sizeof *bh.hits);
+	bh.last=calloc(idx->files?idx->files:1, sizeof *bh.last);
+	if(!entries || !bh.hits || !bh.last) {
+		perror(filename);
+		free(entries);
+		free(bh.hits);
+		free(bh.last);
+		unmap_file(data, len);
+		return 0;
+	}
+
+	printf("** %s\n", filename);
+	n=hash_image(entries, 0, res?&hdr:NULL, data, len);
+	unmap_file(data, len);
+	for(i=0;i<n;i++) {
+		if(entries[i].kind_bank>>24==KIND_HEADER)
+			continue; /* headers are only indexed for completeness */
+		if(entries[i].kind_bank>>24==KIND_BANK)
+			banks++;
+		query_entry(idx, &entries[i], &bh, i);
+	}
+	for(i=0;i<idx->files;i++) {
+		if(bh.hits[i])
+			printf("  banks %u/%u %s\n", (unsigned)bh.hits[i], banks, index_path(idx, i));
+	}
+
+	free(entries);
+	free(bh.hits);
+	free(bh.last);
+	return 1;
+}
+
+static void usage(void) {
+	fprintf(stderr,
+		"usage: " PROG_NAME " [-v] [-j <n>] -o <index> <dir>...\n"
+		"       " PROG_NAME " -q <index> <file>...\n"
+	);
+
+	fprintf(stderr,
+		"-o <index>  write an index of every .nes file under each dir.\n"
+		"-q <index>  list indexed files sharing PRG, CHR or 1K CHR banks.\n"
+		"-j <n>      number of threads (default is one per processor).\n"
+		"-v          verbose.\n"
+	);
+}
+
+int main(int argc, char **argv) {
+	const char *out_filename=NULL, *index_filename=NULL;
+	unsigned threads=pool_threads();
+	struct index idx;
+	char *endptr;
+	int c, i, ret=0;
+
+	while((c=getopt(argc, argv, "hvo:q:j:"))!=-1) {
+		switch(c) {
+			case 'v':
+				verbose_fl++;
+				break;
+			case 'o':
+				out_filename=optarg;
+				break;
+			case 'q':
+				index_filename=optarg;
+				break;
+			case 'j':
+				threads=strtoul(optarg, &endptr, 10);
+				if(*endptr || !threads) {
+					fprintf(stderr, "Error: -j takes a positive number.\n");
+					usage();
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'h':
+			default:
+				usage();
+				return EXIT_FAILURE;
+		}
+	}
+
+	if(optind==argc || !out_filename==!index_filename) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	if(out_filename)
+		return build(out_filename, argv+optind, argc-optind, threads)?0:EXIT_FAILURE;
+
+	if(!open_index(index_filename, &idx))
+		return EXIT_FAILURE;
+	crc32_init();
+	for(i=optind;i<argc;i++) {
+		if(!query(&idx, argv[i]))
+			ret=EXIT_FAILURE;
+	}
+	unmap_file(idx.data, idx.len);
+	return ret;
+}
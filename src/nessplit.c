@@ -3,8 +3,8 @@
  *
  * PUBLIC DOMAIN - Novemeber 20, 2007 - Jon Mayo
  *
- * BUGS:
- * cannot split .nes files that have trainers
+ * the 512-byte trainer is skipped unless -t is given, in which case it is
+ * written to a .trn file.
  *
  */
 /* iNES Format (.NES)
@@ -34,108 +34,93 @@
  *  |  ...   |      | the first PRG-ROM bank.                  |
  *  | ..-EOF |      | CHR-ROM pages (in ascending order).      |
  *  +--------+------+------------------------------------------+
+ *
+ * NES 2.0 headers are also understood, see ines.c.
  */
 
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "ines.h"
 #include "util.h"
 
-struct ines_hdr {
-	size_t prg_rom_size;
-	size_t chr_rom_size;
-	unsigned trainer_fl;
-	unsigned mapper, mirroring;
-};
-
 static int verbose_fl=1;
 
 static int read_ines_hdr(FILE *in, struct ines_hdr *hdr) {
-	uint8_t buf[16];
+	uint8_t buf[INES_HDR_SIZE];
 
 	if(fread(buf, 1l, sizeof buf, in)!=sizeof buf) {
 		fprintf(stderr, "Truncated file.\n");
 		return 0;
 	}
 
-	if(buf[0]!='N' || buf[1]!='E' || buf[2]!='S' || buf[3]!=0x1a) {
-		fprintf(stderr, "Not an iNES file.\n");
+	if(!ines_decode(hdr, buf))
 		return 0;
-	}
-
-	if(hdr) {
-		hdr->prg_rom_size=buf[4]*16384l;
-		hdr->chr_rom_size=buf[5]*8192l;
-		hdr->trainer_fl=(buf[6]>>2)&1; /* 512-byte trainer is before the PRG ROM */
-		hdr->mapper=((buf[6]>>4)&15)|(buf[7]&0xf0);
-		hdr->mirroring=buf[6]&3;
-	}
 
 	if(verbose_fl>1)
 		fprintf(stderr, "  header: %02hhx %02hhx %02hhx %02hhx\n", buf[4], buf[5], buf[6], buf[7]);
-	if(hdr) {
-		fprintf(stderr, "  PRG-ROM %ldK\n", hdr->prg_rom_size/1024);
-		fprintf(stderr, "  CHR-ROM %ldK\n", hdr->chr_rom_size/1024);
-		fprintf(stderr, "  Mapper=%d\n", hdr->mapper);
-		fprintf(stderr, "  Trainer=%d\n", hdr->trainer_fl);
-		fprintf(stderr, "  Mirroring=%d\n", hdr->mirroring);
-		fprintf(stderr, "  Battery=%d\n", (buf[6]>>1)&1);
-		fprintf(stderr, "  4-screen VRAM=%d\n", (buf[6]>>3)&1);
-	}
+	ines_print(stderr, hdr);
 
 	return 1;
 }
 
-static int dump_bin(FILE *in, const char *out_filename, size_t len) {
-	FILE *out;
-	char *buf;
-	int res;
-	out=fopen(out_filename, "wb");
-	if(!out) {
-		perror(out_filename);
-		return 0;
-	}
-	buf=malloc(len);
-	res=fread(buf, 1l, len, in);
-	if(res<0) {
+/* copy len bytes at offset ofs of in_fd to out_filename. the data is copied
+ * in the kernel where possible, so nothing is read through the stdio buffer.
+ */
+static int dump_bin(const char *in_filename, int in_fd, off_t ofs, const char *out_filename, uint64_t len) {
+	int out_fd;
+
+	out_fd=open(out_filename, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if(out_fd<0) {
 		perror(out_filename);
-		free(buf);
 		return 0;
 	}
-	if((unsigned)res!=len) {
-		fprintf(stderr, "%s:short read while copying.\n", out_filename);
-		free(buf);
+	if(!copy_fd_range(in_filename, in_fd, ofs, out_fd, len)) {
+		close(out_fd);
 		return 0;
 	}
-	res=fwrite(buf, 1l, len, out);
-	if(res<0) {
+	if(close(out_fd)) {
 		perror(out_filename);
-		free(buf);
-		return 0;
-	}
-	if((unsigned)res!=len) {
-		fprintf(stderr, "%s:short write while copying.\n", out_filename);
-		free(buf);
 		return 0;
 	}
 
-	free(buf);
 	fprintf(stderr, "Wrote %s\n", out_filename);
 	return 1;
 }
 
+static void usage(void) {
+	fprintf(stderr, "usage: nessplit [-t] [file.nes ...]\nSplits iNES files into CHR and PRG.\n"
+		"  -t  also write the trainer to a .trn file\n");
+}
+
 int main(int argc, char **argv) {
-	int i;
+	int i, c;
+	int trainer_fl=0;
 	FILE *f;
+	off_t ofs;
 	struct ines_hdr hdr;
-	char chr_filename[512], prg_filename[512];
+	char chr_filename[512], prg_filename[512], trn_filename[512];
+
+	while((c=getopt(argc, argv, "th"))!=-1) {
+		switch(c) {
+			case 't':
+				trainer_fl=1;
+				break;
+			case 'h':
+			default:
+				usage();
+				return EXIT_FAILURE;
+		}
+	}
 
-	if (argc==1) {
-		fprintf(stderr, "usage: nessplit [file.nes ...]\nSplits iNES files into CHR and PRG.\n");
+	if (optind>=argc) {
+		usage();
 		return EXIT_FAILURE;
-	} else for(i=1;i<argc;i++) {
+	} else for(i=optind;i<argc;i++) {
 		printf("** %s\n", argv[i]);
 		f=fopen(argv[i], "rb");
 		if(!f) {
@@ -144,26 +129,47 @@ int main(int argc, char **argv) {
 		}
 
 		if(read_ines_hdr(f, &hdr)) {
-			if(hdr.trainer_fl) {
-				fprintf(stderr, "Cannot dump trainers.\n");
+			long len=filesize(argv[i], f);
+
+			if(len<0)
+				goto done;
+			if((uint64_t)len-INES_HDR_SIZE<ines_data_size(&hdr)) {
+				fprintf(stderr, "Truncated file.\n");
 				goto done;
 			}
+			/* the FILE's position is past the header and buffered ahead,
+			 * so all copies use explicit offsets on the descriptor. */
+			ofs=INES_HDR_SIZE;
+			if(hdr.trainer_fl) {
+				if(trainer_fl) {
+					if(!make_file_name(trn_filename, sizeof trn_filename, argv[i], ".trn")) {
+						fprintf(stderr, "Cannot output trainer file.\n");
+						goto done;
+					}
+					if(!dump_bin(argv[i], fileno(f), ofs, trn_filename, INES_TRAINER_SIZE)) {
+						fprintf(stderr, "Error outputing trainer file.\n");
+						goto done;
+					}
+				}
+				ofs+=INES_TRAINER_SIZE;
+			}
 			if(hdr.prg_rom_size) {
 				if(!make_file_name(prg_filename, sizeof prg_filename, argv[i], ".prg")) {
 					fprintf(stderr, "Cannot output PRG file.\n");
 					goto done;
 				}
-				if(!dump_bin(f, prg_filename, hdr.prg_rom_size)) {
+				if(!dump_bin(argv[i], fileno(f), ofs, prg_filename, hdr.prg_rom_size)) {
 					fprintf(stderr, "Error outputing PRG file.\n");
 					goto done;
 				}
+				ofs+=hdr.prg_rom_size;
 			}
 			if(hdr.chr_rom_size) {
 				if(!make_file_name(chr_filename, sizeof chr_filename, argv[i], ".chr")) {
 					fprintf(stderr, "Cannot output CHR file.\n");
 					goto done;
 				}
-				if(!dump_bin(f, chr_filename, hdr.chr_rom_size)) {
+				if(!dump_bin(argv[i], fileno(f), ofs, chr_filename, hdr.chr_rom_size)) {
 					fprintf(stderr, "Error outputing CHR file.\n");
 					goto done;
 				}
@@ -0,0 +1,95 @@
+/* palette.c
+ * NES master palette and the color lists given on the command line.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "palette.h"
+#include "util.h"
+
+/* a common approximation of the 2C02 PPU's output */
+const unsigned char nes_palette[PALETTE_NES_COLORS][3]={
+	{0x7c,0x7c,0x7c}, {0x00,0x00,0xfc}, {0x00,0x00,0xbc}, {0x44,0x28,0xbc},
+	{0x94,0x00,0x84}, {0xa8,0x00,0x20}, {0xa8,0x10,0x00}, {0x88,0x14,0x00},
+	{0x50,0x30,0x00}, {0x00,0x78,0x00}, {0x00,0x68,0x00}, {0x00,0x58,0x00},
+	{0x00,0x40,0x58}, {0x00,0x00,0x00}, {0x00,0x00,0x00}, {0x00,0x00,0x00},
+	{0xbc,0xbc,0xbc}, {0x00,0x78,0xf8}, {0x00,0x58,0xf8}, {0x68,0x44,0xfc},
+	{0xd8,0x00,0xcc}, {0xe4,0x00,0x58}, {0xf8,0x38,0x00}, {0xe4,0x5c,0x10},
+	{0xac,0x7c,0x00}, {0x00,0xb8,0x00}, {0x00,0xa8,0x00}, {0x00,0xa8,0x44},
+	{0x00,0x88,0x88}, {0x00,0x00,0x00}, {0x00,0x00,0x00}, {0x00,0x00,0x00},
+	{0xf8,0xf8,0xf8}, {0x3c,0xbc,0xfc}, {0x68,0x88,0xfc}, {0x98,0x78,0xf8},
+	{0xf8,0x78,0xf8}, {0xf8,0x58,0x98}, {0xf8,0x78,0x58}, {0xfc,0xa0,0x44},
+	{0xf8,0xb8,0x00}, {0xb8,0xf8,0x18}, {0x58,0xd8,0x54}, {0x58,0xf8,0x98},
+	{0x00,0xe8,0xd8}, {0x78,0x78,0x78}, {0x00,0x00,0x00}, {0x00,0x00,0x00},
+	{0xfc,0xfc,0xfc}, {0xa4,0xe4,0xfc}, {0xb8,0xb8,0xf8}, {0xd8,0xb8,0xf8},
+	{0xf8,0xb8,0xf8}, {0xf8,0xa4,0xc0}, {0xf0,0xd0,0xb0}, {0xfc,0xe0,0xa8},
+	{0xf8,0xd8,0x78}, {0xd8,0xf8,0x78}, {0xb8,0xf8,0xb8}, {0xb8,0xf8,0xd8},
+	{0x00,0xfc,0xfc}, {0xf8,0xd8,0xf8}, {0x00,0x00,0x00}, {0x00,0x00,0x00},
+};
+
+/**
+ * load a .pal file as written by emulators: 64 RGB triples, optionally
+ * followed by the 7 emphasis variants, which are ignored.
+ * @returns non-zero on success
+ */
+int palette_load_nes(const char *filename, unsigned char master[PALETTE_NES_COLORS][3]) {
+	unsigned char *data;
+	size_t len;
+
+	data=map_file(filename, &len);
+	if(!data)
+		return 0;
+	if(len!=PALETTE_NES_COLORS*3 && len!=PALETTE_NES_COLORS*3*8) {
+		fprintf(stderr, "%s:not a NES palette, size %zu is not %u or %u.\n", filename, len, PALETTE_NES_COLORS*3, PALETTE_NES_COLORS*3*8);
+		unmap_file(data, len);
+		return 0;
+	}
+	memcpy(master, data, PALETTE_NES_COLORS*3);
+	unmap_file(data, len);
+	return 1;
+}
+
+/**
+ * fill pal from a comma separated list. each entry is a NES color number
+ * in hex, looked up in master, or an RGB color written as #rrggbb.
+ * the transparent index is left alone.
+ * @returns non-zero on success
+ */
+int palette_parse(struct palette *pal, const char *list, const unsigned char master[PALETTE_NES_COLORS][3]) {
+	const char *s=list;
+	char *endptr;
+	unsigned long v;
+
+	pal->count=0;
+	while(*s) {
+		if(pal->count==256) {
+			fprintf(stderr, "%s:more than 256 colors.\n", list);
+			return 0;
+		}
+		if(*s=='#') {
+			v=strtoul(s+1, &endptr, 16);
+			if(endptr-s!=7 || (*endptr && *endptr!=',')) {
+				fprintf(stderr, "%s:bad color '%.*s'.\n", list, (int)strcspn(s, ","), s);
+				return 0;
+			}
+			pal->rgb[pal->count][0]=v>>16;
+			pal->rgb[pal->count][1]=v>>8;
+			pal->rgb[pal->count][2]=v;
+		} else {
+			v=strtoul(s, &endptr, 16);
+			if(endptr==s || (*endptr && *endptr!=',') || v>=PALETTE_NES_COLORS) {
+				fprintf(stderr, "%s:bad NES color '%.*s'.\n", list, (int)strcspn(s, ","), s);
+				return 0;
+			}
+			memcpy(pal->rgb[pal->count], master[v], 3);
+		}
+		pal->count++;
+		s=*endptr ? endptr+1 : endptr;
+	}
+	if(!pal->count) {
+		fprintf(stderr, "empty color list.\n");
+		return 0;
+	}
+	return 1;
+}
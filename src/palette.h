@@ -0,0 +1,16 @@
+#ifndef PALETTE_H
+#define PALETTE_H
+#define PALETTE_NES_COLORS 64
+
+/* colors for an indexed PNG */
+struct palette {
+	unsigned count;
+	unsigned char rgb[256][3];
+	int transparent; /* index written fully transparent, -1 for none */
+};
+
+extern const unsigned char nes_palette[PALETTE_NES_COLORS][3];
+
+int palette_load_nes(const char *filename, unsigned char master[PALETTE_NES_COLORS][3]);
+int palette_parse(struct palette *pal, const char *list, const unsigned char master[PALETTE_NES_COLORS][3]);
+#endif
@@ -0,0 +1,110 @@
+/* planar.c
+ * decodes NES 2bpp planar tiles to packed 2 bit pixels.
+ *
+ * each 16 byte tile becomes 8 rows of 2 bytes with the leftmost pixel in
+ * the top bits, the layout of a 2 bit PNG row. a row is the bits of plane
+ * 0 and plane 1 interleaved, done by spreading each byte over 16 bits.
+ * the SSSE3 kernel does a tile per step, AVX2 two.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#ifdef HAVE_CPU_DISPATCH
+#include <immintrin.h>
+#endif
+
+#include "cpu.h"
+#include "planar.h"
+
+/* put the 8 bits of b in the even bits of the result */
+static inline unsigned spread(unsigned b) {
+	b=(b|b<<4)&0x0f0f;
+	b=(b|b<<2)&0x3333;
+	return (b|b<<1)&0x5555;
+}
+
+static void decode_generic(const unsigned char *src, unsigned char *dst, size_t tiles) {
+	unsigned r, v;
+
+	for(;tiles;tiles--,src+=PLANAR_TILE_SIZE,dst+=PLANAR_TILE_SIZE) {
+		for(r=0;r<8;r++) {
+			v=spread(src[r])|spread(src[r+8])<<1;
+			dst[r*2]=v>>8;
+			dst[r*2+1]=v;
+		}
+	}
+}
+
+#ifdef HAVE_CPU_DISPATCH
+#define SPREAD_SSE(v) \
+	v=_mm_and_si128(_mm_or_si128(v, _mm_slli_epi16(v, 4)), _mm_set1_epi16(0x0f0f)); \
+	v=_mm_and_si128(_mm_or_si128(v, _mm_slli_epi16(v, 2)), _mm_set1_epi16(0x3333)); \
+	v=_mm_and_si128(_mm_or_si128(v, _mm_slli_epi16(v, 1)), _mm_set1_epi16(0x5555))
+
+__attribute__((target("ssse3")))
+static void decode_ssse3(const unsigned char *src, unsigned char *dst, size_t tiles) {
+	/* widen plane 0 and plane 1 rows to 16 bits */
+	const __m128i plane0=_mm_setr_epi8(0, -1, 1, -1, 2, -1, 3, -1, 4, -1, 5, -1, 6, -1, 7, -1);
+	const __m128i plane1=_mm_setr_epi8(8, -1, 9, -1, 10, -1, 11, -1, 12, -1, 13, -1, 14, -1, 15, -1);
+	/* high byte of each row first */
+	const __m128i swap=_mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	__m128i t, a, b;
+
+	for(;tiles;tiles--,src+=PLANAR_TILE_SIZE,dst+=PLANAR_TILE_SIZE) {
+		t=_mm_loadu_si128((const __m128i*)src);
+		a=_mm_shuffle_epi8(t, plane0);
+		b=_mm_shuffle_epi8(t, plane1);
+		SPREAD_SSE(a);
+		SPREAD_SSE(b);
+		t=_mm_or_si128(a, _mm_slli_epi16(b, 1));
+		_mm_storeu_si128((__m128i*)dst, _mm_shuffle_epi8(t, swap));
+	}
+}
+
+#define SPREAD_AVX(v) \
+	v=_mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi16(v, 4)), _mm256_set1_epi16(0x0f0f)); \
+	v=_mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi16(v, 2)), _mm256_set1_epi16(0x3333)); \
+	v=_mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi16(v, 1)), _mm256_set1_epi16(0x5555))
+
+/* the same, a tile in each 128-bit lane */
+__attribute__((target("avx2")))
+static void decode_avx2(const unsigned char *src, unsigned char *dst, size_t tiles) {
+	const __m256i plane0=_mm256_setr_epi8(0, -1, 1, -1, 2, -1, 3, -1, 4, -1, 5, -1, 6, -1, 7, -1,
+		0, -1, 1, -1, 2, -1, 3, -1, 4, -1, 5, -1, 6, -1, 7, -1);
+	const __m256i plane1=_mm256_setr_epi8(8, -1, 9, -1, 10, -1, 11, -1, 12, -1, 13, -1, 14, -1, 15, -1,
+		8, -1, 9, -1, 10, -1, 11, -1, 12, -1, 13, -1, 14, -1, 15, -1);
+	const __m256i swap=_mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+		1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	__m256i t, a, b;
+
+	for(;tiles>=2;tiles-=2,src+=PLANAR_TILE_SIZE*2,dst+=PLANAR_TILE_SIZE*2) {
+		t=_mm256_loadu_si256((const __m256i*)src);
+		a=_mm256_shuffle_epi8(t, plane0);
+		b=_mm256_shuffle_epi8(t, plane1);
+		SPREAD_AVX(a);
+		SPREAD_AVX(b);
+		t=_mm256_or_si256(a, _mm256_slli_epi16(b, 1));
+		_mm256_storeu_si256((__m256i*)dst, _mm256_shuffle_epi8(t, swap));
+	}
+	if(tiles)
+		decode_ssse3(src, dst, tiles);
+}
+#endif
+
+static void (*decode_kernel)(const unsigned char *src, unsigned char *dst, size_t tiles)=decode_generic;
+
+__attribute__((constructor))
+static void planar_select(void) {
+#ifdef HAVE_CPU_DISPATCH
+	unsigned features=cpu_features();
+
+	if(features&CPU_AVX2)
+		decode_kernel=decode_avx2;
+	else if(features&CPU_SSSE3)
+		decode_kernel=decode_ssse3;
+#endif
+}
+
+/* decode tiles from src into dst, 16 bytes each */
+void planar_decode_2bpp(const unsigned char *src, unsigned char *dst, size_t tiles) {
+	decode_kernel(src, dst, tiles);
+}
@@ -0,0 +1,67 @@
+/* planar.h
+ * helpers for NES 2bpp planar tiles held as 64-bit words.
+ *
+ * a tile is 16 bytes: 8 rows of plane 0 then 8 rows of plane 1. each plane
+ * is loaded little-endian, so row n is byte n of the word and the leftmost
+ * pixel of a row is its most significant bit.
+ */
+#ifndef PLANAR_H
+#define PLANAR_H
+#include <stddef.h>
+#include <stdint.h>
+
+#define PLANAR_TILE_SIZE 16
+
+/* bytes 0-6 of a plane, the rows that have a row below them */
+#define PLANAR_UPPER_ROWS 0x00ffffffffffffffull
+
+static inline uint64_t planar_load(const unsigned char *p) {
+	return (uint64_t)p[0]|((uint64_t)p[1]<<8)|((uint64_t)p[2]<<16)|((uint64_t)p[3]<<24)
+		|((uint64_t)p[4]<<32)|((uint64_t)p[5]<<40)|((uint64_t)p[6]<<48)|((uint64_t)p[7]<<56);
+}
+
+static inline void planar_store(unsigned char *p, uint64_t v) {
+	unsigned i;
+
+	for(i=0;i<8;i++)
+		p[i]=v>>(i*8);
+}
+
+static inline unsigned planar_popcount(uint64_t v) {
+	return __builtin_popcountll(v);
+}
+
+/* bits that change from each row to the next, 7 rows worth */
+static inline uint64_t planar_row_changes(uint64_t plane) {
+	return (plane^(plane>>8))&PLANAR_UPPER_ROWS;
+}
+
+/* mirror left to right: reverse the bits of every row */
+static inline uint64_t planar_hflip(uint64_t plane) {
+	plane=(plane&0xf0f0f0f0f0f0f0f0ull)>>4|(plane&0x0f0f0f0f0f0f0f0full)<<4;
+	plane=(plane&0xccccccccccccccccull)>>2|(plane&0x3333333333333333ull)<<2;
+	return (plane&0xaaaaaaaaaaaaaaaaull)>>1|(plane&0x5555555555555555ull)<<1;
+}
+
+/* mirror top to bottom: reverse the rows */
+static inline uint64_t planar_vflip(uint64_t plane) {
+	return __builtin_bswap64(plane);
+}
+
+/* mirror across the diagonal from top right to bottom left, an 8x8 bit
+ * matrix transpose in three rounds of swapping 1x1, 2x2 and 4x4 blocks.
+ * the rows hold the leftmost pixel in the top bit, so this is the
+ * anti-diagonal for pixels. */
+static inline uint64_t planar_antitranspose(uint64_t plane) {
+	uint64_t t;
+
+	t=(plane^(plane>>7))&0x00aa00aa00aa00aaull;
+	plane^=t^(t<<7);
+	t=(plane^(plane>>14))&0x0000cccc0000ccccull;
+	plane^=t^(t<<14);
+	t=(plane^(plane>>28))&0x00000000f0f0f0f0ull;
+	return plane^t^(t<<28);
+}
+
+void planar_decode_2bpp(const unsigned char *src, unsigned char *dst, size_t tiles);
+#endif
@@ -2,10 +2,18 @@
  *
  */
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <setjmp.h>
+#include <time.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
+#include "chrcodec.h"
 #include "image.h"
 #include "log.h"
 
@@ -38,6 +46,8 @@ struct prog_opts
 	int out_bpp;
 	int tile_w, tile_h;
 	const char *out_filename;
+	int watch_fl;
+	int codec;
 };
 
 /*
@@ -47,13 +57,15 @@ static void
 usage(void)
 {
 	fprintf(stderr, 
-		"usage: pngtochr [-hv] [-b <bbp>] [-o <f>] [-t <NxM>] [file ...]\n"
+		"usage: pngtochr [-hvW] [-b <bbp>] [-o <f>] [-t <NxM>] [-z <codec>] [file ...]\n"
 	);
 
 	fprintf(stderr,
 		"-b <bbp>    bits per pixel for output file (default " TOSTR(DEFAULT_BPP) ").\n"
 		"-o <f>      output file (default '" DEFAULT_OUTFILE "').\n"
 		"-t <NxM>    size of tile (default " TOSTR(DEFAULT_W) "x" TOSTR(DEFAULT_H) ").\n"
+		"-W          keep watching the PNG and rewrite only the tiles that change.\n"
+		"-z <codec>  compress the output with rle, lzss or tile (default none).\n"
 	);
 }
 
@@ -67,7 +79,7 @@ parse_args(struct prog_opts *po, int argc, char **argv)
 	const char *tmp;
 	char *endptr;
 
-	while ((c=getopt(argc, argv, "hvb:o:t:"))>0)
+	while ((c=getopt(argc, argv, "hvWb:o:t:z:"))>0)
 	{
 		switch (c)
 		{
@@ -77,6 +89,9 @@ parse_args(struct prog_opts *po, int argc, char **argv)
 			case 'v':
 				po->verbose_fl++;
 				break;
+			case 'W':
+				po->watch_fl=1;
+				break;
 			case 'b':
 				po->out_bpp=strtoul(optarg, &endptr, 10);
 				if (*endptr)
@@ -89,6 +104,15 @@ parse_args(struct prog_opts *po, int argc, char **argv)
 			case 'o':
 				po->out_filename=optarg;
 				break;
+			case 'z':
+				po->codec=codec_lookup(optarg);
+				if (po->codec<0)
+				{
+					fprintf(stderr, "Error: unknown codec '%s'.\n", optarg);
+					usage();
+					return 0;
+				}
+				break;
 			case 't':
 				po->tile_w=strtoul(optarg, &endptr, 10);
 				if (*endptr=='x' || *endptr=='X' || *endptr==',')
@@ -112,6 +136,196 @@ parse_args(struct prog_opts *po, int argc, char **argv)
 	return 1; /* success */
 }
 
+/*
+ * convert the image to CHR in memory, compress it and write it out.
+ */
+static int
+save_compressed(const struct prog_opts *po, struct image *img)
+{
+	unsigned char *chr, *out;
+	size_t chr_len, out_len;
+	FILE *f;
+	int ok;
+
+	chr=image_to_chr(po->out_filename, img, po->tile_w, po->tile_h, &chr_len);
+	if (!chr)
+	{
+		return 0;
+	}
+	out=codec_compress(po->codec, po->out_filename, chr, chr_len, &out_len);
+	free(chr);
+	if (!out)
+	{
+		return 0;
+	}
+	f=fopen(po->out_filename, "wb");
+	if (!f)
+	{
+		perror(po->out_filename);
+		free(out);
+		return 0;
+	}
+	ok=fwrite(out, 1, out_len, f)==out_len;
+	if (fclose(f) || !ok)
+	{
+		perror(po->out_filename);
+		ok=0;
+	}
+	free(out);
+	if (ok && po->verbose_fl)
+	{
+		fprintf(stderr, "%s: %zu bytes, %s %zu bytes (%.1f%%)\n",
+			po->out_filename, chr_len, codec_name(po->codec), out_len,
+			chr_len?100.0*out_len/chr_len:0.0);
+	}
+	return ok;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/*
+ * wait until filename is written or renamed into place. the directory is
+ * watched, since editors often save to a new file and rename it.
+ */
+static int
+wait_for_change(int notify_fd, const char *base)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+	int changed=0;
+
+	while (!changed)
+	{
+		len=read(notify_fd, buf, sizeof buf);
+		if (len<0 && errno==EINTR)
+		{
+			continue;
+		}
+		if (len<=0)
+		{
+			perror("inotify");
+			return 0;
+		}
+		for (p=buf; p<buf+len; p+=sizeof *ev+ev->len)
+		{
+			ev=(const struct inotify_event*)p;
+			if (ev->len && !strcmp(ev->name, base))
+			{
+				changed=1;
+			}
+		}
+	}
+	return 1;
+}
+
+static double
+elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec-start->tv_sec)*1e3+(now.tv_nsec-start->tv_nsec)/1e6;
+}
+
+/*
+ * watch filename and keep the CHR file up to date. img holds the image the
+ * CHR file was made from and is replaced on each change.
+ */
+static int
+watch(const struct prog_opts *po, const char *filename, struct image *img)
+{
+	char dir[512];
+	const char *base;
+	struct image next;
+	struct timespec start;
+	int notify_fd, out_fd;
+	long count;
+
+	base=strrchr(filename, '/');
+	if (base)
+	{
+		if ((size_t)(base-filename)+1>sizeof dir)
+		{
+			fprintf(stderr, "%s:name too long\n", filename);
+			return 0;
+		}
+		if (base==filename)
+		{
+			strcpy(dir, "/");
+		}
+		else
+		{
+			memcpy(dir, filename, base-filename);
+			dir[base-filename]=0;
+		}
+		base++;
+	}
+	else
+	{
+		strcpy(dir, ".");
+		base=filename;
+	}
+
+	notify_fd=inotify_init1(IN_CLOEXEC);
+	if (notify_fd<0)
+	{
+		perror("inotify_init1()");
+		return 0;
+	}
+	if (inotify_add_watch(notify_fd, dir, IN_CLOSE_WRITE|IN_MOVED_TO)<0)
+	{
+		perror(dir);
+		close(notify_fd);
+		return 0;
+	}
+	out_fd=open(po->out_filename, O_WRONLY);
+	if (out_fd<0)
+	{
+		perror(po->out_filename);
+		close(notify_fd);
+		return 0;
+	}
+
+	fprintf(stderr, "watching '%s'\n", filename);
+	while (wait_for_change(notify_fd, base))
+	{
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (!load_png(filename, &next))
+		{
+			fprintf(stderr, "Could not load image '%s'\n", filename);
+			continue; /* keep the last good image */
+		}
+		if (next.xres!=img->xres || next.yres!=img->yres || next.bpp!=img->bpp)
+		{
+			/* the tile slots moved, start over */
+			if (!save_chr(po->out_filename, &next, po->tile_w, po->tile_h))
+			{
+				fprintf(stderr, "Could not save image '%s'\n", po->out_filename);
+				image_destroy(&next);
+				continue;
+			}
+			fprintf(stderr, "%s:size changed, rewrote all tiles (%.2f ms)\n", filename, elapsed_ms(&start));
+		}
+		else
+		{
+			count=update_chr(po->out_filename, out_fd, img, &next, po->tile_w, po->tile_h);
+			if (count<0)
+			{
+				image_destroy(&next);
+				continue;
+			}
+			fprintf(stderr, "%s:%ld tiles updated (%.2f ms)\n", filename, count, elapsed_ms(&start));
+		}
+		image_destroy(img);
+		*img=next;
+	}
+	close(out_fd);
+	close(notify_fd);
+	return 0;
+}
+#endif
+
 /*
  * main
  */
@@ -128,6 +342,8 @@ main(int argc, char **argv)
 	prog_opts.tile_h=DEFAULT_H;
 	prog_opts.out_bpp=DEFAULT_BPP;
 	prog_opts.out_filename=DEFAULT_OUTFILE;
+	prog_opts.watch_fl=0;
+	prog_opts.codec=CODEC_NONE;
 
 	/* load command-line configuration */
 	if (!parse_args(&prog_opts, argc, argv))
@@ -137,6 +353,12 @@ main(int argc, char **argv)
 
 	TRACE("opts: %ux%u@%u '%s'\n", prog_opts.tile_w, prog_opts.tile_h, prog_opts.out_bpp, prog_opts.out_filename);
 
+	if (prog_opts.watch_fl && prog_opts.codec!=CODEC_NONE)
+	{
+		fprintf(stderr, "-W can not be used with -z.\n");
+		return EXIT_FAILURE;
+	}
+
 	if (optind >= argc)
 	{
 		usage();
@@ -157,11 +379,23 @@ main(int argc, char **argv)
 			fprintf(stderr, "Could not load image '%s'\n", argv[i]);
 			return EXIT_FAILURE;
 		}
-		if (!save_chr(prog_opts.out_filename, &curr_img, prog_opts.tile_w, prog_opts.tile_h))
+		if (prog_opts.codec!=CODEC_NONE
+			? !save_compressed(&prog_opts, &curr_img)
+			: !save_chr(prog_opts.out_filename, &curr_img, prog_opts.tile_w, prog_opts.tile_h))
 		{
 			fprintf(stderr, "Could not save image '%s'\n", prog_opts.out_filename);
 			return EXIT_FAILURE;
 		}
+		if (prog_opts.watch_fl)
+		{
+#ifdef HAVE_SYS_INOTIFY_H
+			watch(&prog_opts, argv[i], &curr_img);
+#else
+			fprintf(stderr, "-W is not supported on this system.\n");
+#endif
+			image_destroy(&curr_img);
+			return EXIT_FAILURE;
+		}
 		image_destroy(&curr_img);
 	}
 
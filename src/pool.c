@@ -0,0 +1,84 @@
+/* pool.c
+ * a minimal worker pool: threads pull job indexes from a shared counter
+ * until all count jobs are taken. The calling thread works too.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "pool.h"
+
+struct pool {
+	pthread_mutex_t lock;
+	unsigned next, count;
+	void (*job)(void *arg, unsigned index);
+	void *arg;
+};
+
+/**
+ * @returns the number of online processors, at least 1.
+ */
+unsigned pool_threads(void) {
+	long n;
+
+	n=sysconf(_SC_NPROCESSORS_ONLN);
+	return n>0?(unsigned)n:1;
+}
+
+static void *pool_worker(void *p) {
+	struct pool *pool=p;
+	unsigned index;
+
+	for(;;) {
+		pthread_mutex_lock(&pool->lock);
+		index=pool->next;
+		if(index<pool->count)
+			pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if(index>=pool->count)
+			break;
+		pool->job(pool->arg, index);
+	}
+	return NULL;
+}
+
+/**
+ * call job(arg, i) for every i in 0..count-1 on up to threads threads.
+ * @returns 0 after all jobs finished. if threads cannot be started the
+ * remaining jobs still run on the calling thread.
+ */
+int pool_run(unsigned threads, unsigned count, void (*job)(void *arg, unsigned index), void *arg) {
+	struct pool pool;
+	pthread_t *tids;
+	unsigned i, started=0;
+	int e;
+
+	if(threads>count) threads=count;
+	if(threads<1) threads=1;
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pool.next=0;
+	pool.count=count;
+	pool.job=job;
+	pool.arg=arg;
+
+	tids=calloc(threads, sizeof *tids);
+	for(i=1;tids && i<threads;i++) {
+		e=pthread_create(&tids[started], NULL, pool_worker, &pool);
+		if(e) {
+			fprintf(stderr, "pthread_create():%s\n", strerror(e));
+			break;
+		}
+		started++;
+	}
+
+	pool_worker(&pool);
+
+	for(i=0;i<started;i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+	pthread_mutex_destroy(&pool.lock);
+
+	return 0;
+}
@@ -0,0 +1,8 @@
+/* pool.h
+ * run numbered jobs on a set of worker threads.
+ */
+#ifndef POOL_H
+#define POOL_H
+unsigned pool_threads(void);
+int pool_run(unsigned threads, unsigned count, void (*job)(void *arg, unsigned index), void *arg);
+#endif
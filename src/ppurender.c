@@ -0,0 +1,296 @@
+/* ppurender.c
+ * renders the background of PPU memory dumps to PNG.
+ *
+ * a dump is the 16K PPU address space as an emulator saves it: pattern
+ * tables at $0000, the four nametables (already mirrored) at $2000 and
+ * palette RAM at $3F00.
+ *
+ * the 512 tiles of the pattern tables are decoded once into a cache of
+ * one byte per pixel. dumps with the same pattern tables share a cache, so
+ * a run of frames from a CHR-ROM game decodes its tiles only once. a frame
+ * is then 960 tile copies per nametable, each through a 4 entry table
+ * that applies the palette picked by the attribute byte. caches and frames
+ * are both built on worker threads.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hash64.h"
+#include "image.h"
+#include "palette.h"
+#include "pool.h"
+#include "util.h"
+
+#define PROG_NAME "ppurender"
+#define DUMP_SIZE 0x4000
+#define PATTERN_SIZE 0x2000
+#define NAMETABLE_ADDR 0x2000
+#define NAMETABLE_SIZE 0x400
+#define PALETTE_ADDR 0x3f00
+#define TILE_COUNT 512
+#define NT_COLUMNS 32
+#define NT_ROWS 30
+
+/* pattern tables decoded to one color (0-3) per byte */
+struct tile_cache {
+	unsigned char pixels[TILE_COUNT][64];
+	int failed;
+};
+
+struct frame {
+	const char *filename;
+	unsigned char *data;
+	size_t len;
+	uint64_t hash; /* of the pattern tables */
+	unsigned cache; /* index into caches */
+	int failed;
+};
+
+static struct frame *frames;
+static unsigned frame_count;
+static struct tile_cache *caches;
+static unsigned *cache_frame; /* a frame that holds each cache's tiles */
+static unsigned cache_count;
+static unsigned bg_table, nametable, all_fl;
+static unsigned char master[PALETTE_NES_COLORS][3];
+
+static void decode_job(void *arg __attribute__((unused)), unsigned index) {
+	const struct frame *f=&frames[cache_frame[index]];
+	struct tile_cache *c=&caches[index];
+	struct image img;
+	unsigned t, x, y;
+
+	/* the planar decoder lays the tiles out in a column */
+	if(!load_chr_data(f->filename, f->data, PATTERN_SIZE, &img, 8, 8, 2, 1)) {
+		c->failed=1;
+		return;
+	}
+	for(t=0;t<TILE_COUNT;t++)
+		for(y=0;y<8;y++)
+			for(x=0;x<8;x++)
+				c->pixels[t][y*8+x]=image_get_pixel(&img, x, t*8+y);
+	image_destroy(&img);
+}
+
+/* draw one nametable at ox, oy of an 8bpp image */
+static void draw_nametable(struct image *img, unsigned ox, unsigned oy, const unsigned char *nt, const unsigned char (*tiles)[64]) {
+	const unsigned char *attr=nt+NT_COLUMNS*NT_ROWS;
+	unsigned col, row, y, i;
+
+	for(row=0;row<NT_ROWS;row++) {
+		for(col=0;col<NT_COLUMNS;col++) {
+			const unsigned char *src=tiles[nt[row*NT_COLUMNS+col]];
+			unsigned char lut[4], *dest;
+			unsigned pal;
+
+			/* each attribute byte covers 4x4 tiles, 2 bits per 2x2 */
+			pal=(attr[(row/4)*8+col/4]>>(((row&2)<<1)|(col&2)))&3;
+			lut[0]=0; /* color 0 is always the backdrop */
+			lut[1]=pal*4+1;
+			lut[2]=pal*4+2;
+			lut[3]=pal*4+3;
+
+			dest=img->image_data+(oy+row*8)*img->rowbytes+ox+col*8;
+			for(y=0;y<8;y++,src+=8,dest+=img->rowbytes)
+				for(i=0;i<8;i++)
+					dest[i]=lut[src[i]];
+		}
+	}
+}
+
+static void render_job(void *arg __attribute__((unused)), unsigned index) {
+	struct frame *f=&frames[index];
+	const unsigned char (*tiles)[64]=caches[f->cache].pixels+bg_table*256;
+	const unsigned char *ram=f->data+PALETTE_ADDR;
+	char out_filename[512];
+	struct palette pal;
+	struct image img;
+	unsigned i;
+
+	if(caches[f->cache].failed) {
+		f->failed=1;
+		return;
+	}
+	if(!make_file_name(out_filename, sizeof out_filename, f->filename, ".png")) {
+		fprintf(stderr, "%s:name too long\n", f->filename);
+		f->failed=1;
+		return;
+	}
+
+	/* background palettes, through the backdrop color where hardware does */
+	pal.count=16;
+	pal.transparent=-1;
+	for(i=0;i<16;i++)
+		memcpy(pal.rgb[i], master[ram[i%4 ? i : 0]&0x3f], 3);
+
+	if(!image_create(&img, all_fl ? 512 : 256, all_fl ? 480 : 240, 8, 0)) {
+		f->failed=1;
+		return;
+	}
+	if(all_fl) {
+		for(i=0;i<4;i++)
+			draw_nametable(&img, (i&1)*256, (i>>1)*240, f->data+NAMETABLE_ADDR+i*NAMETABLE_SIZE, tiles);
+	} else {
+		draw_nametable(&img, 0, 0, f->data+NAMETABLE_ADDR+nametable*NAMETABLE_SIZE, tiles);
+	}
+	if(!save_png_indexed(out_filename, &img, &pal))
+		f->failed=1;
+	image_destroy(&img);
+}
+
+static int hash_cmp(const void *a, const void *b) {
+	const struct frame *x=&frames[*(const unsigned*)a], *y=&frames[*(const unsigned*)b];
+
+	if(x->hash!=y->hash)
+		return x->hash<y->hash?-1:1;
+	return *(const unsigned*)a<*(const unsigned*)b?-1:1;
+}
+
+/* give each distinct set of pattern tables one cache */
+static int assign_caches(void) {
+	unsigned *order, i;
+
+	order=malloc(frame_count*sizeof *order);
+	cache_frame=malloc(frame_count*sizeof *cache_frame);
+	if(!order || !cache_frame) {
+		perror("malloc()");
+		free(order);
+		return 0;
+	}
+	for(i=0;i<frame_count;i++) {
+		frames[i].hash=hash64(frames[i].data, PATTERN_SIZE, 0);
+		order[i]=i;
+	}
+	qsort(order, frame_count, sizeof *order, hash_cmp);
+
+	cache_count=0;
+	for(i=0;i<frame_count;i++) {
+		struct frame *f=&frames[order[i]];
+		const struct frame *prev=cache_count ? &frames[cache_frame[cache_count-1]] : NULL;
+
+		if(!prev || prev->hash!=f->hash || memcmp(prev->data, f->data, PATTERN_SIZE))
+			cache_frame[cache_count++]=order[i];
+		f->cache=cache_count-1;
+	}
+	free(order);
+
+	caches=calloc(cache_count, sizeof *caches);
+	if(!caches) {
+		perror("calloc()");
+		return 0;
+	}
+	return 1;
+}
+
+static void usage(void) {
+	fprintf(stderr,
+		"usage: " PROG_NAME " [-v4] [-b <0|1>] [-n <0-3>] [-p <pal>] [-j <n>] <dump>...\n"
+	);
+
+	fprintf(stderr,
+		"-b <0|1>    pattern table of the background (default 0).\n"
+		"-n <0-3>    nametable to render (default 0).\n"
+		"-4          render all four nametables as one 512x480 image.\n"
+		"-p <pal>    NES palette file (default is built in).\n"
+		"-j <n>      threads (default is one per processor).\n"
+		"-v          verbose.\n"
+		"each 16K dump of PPU memory is written to a PNG of the same name.\n"
+	);
+}
+
+int main(int argc, char **argv) {
+	unsigned threads=pool_threads(), i;
+	int c, verbose_fl=0, ret=EXIT_FAILURE;
+	char *endptr;
+
+	memcpy(master, nes_palette, sizeof master);
+	while((c=getopt(argc, argv, "hv4b:n:p:j:"))!=-1) {
+		switch(c) {
+			case 'v':
+				verbose_fl++;
+				break;
+			case '4':
+				all_fl=1;
+				break;
+			case 'b':
+				bg_table=strtoul(optarg, &endptr, 10);
+				if(*endptr || bg_table>1) {
+					fprintf(stderr, "Error: -b takes 0 or 1.\n");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'n':
+				nametable=strtoul(optarg, &endptr, 10);
+				if(*endptr || nametable>3) {
+					fprintf(stderr, "Error: -n takes 0 to 3.\n");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'p':
+				if(!palette_load_nes(optarg, master))
+					return EXIT_FAILURE;
+				break;
+			case 'j':
+				threads=strtoul(optarg, &endptr, 10);
+				if(*endptr || !threads) {
+					fprintf(stderr, "Error: -j takes a positive number.\n");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'h':
+			default:
+				usage();
+				return EXIT_FAILURE;
+		}
+	}
+	if(optind==argc) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	frames=calloc(argc-optind, sizeof *frames);
+	if(!frames) {
+		perror("calloc()");
+		return EXIT_FAILURE;
+	}
+	for(i=optind;i<(unsigned)argc;i++) {
+		struct frame *f=&frames[frame_count];
+
+		f->filename=argv[i];
+		f->data=map_file(f->filename, &f->len);
+		if(!f->data)
+			goto done;
+		frame_count++;
+		if(f->len!=DUMP_SIZE) {
+			fprintf(stderr, "%s:size %zu is not a %u byte PPU dump.\n", f->filename, f->len, DUMP_SIZE);
+			goto done;
+		}
+	}
+
+	if(!assign_caches())
+		goto done;
+	if(verbose_fl)
+		fprintf(stderr, "%u frames, %u sets of pattern tables\n", frame_count, cache_count);
+	if(pool_run(threads, cache_count, decode_job, NULL))
+		goto done;
+	if(pool_run(threads, frame_count, render_job, NULL))
+		goto done;
+
+	ret=EXIT_SUCCESS;
+	for(i=0;i<frame_count;i++) {
+		if(frames[i].failed) {
+			fprintf(stderr, "Could not render '%s'\n", frames[i].filename);
+			ret=EXIT_FAILURE;
+		}
+	}
+done:
+	for(i=0;i<frame_count;i++)
+		unmap_file(frames[i].data, frames[i].len);
+	free(frames);
+	free(caches);
+	free(cache_frame);
+	return ret;
+}
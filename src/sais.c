@@ -0,0 +1,310 @@
+/* sais.c
+ * suffix array construction by induced sorting (SA-IS).
+ *
+ * Nong, Zhang and Chan, "Two Efficient Algorithms for Linear Time Suffix
+ * Array Construction", 2011. This file is derived from Yuta Mori's
+ * sais-lite, cut down to the suffix array construction bpsdiff uses:
+ * bucket arrays are carved out of the free space in SA where possible,
+ * and the reduced problem is solved recursively in place, so the work
+ * space beyond SA itself is a few bucket arrays.
+ *
+ * sais-lite carries the following notice:
+ *
+ * Copyright (c) 2008-2010 Yuta Mori All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include "sais.h"
+
+#define MINBUCKETSIZE 256
+
+/* T is either the input bytes (cs 1) or a reduced string of int32_t */
+#define chr(i) (cs==sizeof(int32_t)?((const int32_t *)T)[i]:((const unsigned char *)T)[i])
+
+static void get_counts(const void *T, int32_t *C, int32_t n, int32_t k, int cs) {
+	int32_t i;
+	for(i=0;i<k;i++) C[i]=0;
+	for(i=0;i<n;i++) C[chr(i)]++;
+}
+
+static void get_buckets(const int32_t *C, int32_t *B, int32_t k, int end) {
+	int32_t i, sum=0;
+	if(end) {
+		for(i=0;i<k;i++) { sum+=C[i]; B[i]=sum; }
+	} else {
+		for(i=0;i<k;i++) { sum+=C[i]; B[i]=sum-C[i]; }
+	}
+}
+
+/* sort all LMS-substrings */
+static void lms_sort(const void *T, int32_t *SA, int32_t *C, int32_t *B, int32_t n, int32_t k, int cs) {
+	int32_t *b, i, j, c0, c1;
+
+	/* compute SAl */
+	if(C==B) get_counts(T, C, n, k, cs);
+	get_buckets(C, B, k, 0); /* find starts of buckets */
+	j=n-1;
+	b=SA+B[c1=chr(j)];
+	j--;
+	*b++=(chr(j)<c1)?~j:j;
+	for(i=0;i<n;i++) {
+		if(0<(j=SA[i])) {
+			if((c0=chr(j))!=c1) { B[c1]=b-SA; b=SA+B[c1=c0]; }
+			j--;
+			*b++=(chr(j)<c1)?~j:j;
+			SA[i]=0;
+		} else if(j<0) {
+			SA[i]=~j;
+		}
+	}
+
+	/* compute SAs */
+	if(C==B) get_counts(T, C, n, k, cs);
+	get_buckets(C, B, k, 1); /* find ends of buckets */
+	for(i=n-1,b=SA+B[c1=0];0<=i;i--) {
+		if(0<(j=SA[i])) {
+			if((c0=chr(j))!=c1) { B[c1]=b-SA; b=SA+B[c1=c0]; }
+			j--;
+			*--b=(chr(j)>c1)?~(j+1):j;
+			SA[i]=0;
+		}
+	}
+}
+
+/* compact the sorted LMS-substrings and give each a name.
+ * @returns number of distinct names */
+static int32_t lms_postproc(const void *T, int32_t *SA, int32_t n, int32_t m, int cs) {
+	int32_t i, j, p, q, plen, qlen, name, c0, c1;
+	int diff;
+
+	/* compact all the sorted substrings into the first m items of SA.
+	 * 2*m is never larger than n. */
+	for(i=0;(p=SA[i])<0;i++) SA[i]=~p;
+	if(i<m) {
+		for(j=i,i++;;i++) {
+			if((p=SA[i])<0) {
+				SA[j++]=~p;
+				SA[i]=0;
+				if(j==m) break;
+			}
+		}
+	}
+
+	/* store the length of all substrings */
+	i=n-1; j=n-1; c0=chr(n-1);
+	do { c1=c0; } while((0<=--i) && ((c0=chr(i))>=c1));
+	while(0<=i) {
+		do { c1=c0; } while((0<=--i) && ((c0=chr(i))<=c1));
+		if(0<=i) {
+			SA[m+((i+1)>>1)]=j-i;
+			j=i+1;
+			do { c1=c0; } while((0<=--i) && ((c0=chr(i))>=c1));
+		}
+	}
+
+	/* find the lexicographic names of all substrings */
+	for(i=0,name=0,q=n,qlen=0;i<m;i++) {
+		p=SA[i];
+		plen=SA[m+(p>>1)];
+		diff=1;
+		if(plen==qlen && q+plen<n) {
+			for(j=0;j<plen && chr(p+j)==chr(q+j);j++) ;
+			if(j==plen) diff=0;
+		}
+		if(diff) { name++; q=p; qlen=plen; }
+		SA[m+(p>>1)]=name;
+	}
+
+	return name;
+}
+
+static void induce_sa(const void *T, int32_t *SA, int32_t *C, int32_t *B, int32_t n, int32_t k, int cs) {
+	int32_t *b, i, j, c0, c1;
+
+	/* compute SAl */
+	if(C==B) get_counts(T, C, n, k, cs);
+	get_buckets(C, B, k, 0); /* find starts of buckets */
+	j=n-1;
+	b=SA+B[c1=chr(j)];
+	*b++=((0<j) && (chr(j-1)<c1))?~j:j;
+	for(i=0;i<n;i++) {
+		j=SA[i];
+		SA[i]=~j;
+		if(0<j) {
+			j--;
+			if((c0=chr(j))!=c1) { B[c1]=b-SA; b=SA+B[c1=c0]; }
+			*b++=((0<j) && (chr(j-1)<c1))?~j:j;
+		}
+	}
+
+	/* compute SAs */
+	if(C==B) get_counts(T, C, n, k, cs);
+	get_buckets(C, B, k, 1); /* find ends of buckets */
+	for(i=n-1,b=SA+B[c1=0];0<=i;i--) {
+		if(0<(j=SA[i])) {
+			j--;
+			if((c0=chr(j))!=c1) { B[c1]=b-SA; b=SA+B[c1=c0]; }
+			*--b=((j==0) || (chr(j-1)>c1))?~j:j;
+		} else {
+			SA[i]=~j;
+		}
+	}
+}
+
+/* fs is the number of free entries at the end of SA, k the alphabet size */
+static int sais_main(const void *T, int32_t *SA, int32_t fs, int32_t n, int32_t k, int cs) {
+	int32_t *C, *B, *RA, *b;
+	int32_t i, j, m, p, q, t, name, newfs, c0, c1;
+	unsigned flags;
+
+	if(k<=MINBUCKETSIZE) {
+		if(!(C=malloc(k*sizeof *C))) return -2;
+		if(k<=fs) {
+			B=SA+(n+fs-k);
+			flags=1;
+		} else {
+			if(!(B=malloc(k*sizeof *B))) { free(C); return -2; }
+			flags=3;
+		}
+	} else if(k<=fs) {
+		C=SA+(n+fs-k);
+		if(k<=fs-k) {
+			B=C-k;
+			flags=0;
+		} else if(k<=MINBUCKETSIZE*4) {
+			if(!(B=malloc(k*sizeof *B))) return -2;
+			flags=2;
+		} else {
+			B=C;
+			flags=8;
+		}
+	} else {
+		if(!(C=B=malloc(k*sizeof *C))) return -2;
+		flags=4|8;
+	}
+
+	/* stage 1: reduce the problem by at least 1/2, sort all the LMS-substrings */
+	get_counts(T, C, n, k, cs);
+	get_buckets(C, B, k, 1); /* find ends of buckets */
+	for(i=0;i<n;i++) SA[i]=0;
+	b=&t; i=n-1; j=n; m=0; c0=chr(n-1);
+	do { c1=c0; } while((0<=--i) && ((c0=chr(i))>=c1));
+	while(0<=i) {
+		do { c1=c0; } while((0<=--i) && ((c0=chr(i))<=c1));
+		if(0<=i) {
+			*b=j;
+			b=SA+--B[c1];
+			j=i;
+			m++;
+			do { c1=c0; } while((0<=--i) && ((c0=chr(i))>=c1));
+		}
+	}
+
+	if(1<m) {
+		lms_sort(T, SA, C, B, n, k, cs);
+		name=lms_postproc(T, SA, n, m, cs);
+	} else if(m==1) {
+		*b=j+1;
+		name=1;
+	} else {
+		name=0;
+	}
+
+	/* stage 2: solve the reduced problem, recurse if names are not yet unique */
+	if(name<m) {
+		if(flags&4) free(C);
+		if(flags&2) free(B);
+		newfs=(n+fs)-(m*2);
+		if((flags&(1|4|8))==0) {
+			if(k+name<=newfs) newfs-=k;
+			else flags|=8;
+		}
+		RA=SA+m+newfs;
+		for(i=m+(n>>1)-1,j=m-1;m<=i;i--) {
+			if(SA[i]!=0) RA[j--]=SA[i]-1;
+		}
+		if(sais_main(RA, SA, newfs, m, name, sizeof(int32_t))!=0) {
+			if(flags&1) free(C);
+			return -2;
+		}
+
+		i=n-1; j=m-1; c0=chr(n-1);
+		do { c1=c0; } while((0<=--i) && ((c0=chr(i))>=c1));
+		while(0<=i) {
+			do { c1=c0; } while((0<=--i) && ((c0=chr(i))<=c1));
+			if(0<=i) {
+				RA[j--]=i+1;
+				do { c1=c0; } while((0<=--i) && ((c0=chr(i))>=c1));
+			}
+		}
+		for(i=0;i<m;i++) SA[i]=RA[SA[i]];
+
+		if(flags&4) {
+			if(!(C=B=malloc(k*sizeof *C))) return -2;
+		}
+		if(flags&2) {
+			if(!(B=malloc(k*sizeof *B))) {
+				if(flags&1) free(C);
+				return -2;
+			}
+		}
+	}
+
+	/* stage 3: induce the result for the original problem */
+	if(flags&8) get_counts(T, C, n, k, cs);
+	/* put all left-most S characters into their buckets */
+	if(1<m) {
+		get_buckets(C, B, k, 1); /* find ends of buckets */
+		i=m-1; j=n; p=SA[m-1]; c1=chr(p);
+		do {
+			q=B[c0=c1];
+			while(q<j) SA[--j]=0;
+			do {
+				SA[--j]=p;
+				if(--i<0) break;
+				p=SA[i];
+			} while((c1=chr(p))==c0);
+		} while(0<=i);
+		while(0<j) SA[--j]=0;
+	}
+	induce_sa(T, SA, C, B, n, k, cs);
+
+	if(flags&(1|4)) free(C);
+	if(flags&2) free(B);
+
+	return 0;
+}
+
+/**
+ * build the suffix array of T[0..n-1] into SA[0..n-1].
+ * @returns 0 on success, negative on allocation failure.
+ */
+int sais(const unsigned char *T, int32_t *SA, int32_t n) {
+	if(!T || !SA || n<0) return -1;
+	if(n<=1) {
+		if(n==1) SA[0]=0;
+		return 0;
+	}
+	return sais_main(T, SA, 0, n, 256, 1);
+}
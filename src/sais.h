@@ -0,0 +1,8 @@
+/* sais.h
+ * linear time suffix array construction.
+ */
+#ifndef SAIS_H
+#define SAIS_H
+#include <stdint.h>
+int sais(const unsigned char *T, int32_t *SA, int32_t n);
+#endif
@@ -1,11 +1,18 @@
 /* util.c
  */
+#define _GNU_SOURCE /* copy_file_range() */
 #include <assert.h>
 #include <errno.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #include "util.h"
 #include "log.h"
 
@@ -28,6 +35,16 @@ int make_file_name(char *dest, size_t max, const char *orig, const char *newext)
 	return 1;
 }
 
+/* dir/name.ext -> dir/name<suffix>.ext. return non-zero on success */
+int make_suffixed_name(char *dest, size_t max, const char *orig, const char *suffix) {
+	const char *ext=file_extension(orig);
+	int len=ext?(int)(ext-orig):(int)strlen(orig);
+	int res;
+
+	res=snprintf(dest, max, "%.*s%s%s", len, orig, suffix, ext?ext:"");
+	return res>=0 && (size_t)res<max;
+}
+
 /**
  * get size of file in bytes
  * @returns -1 on error, >=0 on success
@@ -66,4 +83,118 @@ const char *file_extension(const char *filename) {
 	return tmp; /* return the extension including the . */
 }
 
+/**
+ * map an entire file read-only.
+ * @returns pointer to the contents and the size in len, or NULL on error.
+ */
+void *map_file(const char *filename, size_t *len) {
+	static unsigned char empty[1];
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd=open(filename, O_RDONLY);
+	if(fd<0) {
+		PERROR(filename);
+		return NULL;
+	}
+	if(fstat(fd, &st)!=0) {
+		PERROR(filename);
+		close(fd);
+		return NULL;
+	}
+
+	*len=st.st_size;
+	if(!*len) { /* mmap() refuses empty mappings */
+		close(fd);
+		return empty;
+	}
+
+	p=mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(p==MAP_FAILED) {
+		PERROR(filename);
+		return NULL;
+	}
+
+	return p;
+}
+
+/**
+ * release a mapping made by map_file().
+ */
+void unmap_file(void *p, size_t len) {
+	if(p && len)
+		munmap(p, len);
+}
 
+/* errors that mean the kernel can't do this copy, but a plain one may work */
+static int copy_unsupported(int e) {
+	return e==ENOSYS || e==EXDEV || e==EINVAL || e==EOPNOTSUPP;
+}
+
+/**
+ * copy len bytes at offset in_ofs of in_fd to the current position of
+ * out_fd. uses copy_file_range() or sendfile() so the data stays in the
+ * kernel, falling back to a read/write loop.
+ * @returns non-zero on success
+ */
+int copy_fd_range(const char *filename, int in_fd, off_t in_ofs, int out_fd, size_t len) {
+	char buf[32768];
+	ssize_t res;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while(len>0) {
+		res=copy_file_range(in_fd, &in_ofs, out_fd, NULL, len, 0);
+		if(res<0 && errno==EINTR) continue;
+		if(res<0 && copy_unsupported(errno)) break;
+		if(res<0) {
+			PERROR(filename);
+			return 0;
+		}
+		if(res==0) goto short_read;
+		len-=res;
+	}
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+	while(len>0) {
+		res=sendfile(out_fd, in_fd, &in_ofs, len);
+		if(res<0 && errno==EINTR) continue;
+		if(res<0 && copy_unsupported(errno)) break;
+		if(res<0) {
+			PERROR(filename);
+			return 0;
+		}
+		if(res==0) goto short_read;
+		len-=res;
+	}
+#endif
+	while(len>0) {
+		char *p=buf;
+
+		res=pread(in_fd, buf, len<sizeof buf?len:sizeof buf, in_ofs);
+		if(res<0 && errno==EINTR) continue;
+		if(res<0) {
+			PERROR(filename);
+			return 0;
+		}
+		if(res==0) goto short_read;
+		in_ofs+=res;
+		len-=res;
+		while(res>0) {
+			ssize_t w=write(out_fd, p, res);
+			if(w<0 && errno==EINTR) continue;
+			if(w<0) {
+				PERROR(filename);
+				return 0;
+			}
+			p+=w;
+			res-=w;
+		}
+	}
+
+	return 1;
+short_read:
+	fprintf(stderr, "%s:short read while copying.\n", filename);
+	return 0;
+}
@@ -2,7 +2,12 @@
 #define UTIL_H
 #include <stddef.h>
 #include <stdio.h>
+#include <sys/types.h>
 int make_file_name(char *dest, size_t max, const char *orig, const char *newext);
+int make_suffixed_name(char *dest, size_t max, const char *orig, const char *suffix);
 long filesize(const char *filename, FILE *f);
 const char *file_extension(const char *filename);
+void *map_file(const char *filename, size_t *len);
+void unmap_file(void *p, size_t len);
+int copy_fd_range(const char *filename, int in_fd, off_t in_ofs, int out_fd, size_t len);
 #endif